@@ -20,7 +20,8 @@ function(build_tracer_bitcode TEST_NAME f_SRC WORKLOAD)
 
   # Add ZLIB location.
   get_filename_component(ZLIB_LIB_DIR ${ZLIB_LIBRARIES} DIRECTORY)
-  set(FINAL_CXX_LDFLAGS "-lm" "-L${ZLIB_LIB_DIR}" "-lz" "-lpthread")
+  set(FINAL_CXX_LDFLAGS "-lm" "-L${ZLIB_LIB_DIR}" "-lz" "-lpthread" "-lrt" "-ldl"
+      ${TRACER_CODEC_LIBRARIES})
 
   set(LLVMC_FLAGS ${LLVMC_FLAGS} ${CFLAGS})
   build_llvm_bitcode(${TEST_NAME} ${f_SRC})
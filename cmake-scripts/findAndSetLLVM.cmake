@@ -36,6 +36,26 @@ SET(REQ_LLVM_LIBRARIES ${LLVM_LIBS})
 # through apt and other package managers.
 find_package(ZLIB 1.2.10 REQUIRED)
 
+# zstd and lz4 trace compression are optional, and are built in if their
+# libraries are found. TRACER_CODEC_FLAGS and TRACER_CODEC_LIBRARIES are added
+# to everything that compresses or reads traces.
+set(TRACER_CODEC_FLAGS "")
+set(TRACER_CODEC_LIBRARIES "")
+find_path(ZSTD_INCLUDE_DIR zstd.h)
+find_library(ZSTD_LIBRARY zstd)
+if(ZSTD_INCLUDE_DIR AND ZSTD_LIBRARY)
+  message(STATUS "Found zstd: ${ZSTD_LIBRARY}")
+  list(APPEND TRACER_CODEC_FLAGS "-DLLVMTRACER_HAS_ZSTD" "-I${ZSTD_INCLUDE_DIR}")
+  list(APPEND TRACER_CODEC_LIBRARIES ${ZSTD_LIBRARY})
+endif()
+find_path(LZ4_INCLUDE_DIR lz4frame.h)
+find_library(LZ4_LIBRARY lz4)
+if(LZ4_INCLUDE_DIR AND LZ4_LIBRARY)
+  message(STATUS "Found lz4: ${LZ4_LIBRARY}")
+  list(APPEND TRACER_CODEC_FLAGS "-DLLVMTRACER_HAS_LZ4" "-I${LZ4_INCLUDE_DIR}")
+  list(APPEND TRACER_CODEC_LIBRARIES ${LZ4_LIBRARY})
+endif()
+
 # For debug use only
 if(${TEST_CMAKE})
   message("debug messages below")
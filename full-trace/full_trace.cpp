@@ -20,6 +20,9 @@
 #include "llvm/IR/Metadata.h"
 #include "llvm/IR/Type.h"
 #include "llvm/Support/CommandLine.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
 
 #include "full_trace.h"
 
@@ -58,6 +61,40 @@ cl::opt<bool>
                              "function can act as a \"top-level\" function."),
                     cl::init(false), cl::ValueDisallowed);
 
+cl::opt<bool>
+    staticInstTable("static-inst-table",
+                    cl::desc("Store everything that is known about each "
+                             "instrumented instruction at compile time in a "
+                             "static record table, and only log the record "
+                             "ID and the dynamic operand values at runtime."),
+                    cl::init(false), cl::ValueDisallowed);
+
+cl::opt<bool>
+    logPerBlock("log-per-block",
+                cl::desc("Log each basic block with as few calls as "
+                         "possible: one per call instruction it contains, "
+                         "plus one at its end. Implies -static-inst-table."),
+                cl::init(false), cl::ValueDisallowed);
+
+cl::opt<bool>
+    inlineLogGuard("inline-log-guard",
+                   cl::desc("Check whether the tracer is logging inline, "
+                            "and branch around the logging calls when it is "
+                            "not, so that untraced code runs at close to "
+                            "native speed."),
+                   cl::init(false), cl::ValueDisallowed);
+
+cl::opt<bool>
+    nativeClones("native-clones",
+                 cl::desc("In top-level mode, keep an uninstrumented clone "
+                          "of every instrumented function, and only run the "
+                          "instrumented top-level function for the "
+                          "invocations selected at runtime by "
+                          "LLVMTRACER_INVOCATIONS."),
+                 cl::init(false), cl::ValueDisallowed);
+
+static bool useStaticInstTable() { return staticInstTable || logPerBlock; }
+
 namespace {
 
 void split(const std::string &s, const char delim,
@@ -152,6 +189,28 @@ static Constant *createStringArg(const char *string, Module *curr_module) {
     return ConstantExpr::getGetElementPtr(ArrayTy_0, gvar_array, indices);
 }
 
+// If value points to a constant C string, return the string in str.
+//
+// TODO: this only works for constant expression strings, but not for mutable
+// strings.
+static bool getConstantString(Value *value, StringRef &str) {
+  IntegerType *itype =
+      dyn_cast<IntegerType>(value->getType()->getPointerElementType());
+  if (!itype || itype->getBitWidth() != 8)
+    return false;
+  ConstantExpr *ce = dyn_cast<ConstantExpr>(value);
+  if (!ce)
+    return false;
+  GlobalVariable *gv = dyn_cast<GlobalVariable>(ce->getOperand(0));
+  if (!gv || !gv->hasInitializer())
+    return false;
+  ConstantDataArray *array = dyn_cast<ConstantDataArray>(gv->getInitializer());
+  if (!array || !array->isCString())
+    return false;
+  str = array->getAsCString();
+  return true;
+}
+
 int getMemSize(Type *T) {
   int size = 0;
   if (T->isPointerTy())
@@ -208,7 +267,10 @@ int getMemSize(Type *T) {
   return size;
 }
 
-Tracer::Tracer() : FunctionPass(ID) {}
+Tracer::Tracer()
+    : FunctionPass(ID), logging_enabled(nullptr), module_desc(nullptr),
+      num_static_records(0),
+      num_static_segments(0), static_values(nullptr), num_static_slots(0) {}
 
 bool Tracer::doInitialization(Module &M) {
   std::set<std::string> user_workloads = getUserWorkloadFunctions();
@@ -224,31 +286,79 @@ bool Tracer::doInitialization(Module &M) {
   auto VoidTy = Type::getVoidTy(llvm_context);
   auto DoubleTy = Type::getDoubleTy(llvm_context);
 
+  // struct trace_module { i64 string_base; i64 num_strings;
+  //                       i8** strings; trace_module* next;
+  //                       i8* static_table; i64 static_table_size;
+  //                       i64 record_base; i8* records;
+  //                       i32* loops; i64 num_loops; }
+  trace_module_ty = StructType::create(llvm_context, "struct.trace_module");
+  trace_module_ty->setBody({ I64Ty, I64Ty, I8PtrTy->getPointerTo(),
+                             trace_module_ty->getPointerTo(), I8PtrTy, I64Ty,
+                             I64Ty, I8PtrTy,
+                             Type::getInt32PtrTy(llvm_context), I64Ty });
+  auto ModulePtrTy = trace_module_ty->getPointerTo();
+  // The initializer is filled in once the string table is complete.
+  module_desc = new GlobalVariable(M, trace_module_ty, false,
+                                   GlobalValue::InternalLinkage,
+                                   Constant::getNullValue(trace_module_ty),
+                                   "llvmtracer.module");
+
   // Add external trace_logger function declarations.
   TL_log_entry = M.getOrInsertFunction("trace_logger_log_entry", VoidTy,
-                                       I8PtrTy, I64Ty);
+                                       ModulePtrTy, I64Ty, I64Ty);
 
+  // The last arguments of these are the prebuilt text of the line (see
+  // printFirstLine() and printParamLine()).
   TL_log0 = M.getOrInsertFunction( "trace_logger_log0", VoidTy,
-      I64Ty, I8PtrTy, I8PtrTy, I8PtrTy, I64Ty, I1Ty, I1Ty);
+      ModulePtrTy, I64Ty, I64Ty, I64Ty, I64Ty, I64Ty, I1Ty, I1Ty, I8PtrTy,
+      I64Ty);
 
   TL_log_int = M.getOrInsertFunction( "trace_logger_log_int", VoidTy,
-      I64Ty, I64Ty, I64Ty, I64Ty, I8PtrTy, I64Ty, I8PtrTy);
+      ModulePtrTy, I64Ty, I64Ty, I64Ty, I64Ty, I64Ty, I64Ty, I64Ty, I8PtrTy,
+      I64Ty, I64Ty);
 
   TL_log_ptr = M.getOrInsertFunction( "trace_logger_log_ptr", VoidTy,
-      I64Ty, I64Ty, I64Ty, I64Ty, I8PtrTy, I64Ty, I8PtrTy);
+      ModulePtrTy, I64Ty, I64Ty, I64Ty, I64Ty, I64Ty, I64Ty, I64Ty, I8PtrTy,
+      I64Ty, I64Ty);
 
-  TL_log_string =
-      M.getOrInsertFunction("trace_logger_log_string", VoidTy, I64Ty, I64Ty,
-                            I8PtrTy, I64Ty, I8PtrTy, I64Ty, I8PtrTy);
+  TL_log_string = M.getOrInsertFunction( "trace_logger_log_string", VoidTy,
+      ModulePtrTy, I64Ty, I64Ty, I64Ty, I64Ty, I64Ty, I64Ty, I64Ty, I8PtrTy,
+      I64Ty, I64Ty);
 
   TL_log_double = M.getOrInsertFunction( "trace_logger_log_double", VoidTy,
-      I64Ty, I64Ty, DoubleTy, I64Ty, I8PtrTy, I64Ty, I8PtrTy);
+      ModulePtrTy, I64Ty, I64Ty, DoubleTy, I64Ty, I64Ty, I64Ty, I64Ty,
+      I8PtrTy, I64Ty, I64Ty);
 
   TL_log_vector = M.getOrInsertFunction( "trace_logger_log_vector", VoidTy,
-      I64Ty, I64Ty, I8PtrTy, I64Ty, I8PtrTy, I64Ty, I8PtrTy);
+      ModulePtrTy, I64Ty, I64Ty, I8PtrTy, I64Ty, I64Ty, I64Ty, I64Ty, I8PtrTy,
+      I64Ty, I64Ty);
 
   TL_update_status = M.getOrInsertFunction("trace_logger_update_status", VoidTy,
-                                           I8PtrTy, I64Ty, I1Ty, I1Ty);
+                                           ModulePtrTy, I64Ty, I64Ty, I1Ty,
+                                           I1Ty);
+
+  TL_register_module = M.getOrInsertFunction("trace_logger_register_module",
+                                             VoidTy, ModulePtrTy);
+
+  TL_log_static = M.getOrInsertFunction("trace_logger_log_static", VoidTy,
+                                        ModulePtrTy, I64Ty,
+                                        I64Ty->getPointerTo());
+
+  TL_log_block = M.getOrInsertFunction("trace_logger_log_block", VoidTy,
+                                       ModulePtrTy, I64Ty,
+                                       I64Ty->getPointerTo());
+
+  TL_trace_invocation = M.getOrInsertFunction(
+      "trace_logger_trace_invocation", I1Ty, ModulePtrTy, I64Ty);
+
+  if (inlineLogGuard) {
+    // The runtime is linked into the instrumented executable, so its TLS
+    // can use the initial-exec model.
+    logging_enabled = new GlobalVariable(
+        M, Type::getInt8Ty(llvm_context), false, GlobalValue::ExternalLinkage,
+        nullptr, "trace_logger_logging_enabled", nullptr,
+        GlobalValue::InitialExecTLSModel);
+  }
 
   // We will instrument in top level mode if there is only one workload
   // function or if explicitly told to do so.
@@ -291,7 +401,215 @@ bool Tracer::doInitialization(Module &M) {
     }
   }
 
-  return false;
+  if (nativeClones) {
+    if (is_toplevel_mode)
+      createNativeClones(M);
+    else
+      errs() << "[WARNING]: -native-clones only applies in top-level mode.\n";
+  }
+
+  return !native_clones.empty();
+}
+
+void Tracer::createNativeClones(Module &M) {
+  std::vector<Function*> funcs;
+  for (Function &F : M) {
+    // Only clone the functions that runOnFunction() will instrument.
+    if (F.isDeclaration() || F.isVarArg() || F.getName() == "main")
+      continue;
+    // Forwarding an inalloca argument needs a musttail call, which the
+    // dispatch block cannot make (like varargs above), so these are always
+    // traced.
+    bool has_inalloca = false;
+    for (Argument &arg : F.args())
+      has_inalloca |= arg.hasInAllocaAttr();
+    if (has_inalloca)
+      continue;
+    auto it = mangledNameMap.find(F.getName());
+    if (it == mangledNameMap.end() || it->second != F.getName())
+      continue;
+    const std::string &funcName = F.getName().str();
+    if (isDmaFunction(funcName) || isHostMemFunction(funcName) ||
+        isSetSamplingFactor(funcName))
+      continue;
+    funcs.push_back(&F);
+  }
+
+  for (Function *F : funcs) {
+    ValueToValueMapTy VMap;
+    Function *clone = CloneFunction(F, VMap);
+    clone->setName(F->getName() + ".native");
+    clone->setLinkage(GlobalValue::InternalLinkage);
+    native_clones[F] = clone;
+  }
+
+  for (auto &clone : native_clones) {
+    for (BasicBlock &BB : *clone.second) {
+      for (Instruction &I : BB) {
+        CallInst *call = dyn_cast<CallInst>(&I);
+        if (!call || !call->getCalledFunction())
+          continue;
+        Function *callee = call->getCalledFunction();
+        auto it = native_clones.find(callee);
+        if (it != native_clones.end() &&
+            !isTrackedFunction(callee->getName().str()))
+          call->setCalledFunction(it->second);
+      }
+    }
+  }
+}
+
+void Tracer::insertNativeDispatch(Function &F, Function *native) {
+  LLVMContext &llvm_context = F.getContext();
+  BasicBlock *old_entry = &F.getEntryBlock();
+  BasicBlock *dispatch_bb = BasicBlock::Create(
+      llvm_context, "llvmtracer.dispatch", &F, old_entry);
+  BasicBlock *native_bb =
+      BasicBlock::Create(llvm_context, "llvmtracer.native", &F, old_entry);
+
+  IRBuilder<> IRB(dispatch_bb);
+  Value *args[] = { module_desc, createStringIdIfNotExists(
+                                     F.getName().str().c_str()) };
+  Instruction *trace_it = IRB.CreateCall(TL_trace_invocation, args);
+  IRB.CreateCondBr(trace_it, old_entry, native_bb);
+
+  // Static allocas (including the tracer's own buffers) must stay in the
+  // entry block.
+  std::vector<AllocaInst*> allocas;
+  for (Instruction &I : *old_entry) {
+    AllocaInst *alloca = dyn_cast<AllocaInst>(&I);
+    if (alloca && isa<Constant>(alloca->getArraySize()))
+      allocas.push_back(alloca);
+  }
+  for (AllocaInst *alloca : allocas)
+    alloca->moveBefore(trace_it);
+
+  IRB.SetInsertPoint(native_bb);
+  std::vector<Value*> native_args;
+  for (Argument &arg : F.args())
+    native_args.push_back(&arg);
+  CallInst *call = IRB.CreateCall(native, native_args);
+  // The clone has the same ABI as F, so byval, sret, zeroext and so on must
+  // be passed the same way.
+  call->setCallingConv(F.getCallingConv());
+  call->setAttributes(F.getAttributes());
+  // Calls to functions with debug info need a location.
+  if (DISubprogram *SP = F.getSubprogram())
+    call->setDebugLoc(DebugLoc::get(SP->getLine(), 0, SP));
+  if (F.getReturnType()->isVoidTy())
+    IRB.CreateRetVoid();
+  else
+    IRB.CreateRet(call);
+}
+
+bool Tracer::doFinalization(Module &M) {
+  if (!module_desc)
+    return false;
+  if (string_table.empty()) {
+    // Nothing in this module was instrumented.
+    module_desc->eraseFromParent();
+    module_desc = nullptr;
+    return true;
+  }
+  emitModuleTables(M);
+  return true;
+}
+
+void Tracer::emitModuleTables(Module &M) {
+  auto &llvm_context = M.getContext();
+  auto I64Ty = Type::getInt64Ty(llvm_context);
+  auto I8PtrTy = Type::getInt8PtrTy(llvm_context);
+
+  ArrayType *table_ty = ArrayType::get(I8PtrTy, string_table.size());
+  GlobalVariable *table = new GlobalVariable(
+      M, table_ty, true, GlobalValue::PrivateLinkage,
+      ConstantArray::get(table_ty, string_table), "llvmtracer.strings");
+  Constant *zero = ConstantInt::get(I64Ty, 0);
+  Constant *indices[] = { zero, zero };
+
+  Constant *static_table_ptr = ConstantPointerNull::get(I8PtrTy);
+  uint64_t static_table_size = 0;
+  if (num_static_records) {
+    std::string blob;
+    append_static_field<uint32_t>(blob, num_static_records);
+    blob += static_table;
+    append_static_field<uint32_t>(blob, num_static_segments);
+    blob += static_segments;
+    static_table_size = blob.size();
+    Constant *data = ConstantDataArray::get(
+        llvm_context, ArrayRef<uint8_t>(
+                          reinterpret_cast<const uint8_t *>(blob.data()),
+                          blob.size()));
+    GlobalVariable *static_table_var =
+        new GlobalVariable(M, data->getType(), true,
+                           GlobalValue::PrivateLinkage, data,
+                           "llvmtracer.static_table");
+    static_table_ptr = ConstantExpr::getGetElementPtr(
+        data->getType(), static_table_var, indices);
+  }
+
+  Constant *loop_table_ptr =
+      ConstantPointerNull::get(Type::getInt32PtrTy(llvm_context));
+  if (!loop_table.empty()) {
+    Constant *data = ConstantDataArray::get(llvm_context,
+                                            ArrayRef<uint32_t>(loop_table));
+    GlobalVariable *loop_table_var =
+        new GlobalVariable(M, data->getType(), true,
+                           GlobalValue::PrivateLinkage, data,
+                           "llvmtracer.loops");
+    loop_table_ptr = ConstantExpr::getGetElementPtr(
+        data->getType(), loop_table_var, indices);
+  }
+
+  Constant *fields[] = {
+    zero, ConstantInt::get(I64Ty, string_table.size()),
+    ConstantExpr::getGetElementPtr(table_ty, table, indices),
+    ConstantPointerNull::get(trace_module_ty->getPointerTo()),
+    static_table_ptr, ConstantInt::get(I64Ty, static_table_size), zero,
+    ConstantPointerNull::get(I8PtrTy), loop_table_ptr,
+    ConstantInt::get(I64Ty, loop_table.size() / TRACE_LOOP_ROW_SIZE)
+  };
+  module_desc->setInitializer(ConstantStruct::get(trace_module_ty, fields));
+
+  // Register the module from a constructor so that its strings have global
+  // IDs before any instrumented code runs.
+  Function *ctor = Function::Create(
+      FunctionType::get(Type::getVoidTy(llvm_context), false),
+      GlobalValue::InternalLinkage, "llvmtracer.register_module", &M);
+  IRBuilder<> IRB(BasicBlock::Create(llvm_context, "entry", ctor));
+  IRB.CreateCall(TL_register_module, module_desc);
+  IRB.CreateRetVoid();
+  appendToGlobalCtors(M, ctor, 0);
+}
+
+void Tracer::addLoopToTable(Loop *loop) {
+  DebugLoc start = loop->getStartLoc();
+  // Loops without debug info cannot be matched to a label.
+  if (!start)
+    return;
+  char id[InstEnv::BUF_SIZE];
+  uint32_t row[TRACE_LOOP_ROW_SIZE];
+  row[0] = getStringId(curr_function->getName().str().c_str());
+  row[1] = start.getLine();
+  makeValueId(loop->getHeader(), id);
+  row[2] = getStringId(id);
+
+  SmallVector<BasicBlock *, 4> latches;
+  loop->getLoopLatches(latches);
+  SmallVector<BasicBlock *, 4> exits;
+  loop->getUniqueExitBlocks(exits);
+  for (BasicBlock *bb : latches) {
+    makeValueId(bb, id);
+    row[3] = LOOP_LATCH;
+    row[4] = getStringId(id);
+    loop_table.insert(loop_table.end(), row, row + TRACE_LOOP_ROW_SIZE);
+  }
+  for (BasicBlock *bb : exits) {
+    makeValueId(bb, id);
+    row[3] = LOOP_EXIT;
+    row[4] = getStringId(id);
+    loop_table.insert(loop_table.end(), row, row + TRACE_LOOP_ROW_SIZE);
+  }
 }
 
 std::set<std::string> Tracer::getUserWorkloadFunctions() const {
@@ -320,6 +638,8 @@ bool Tracer::runOnFunction(Function &F) {
   slotToVarName.clear();
   // Stack allocated buffers can't be reused across functions of course.
   vector_buffers.clear();
+  static_values = nullptr;
+  num_static_slots = 0;
 
   // Collect debug info before adding any instrumentation.
   //
@@ -344,12 +664,36 @@ bool Tracer::runOnFunction(Function &F) {
           preheaderLineNum[PHeadInst] = loop->getStartLoc().getLine();
   }
 
+  // Record every loop of the function by the line it starts on, so that the
+  // runtime can find the loop of a label (see LLVMTRACER_LOOP_LABEL).
+  if (is_toplevel_mode || isTrackedFunction(F.getName().str())) {
+    for (auto bb_it = F.begin(); bb_it != F.end(); ++bb_it) {
+      Loop *loop = LI.getLoopFor(&*bb_it);
+      if (loop && loop->getHeader() == &*bb_it)
+        addLoopToTable(loop);
+    }
+  }
+
   for (auto bb_it = F.begin(); bb_it != F.end(); ++bb_it) {
     BasicBlock& bb = *bb_it;
     func_modified = runOnBasicBlock(bb);
   }
   if (F.getName() != "main")
     func_modified |= runOnFunctionEntry(F);
+  if (static_values) {
+    static_values->setOperand(
+        0, ConstantInt::get(Type::getInt64Ty(F.getContext()),
+                            num_static_slots));
+  }
+  if (inlineLogGuard && func_modified)
+    guardLoggingCalls(F);
+  if (is_toplevel_mode && isTrackedFunction(F.getName().str())) {
+    auto clone = native_clones.find(&F);
+    if (clone != native_clones.end()) {
+      insertNativeDispatch(F, clone->second);
+      func_modified = true;
+    }
+  }
 
   purgeDebugInfo();
   delete st;
@@ -395,8 +739,10 @@ bool Tracer::runOnBasicBlock(BasicBlock &BB) {
     // value. LLVM-Tracer only supports instrumentation of C code (although that
     // code can live in a C++ file). This kind of behavior is thus unsupported
     // and does not need any instrumentation.
-    if (isa<InvokeInst>(*itr))
+    if (isa<InvokeInst>(*itr)) {
+      flushSegment();
       continue;
+    }
 
     // Get static BasicBlock ID: produce bbid
     makeValueId(&BB, env.bbid);
@@ -412,6 +758,7 @@ bool Tracer::runOnBasicBlock(BasicBlock &BB) {
       // pointer). This cannot happen for code that we want to turn into
       // hardware, so skip it.
       if (!called_func) {
+        flushSegment();
         continue;
       }
       const std::string &called_func_name = called_func->getName().str();
@@ -432,11 +779,16 @@ bool Tracer::runOnBasicBlock(BasicBlock &BB) {
         traceCall = false;
       }
     }
-    if (!traceCall)
+    if (!traceCall) {
+      // Calls we do not trace may still reach instrumented code.
+      if (!isa<IntrinsicInst>(currInst))
+        flushSegment();
       continue;
+    }
 
     if (isa<CallInst>(currInst) && traceCall) {
       handleCallInstruction(currInst, &env);
+      flushSegment();
     } else {
       handleNonPhiNonCallInstruction(currInst, &env);
     }
@@ -449,7 +801,9 @@ bool Tracer::runOnBasicBlock(BasicBlock &BB) {
     if (isa<AllocaInst>(currInst)) {
       processAllocaInstruction(itr);
     }
+    flushStaticRecord();
   }
+  flushSegment();
 
   // Conservatively assume that we changed the basic block.
   return true;
@@ -466,6 +820,10 @@ bool Tracer::runOnFunctionEntry(Function& func) {
   // insert instrumentation before an alloca instruction we attempt to reuse.
   for (; insertp != first_bb->end();) {
     if (AllocaInst* alloca = dyn_cast<AllocaInst>(insertp)) {
+      if (alloca == static_values) {
+        ++insertp;
+        continue;
+      }
       Type* allocated_type = alloca->getAllocatedType();
       if (allocated_type->isVectorTy()) {
         // There can only be one alloca instruction for a given vector type in
@@ -520,6 +878,7 @@ bool Tracer::runOnFunctionEntry(Function& func) {
 
     printParamLine(insertPointInst, &params);
   }
+  flushSegment();
 
   return true;
 }
@@ -614,56 +973,68 @@ void Tracer::printParamLine(Instruction *I, int param_num, const char *reg_id,
                             const char *bbId, Type::TypeID datatype,
                             unsigned datasize, Value *value, bool is_reg,
                             bool is_intrinsic, const char *prev_bbid) {
-  IRBuilder<> IRB(I);
   bool is_phi = (bbId != nullptr && strcmp(bbId, "phi") == 0);
+  if (useStaticInstTable()) {
+    printStaticParamLine(I, param_num, reg_id, is_phi, datatype, datasize,
+                         value, is_reg, is_intrinsic, prev_bbid);
+    return;
+  }
+  IRBuilder<> IRB(I);
   Value *v_param_num = ConstantInt::get(IRB.getInt64Ty(), param_num);
   Value *v_size = ConstantInt::get(IRB.getInt64Ty(), datasize);
   Value *v_is_reg = ConstantInt::get(IRB.getInt64Ty(), is_reg);
   Value *v_is_phi = ConstantInt::get(IRB.getInt64Ty(), is_phi);
-  Constant *vv_reg_id = createStringArgIfNotExists(reg_id);
-  Constant *vv_prev_bbid = createStringArgIfNotExists(prev_bbid);
+  Constant *vv_reg_id = createStringIdIfNotExists(reg_id);
+  Constant *vv_prev_bbid = createStringIdIfNotExists(prev_bbid);
+
+  // Everything on the line but the value is the same every time, so the
+  // text before and after the value is built here, once.
+  std::string prefix;
+  if (param_num == RESULT_LINE)
+    prefix = "r";
+  else if (param_num == FORWARD_LINE)
+    prefix = "f";
+  else
+    prefix = std::to_string(param_num);
+  prefix += "," + std::to_string(datasize) + ",";
+  std::string suffix = "," + std::to_string(is_reg) + ",";
+  suffix += is_reg ? reg_id : " ";
+  if (is_phi)
+    suffix += std::string(",") + prev_bbid;
+  suffix += ",\n";
+  Constant *v_text = createStringArgIfNotExists((prefix + suffix).c_str());
+  Value *v_prefix_size = ConstantInt::get(IRB.getInt64Ty(), prefix.size());
+  Value *v_suffix_size = ConstantInt::get(IRB.getInt64Ty(), suffix.size());
 
   if (value != nullptr) {
     if (datatype == llvm::Type::IntegerTyID) {
       Value *v_value = IRB.CreateZExt(value, IRB.getInt64Ty());
-      Value *args[] = { v_param_num,    v_size,   v_value,     v_is_reg,
-                        vv_reg_id, v_is_phi, vv_prev_bbid };
+      Value *args[] = { module_desc, v_param_num,   v_size,   v_value,
+                        v_is_reg,    vv_reg_id,     v_is_phi, vv_prev_bbid,
+                        v_text,      v_prefix_size, v_suffix_size };
       IRB.CreateCall(TL_log_int, args);
     } else if (datatype >= llvm::Type::HalfTyID &&
                datatype <= llvm::Type::PPC_FP128TyID) {
       Value *v_value = IRB.CreateFPExt(value, IRB.getDoubleTy());
-      Value *args[] = { v_param_num,    v_size,   v_value,     v_is_reg,
-                        vv_reg_id, v_is_phi, vv_prev_bbid };
+      Value *args[] = { module_desc, v_param_num,   v_size,   v_value,
+                        v_is_reg,    vv_reg_id,     v_is_phi, vv_prev_bbid,
+                        v_text,      v_prefix_size, v_suffix_size };
       IRB.CreateCall(TL_log_double, args);
     } else if (datatype == llvm::Type::PointerTyID) {
       Value *v_value = nullptr;
-      Type *pteetype = value->getType()->getPointerElementType();
+      StringRef str;
       bool is_string = false;
       if (is_intrinsic) {
         v_value = ConstantInt::get(IRB.getInt64Ty(), 0);
+      } else if (getConstantString(value, str)) {
+        v_value = createStringIdIfNotExists(str.str().c_str());
+        is_string = true;
       } else {
         v_value = IRB.CreatePtrToInt(value, IRB.getInt64Ty());
-        // If the pointee type is 8-bit integer, get the string.
-        // TODO: the code below only works for constant expressio strings, but
-        // not for mutable strings.
-        if (IntegerType *itype = dyn_cast<IntegerType>(pteetype)) {
-          if (itype->getBitWidth() == 8) {
-            if (ConstantExpr *ce = dyn_cast<ConstantExpr>(value)) {
-              if (GlobalVariable *gv =
-                      dyn_cast<GlobalVariable>(ce->getOperand(0))) {
-                if (ConstantDataArray *array =
-                        dyn_cast<ConstantDataArray>(gv->getInitializer())) {
-                  v_value =
-                      createStringArgIfNotExists(array->getAsCString().data());
-                  is_string = true;
-                }
-              }
-            }
-          }
-        }
       }
-      Value *args[] = { v_param_num, v_size,   v_value,     v_is_reg,
-                        vv_reg_id,   v_is_phi, vv_prev_bbid };
+      Value *args[] = { module_desc, v_param_num,   v_size,   v_value,
+                        v_is_reg,    vv_reg_id,     v_is_phi, vv_prev_bbid,
+                        v_text,      v_prefix_size, v_suffix_size };
       if (is_string)
         IRB.CreateCall(TL_log_string, args);
       else
@@ -672,34 +1043,304 @@ void Tracer::printParamLine(Instruction *I, int param_num, const char *reg_id,
       // Give the logger function a pointer to the data. We'll read it out in
       // the logger function itself.
       Value *v_value = createVectorArg(value, IRB);
-      Value *args[] = { v_param_num,    v_size,   v_value,     v_is_reg,
-                        vv_reg_id, v_is_phi, vv_prev_bbid };
+      Value *args[] = { module_desc, v_param_num,   v_size,   v_value,
+                        v_is_reg,    vv_reg_id,     v_is_phi, vv_prev_bbid,
+                        v_text,      v_prefix_size, v_suffix_size };
       IRB.CreateCall(TL_log_vector, args);
     } else {
-      errs() << "[WARNING]: Encountered unhandled datatype ";
-      if (datatype == Type::FunctionTyID) {
-        errs() << "FunctionType";
-      } else if (datatype == Type::StructTyID) {
-        errs() << "StructType";
-      } else if (datatype == Type::ArrayTyID) {
-        errs() << "ArrayType";
-      } else if (datatype == Type::TokenTyID) {
-        errs() << "ArrayType";
-      } else {
-        Type* t = Type::getPrimitiveType(curr_module->getContext(), datatype);
-        errs() << *t;
-      }
-      errs() << " on variable " << reg_id << "\n";
+      warnUnhandledDatatype(datatype, reg_id);
     }
   } else {
     Value *v_value = ConstantInt::get(IRB.getInt64Ty(), 0);
-    Value *args[] = { v_param_num,    v_size,   v_value,     v_is_reg,
-                      vv_reg_id, v_is_phi, vv_prev_bbid };
+    Value *args[] = { module_desc, v_param_num,   v_size,   v_value,
+                      v_is_reg,    vv_reg_id,     v_is_phi, vv_prev_bbid,
+                      v_text,      v_prefix_size, v_suffix_size };
     IRB.CreateCall(TL_log_int, args);
   }
 }
 
+bool Tracer::isGuardedLoggingInst(Instruction *I,
+                                  const std::set<Instruction*> &in_run) {
+  if (CallInst *call = dyn_cast<CallInst>(I)) {
+    // Status updates and entry lines must always reach the runtime, since
+    // they are what turns logging on.
+    Value *callee = call->getCalledValue();
+    return callee == TL_log0 || callee == TL_log_int || callee == TL_log_ptr ||
+           callee == TL_log_string || callee == TL_log_double ||
+           callee == TL_log_vector || callee == TL_log_static ||
+           callee == TL_log_block;
+  }
+  if (StoreInst *store = dyn_cast<StoreInst>(I)) {
+    // Stores into the vector and static value buffers.
+    Value *ptr = store->getPointerOperand();
+    while (true) {
+      if (GetElementPtrInst *gep = dyn_cast<GetElementPtrInst>(ptr))
+        ptr = gep->getPointerOperand();
+      else if (BitCastInst *bitcast = dyn_cast<BitCastInst>(ptr))
+        ptr = bitcast->getOperand(0);
+      else
+        break;
+    }
+    if (ptr == static_values)
+      return true;
+    for (auto &buf : vector_buffers) {
+      if (ptr == buf.second)
+        return true;
+    }
+    return false;
+  }
+  // Logged values are converted with casts and buffer slots are addressed
+  // with GEPs. These can be moved along with the logging calls as long as
+  // they are only used by them.
+  if (!isa<CastInst>(I) && !isa<GetElementPtrInst>(I))
+    return false;
+  for (User *user : I->users()) {
+    if (in_run.find(dyn_cast<Instruction>(user)) == in_run.end())
+      return false;
+  }
+  return true;
+}
+
+void Tracer::guardLoggingCalls(Function &F) {
+  // Find every run of consecutive logging instructions that includes at
+  // least one logging call. Walking backwards sees the users of a value
+  // before the value itself.
+  std::vector<std::vector<Instruction*>> runs;
+  for (BasicBlock &BB : F) {
+    std::vector<Instruction*> run;
+    std::set<Instruction*> in_run;
+    bool has_call = false;
+    for (auto it = BB.rbegin(); it != BB.rend(); ++it) {
+      Instruction *I = &*it;
+      if (isGuardedLoggingInst(I, in_run)) {
+        run.push_back(I);
+        in_run.insert(I);
+        has_call |= isa<CallInst>(I);
+        continue;
+      }
+      if (has_call)
+        runs.emplace_back(run.rbegin(), run.rend());
+      run.clear();
+      in_run.clear();
+      has_call = false;
+    }
+    if (has_call)
+      runs.emplace_back(run.rbegin(), run.rend());
+  }
+
+  for (auto &run : runs) {
+    Instruction *first = run.front();
+    IRBuilder<> IRB(first);
+    Value *is_enabled =
+        IRB.CreateICmpNE(IRB.CreateLoad(logging_enabled), IRB.getInt8(0));
+    TerminatorInst *then_term =
+        SplitBlockAndInsertIfThen(is_enabled, first, false);
+    for (Instruction *I : run)
+      I->moveBefore(then_term);
+  }
+}
+
+void Tracer::warnUnhandledDatatype(Type::TypeID datatype, const char *reg_id) {
+  errs() << "[WARNING]: Encountered unhandled datatype ";
+  if (datatype == Type::FunctionTyID) {
+    errs() << "FunctionType";
+  } else if (datatype == Type::StructTyID) {
+    errs() << "StructType";
+  } else if (datatype == Type::ArrayTyID) {
+    errs() << "ArrayType";
+  } else if (datatype == Type::TokenTyID) {
+    errs() << "ArrayType";
+  } else {
+    Type* t = Type::getPrimitiveType(curr_module->getContext(), datatype);
+    errs() << *t;
+  }
+  errs() << " on variable " << reg_id << "\n";
+}
+
+void Tracer::printStaticParamLine(Instruction *I, int param_num,
+                                  const char *reg_id, bool is_phi,
+                                  Type::TypeID datatype, unsigned datasize,
+                                  Value *value, bool is_reg, bool is_intrinsic,
+                                  const char *prev_bbid) {
+  trace_static_param param;
+  param.line = param_num;
+  param.size = datasize;
+  param.kind = TRACE_REC_INT;
+  param.flags = (is_reg ? PARAM_IS_REG : 0) | (is_phi ? PARAM_IS_PHI : 0);
+  param.label = getStringId(reg_id);
+  param.prev_bbid = getStringId(prev_bbid);
+  param.value = 0;
+
+  // Anything that is not a constant is logged at runtime.
+  Value *dynamic_value = nullptr;
+  if (value != nullptr) {
+    StringRef str;
+    if (datatype == llvm::Type::IntegerTyID) {
+      if (ConstantInt *constant = dyn_cast<ConstantInt>(value))
+        param.value = constant->getValue().zextOrTrunc(64).getZExtValue();
+      else
+        dynamic_value = value;
+    } else if (datatype >= llvm::Type::HalfTyID &&
+               datatype <= llvm::Type::PPC_FP128TyID) {
+      param.kind = TRACE_REC_DOUBLE;
+      if (ConstantFP *constant = dyn_cast<ConstantFP>(value)) {
+        APFloat fp_value = constant->getValueAPF();
+        bool loses_info;
+        fp_value.convert(APFloat::IEEEdouble(), APFloat::rmNearestTiesToEven,
+                         &loses_info);
+        param.value = fp_value.bitcastToAPInt().getZExtValue();
+      } else {
+        dynamic_value = value;
+      }
+    } else if (datatype == llvm::Type::PointerTyID) {
+      param.kind = TRACE_REC_PTR;
+      if (is_intrinsic || isa<ConstantPointerNull>(value)) {
+        param.value = 0;
+      } else if (getConstantString(value, str)) {
+        param.kind = TRACE_REC_STRING;
+        param.value = getStringId(str.str().c_str());
+      } else {
+        dynamic_value = value;
+      }
+    } else if (datatype == llvm::Type::VectorTyID) {
+      param.kind = TRACE_REC_VECTOR;
+      dynamic_value = value;
+    } else {
+      warnUnhandledDatatype(datatype, reg_id);
+      return;
+    }
+  }
+  if (dynamic_value)
+    param.flags |= PARAM_IS_DYNAMIC;
+
+  if (pending_record.insert_point != I) {
+    flushStaticRecord();
+    beginStaticRecord(I, STATIC_PARAMS);
+  }
+  pending_record.params.push_back(param);
+  pending_record.values.push_back(dynamic_value);
+}
+
+void Tracer::beginStaticRecord(Instruction *I, trace_static_kind kind) {
+  assert(!pending_record.insert_point);
+  pending_record.insert_point = I;
+  pending_record.record = trace_static_record();
+  pending_record.record.kind = kind;
+  pending_record.params.clear();
+  pending_record.values.clear();
+}
+
+void Tracer::flushStaticRecord() {
+  Instruction *I = pending_record.insert_point;
+  if (!I)
+    return;
+  pending_record.insert_point = nullptr;
+
+  trace_static_record &record = pending_record.record;
+  record.num_params = pending_record.params.size();
+  encode_static_record(static_table, record);
+  for (const trace_static_param &param : pending_record.params)
+    encode_static_param(static_table, param);
+  unsigned record_id = num_static_records++;
+
+  // Store the dynamic values into consecutive slots of the values buffer,
+  // after those of the earlier records in the segment.
+  IRBuilder<> IRB(I);
+  unsigned slot = pending_segment.num_slots;
+  for (size_t i = 0; i < pending_record.params.size(); i++) {
+    const trace_static_param &param = pending_record.params[i];
+    Value *value = pending_record.values[i];
+    if (!value)
+      continue;
+    Value *v_slot = IRB.CreateConstGEP1_64(getStaticValuesBuffer(), slot);
+    switch (param.kind) {
+      case TRACE_REC_INT:
+        IRB.CreateStore(IRB.CreateZExt(value, IRB.getInt64Ty()), v_slot);
+        break;
+      case TRACE_REC_DOUBLE:
+        IRB.CreateStore(
+            IRB.CreateFPExt(value, IRB.getDoubleTy()),
+            IRB.CreatePointerCast(v_slot, IRB.getDoubleTy()->getPointerTo()));
+        break;
+      case TRACE_REC_PTR:
+        IRB.CreateStore(IRB.CreatePtrToInt(value, IRB.getInt64Ty()), v_slot);
+        break;
+      case TRACE_REC_VECTOR:
+        IRB.CreateAlignedStore(
+            value,
+            IRB.CreatePointerCast(v_slot, value->getType()->getPointerTo()),
+            8);
+        break;
+    }
+    slot += static_param_slots(param);
+  }
+  num_static_slots = std::max(num_static_slots, slot);
+
+  if (logPerBlock) {
+    pending_segment.insert_point = I;
+    pending_segment.records.push_back(record_id);
+    pending_segment.num_slots = slot;
+    return;
+  }
+
+  Value *v_values =
+      slot ? getStaticValuesBuffer()
+           : ConstantPointerNull::get(IRB.getInt64Ty()->getPointerTo());
+  Value *args[] = { module_desc,
+                    ConstantInt::get(IRB.getInt64Ty(), record_id), v_values };
+  IRB.CreateCall(TL_log_static, args);
+}
+
+void Tracer::flushSegment() {
+  flushStaticRecord();
+  if (pending_segment.records.empty())
+    return;
+
+  append_static_field<uint32_t>(static_segments,
+                                pending_segment.records.size());
+  for (uint32_t record_id : pending_segment.records)
+    append_static_field<uint32_t>(static_segments, record_id);
+  unsigned segment_id = num_static_segments++;
+
+  IRBuilder<> IRB(pending_segment.insert_point);
+  Value *v_values =
+      pending_segment.num_slots
+          ? getStaticValuesBuffer()
+          : ConstantPointerNull::get(IRB.getInt64Ty()->getPointerTo());
+  Value *args[] = { module_desc,
+                    ConstantInt::get(IRB.getInt64Ty(), segment_id), v_values };
+  IRB.CreateCall(TL_log_block, args);
+  pending_segment = PendingSegment();
+}
+
+Value *Tracer::getStaticValuesBuffer() {
+  if (!static_values) {
+    // As with vector buffers, allocate at the very beginning of the function
+    // so that the buffer dominates all uses. The size is fixed up once the
+    // function is done.
+    Instruction *insertp =
+        cast<Instruction>(curr_function->front().getFirstInsertionPt());
+    IRBuilder<> alloca_builder(insertp);
+    static_values = alloca_builder.CreateAlloca(
+        alloca_builder.getInt64Ty(), alloca_builder.getInt64(1));
+  }
+  return static_values;
+}
+
 void Tracer::printFirstLine(Instruction *I, InstEnv *env, unsigned opcode) {
+  if (useStaticInstTable()) {
+    if (env->to_fxpt)
+      opcode = opcodeToFixedPoint(opcode);
+    flushStaticRecord();
+    beginStaticRecord(I, STATIC_INST);
+    trace_static_record &record = pending_record.record;
+    record.line = env->line_number;
+    record.func = getStringId(env->funcName);
+    record.bb = getStringId(env->bbid);
+    record.inst = getStringId(env->instid);
+    record.opcode = opcode;
+    return;
+  }
   IRBuilder<> IRB(I);
   Value *v_opty, *v_linenumber, *v_is_tracked_function,
       *v_is_toplevel_mode;
@@ -715,27 +1356,36 @@ void Tracer::printFirstLine(Instruction *I, InstEnv *env, unsigned opcode) {
       IRB.getInt1Ty(),
       (tracked_functions.find(env->funcName) != tracked_functions.end()));
   v_is_toplevel_mode = ConstantInt::get(IRB.getInt1Ty(), is_toplevel_mode);
-  Constant *vv_func_name = createStringArgIfNotExists(env->funcName);
-  Constant *vv_bb = createStringArgIfNotExists(env->bbid);
-  Constant *vv_inst = createStringArgIfNotExists(env->instid);
-  Value *args[] = { v_linenumber,      vv_func_name, vv_bb,
-                    vv_inst,           v_opty,       v_is_tracked_function,
-                    v_is_toplevel_mode };
+  Constant *vv_func_name = createStringIdIfNotExists(env->funcName);
+  Constant *vv_bb = createStringIdIfNotExists(env->bbid);
+  Constant *vv_inst = createStringIdIfNotExists(env->instid);
+  // The text of the line, up to the dynamic instruction count.
+  std::string text = "\n0," + std::to_string(env->line_number) + "," +
+                     env->funcName + "," + env->bbid + "," + env->instid +
+                     "," + std::to_string(opcode) + ",";
+  Constant *v_text = createStringArgIfNotExists(text.c_str());
+  Value *v_text_size = ConstantInt::get(IRB.getInt64Ty(), text.size());
+  Value *args[] = { module_desc, v_linenumber,          vv_func_name,
+                    vv_bb,       vv_inst,               v_opty,
+                    v_is_tracked_function, v_is_toplevel_mode,
+                    v_text,      v_text_size };
   IRB.CreateCall(TL_log0, args);
 }
 
 void Tracer::printTopLevelEntryFirstLine(Instruction *I, InstEnv *env,
                                          int num_params) {
+  flushSegment();
   IRBuilder<> IRB(I);
-  Constant *vv_func_name = createStringArgIfNotExists(env->funcName);
+  Constant *vv_func_name = createStringIdIfNotExists(env->funcName);
   Value* v_num_params = ConstantInt::get(IRB.getInt64Ty(), num_params);
-  Value *args[] = { vv_func_name, v_num_params };
+  Value *args[] = { module_desc, vv_func_name, v_num_params };
   IRB.CreateCall(TL_log_entry, args);
 }
 
 void Tracer::updateTracerStatus(Instruction *I, InstEnv *env, int opcode) {
+  flushSegment();
   IRBuilder<> IRB(I);
-  Constant *func_name = createStringArgIfNotExists(env->funcName);
+  Constant *func_name = createStringIdIfNotExists(env->funcName);
   if (env->to_fxpt)
     opcode = opcodeToFixedPoint(opcode);
   Value *v_opcode = ConstantInt::get(IRB.getInt64Ty(), opcode);
@@ -744,7 +1394,7 @@ void Tracer::updateTracerStatus(Instruction *I, InstEnv *env, int opcode) {
       (tracked_functions.find(env->funcName) != tracked_functions.end()));
   Value *v_is_toplevel_mode =
       ConstantInt::get(IRB.getInt1Ty(), is_toplevel_mode);
-  Value *args[] = {func_name, v_opcode, v_is_tracked_function,
+  Value *args[] = {module_desc, func_name, v_opcode, v_is_tracked_function,
                    v_is_toplevel_mode};
   IRB.CreateCall(TL_update_status, args);
 }
@@ -968,6 +1618,7 @@ void Tracer::handlePhiNodes(BasicBlock* BB, InstEnv* env) {
       }
       printParamLine(insertPointInst, &params);
     }
+    flushStaticRecord();
   }
 }
 
@@ -1150,6 +1801,22 @@ Constant *Tracer::createStringArgIfNotExists(const char *str) {
   return global_strings[key];
 }
 
+Constant *Tracer::createStringIdIfNotExists(const char *str) {
+  return ConstantInt::get(Type::getInt64Ty(curr_module->getContext()),
+                          getStringId(str));
+}
+
+unsigned Tracer::getStringId(const char *str) {
+  std::string key(str);
+  auto it = string_ids.find(key);
+  if (it != string_ids.end())
+    return it->second;
+  unsigned id = string_table.size();
+  string_ids[key] = id;
+  string_table.push_back(createStringArgIfNotExists(str));
+  return id;
+}
+
 Tracer::VecBufKey Tracer::createVecBufKey(Type* vector_type) {
   assert(vector_type->isVectorTy());
   unsigned num_elements = vector_type->getVectorNumElements();
@@ -1183,7 +1850,9 @@ Value *Tracer::createVectorArg(Value *vector, IRBuilder<> &IRB) {
 
 void Tracer::getAnalysisUsage(AnalysisUsage& Info) const {
   Info.addRequired<LoopInfoWrapperPass>();
-  Info.setPreservesAll();
+  // The inline logging guard and native clone dispatch change the CFG.
+  if (!inlineLogGuard && !nativeClones)
+    Info.setPreservesAll();
 }
 
 LabelMapHandler::LabelMapHandler() : ModulePass(ID) {}
@@ -3,11 +3,14 @@
 #include <string>
 
 #include "llvm/Pass.h"
+#include "llvm/Analysis/LoopInfo.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/BasicBlock.h"
 #include "llvm/IR/DebugInfo.h"
 #include "llvm/IR/ModuleSlotTracker.h"
 
+#include "trace_format.h"
+
 extern char s_phi[];
 
 using namespace llvm;
@@ -74,6 +77,40 @@ struct InstOperandParams {
     char *prev_bbid;
 };
 
+// A static record that is still being built (see -static-inst-table).
+//
+// Parameters are added to the record until instrumentation moves on to a
+// different insertion point, at which point the record is added to the
+// module's static record table and a single call to TL_log_static is inserted.
+struct PendingStaticRecord {
+  public:
+    PendingStaticRecord() : insert_point(nullptr) {}
+
+    // The logging call is inserted before this instruction. This is null when
+    // there is no pending record.
+    Instruction *insert_point;
+    trace_static_record record;
+    std::vector<trace_static_param> params;
+    // The runtime value of each dynamic parameter, or null for parameters
+    // that are stored in the table.
+    std::vector<Value*> values;
+};
+
+// Consecutive static records that are logged with a single call to
+// TL_log_block (see -log-per-block).
+struct PendingSegment {
+  public:
+    PendingSegment() : insert_point(nullptr), num_slots(0) {}
+
+    // The logging call is inserted before this instruction, which is the
+    // insertion point of the last record in the segment.
+    Instruction *insert_point;
+    // Module-local IDs of the records in this segment.
+    std::vector<uint32_t> records;
+    // Number of 64-bit value slots used by the records so far.
+    unsigned num_slots;
+};
+
 class Tracer : public FunctionPass {
   public:
     Tracer();
@@ -81,6 +118,7 @@ class Tracer : public FunctionPass {
     static char ID;
 
     virtual bool doInitialization(Module &M);
+    virtual bool doFinalization(Module &M);
     virtual bool runOnFunction(Function& F);
     virtual bool runOnBasicBlock(BasicBlock &BB);
     virtual void getAnalysisUsage(AnalysisUsage& Info) const;
@@ -117,7 +155,8 @@ class Tracer : public FunctionPass {
     // This function inserts a call to TL_log0 (the first line of output for an
     // instruction), which largely contains information about this
     // instruction's context: basic block, function, static instruction id,
-    // source line number, etc.
+    // source line number, etc. The text trace line for all of these is built
+    // here and passed along, so that the runtime only has to copy it.
     void printFirstLine(Instruction *insert_point, InstEnv *env, unsigned opcode);
 
     // Insert instrumentation to print a line about an instruction's parameters.
@@ -126,7 +165,8 @@ class Tracer : public FunctionPass {
     // arguments, return values, etc.
     //
     // Based on the value of datatype, this function inserts calls to
-    // TL_log_int or TL_log_double.
+    // TL_log_int or TL_log_double. As with printFirstLine(), the text trace
+    // line is built here except for the value.
     void printParamLine(Instruction *I, int param_num, const char *reg_id,
                         const char *bbId, Type::TypeID datatype,
                         unsigned datasize, Value *value, bool is_reg,
@@ -134,6 +174,72 @@ class Tracer : public FunctionPass {
 
     void printParamLine(Instruction *I, InstOperandParams *params);
 
+    // Add a parameter to the pending static record at I.
+    //
+    // This is printParamLine() for -static-inst-table. Constant operands are
+    // stored in the static record table; everything else is logged when the
+    // record is flushed.
+    void printStaticParamLine(Instruction *I, int param_num, const char *reg_id,
+                              bool is_phi, Type::TypeID datatype,
+                              unsigned datasize, Value *value, bool is_reg,
+                              bool is_intrinsic, const char *prev_bbid);
+
+    // Start a new static record whose logging call goes before I.
+    void beginStaticRecord(Instruction *I, trace_static_kind kind);
+
+    // Add the pending static record (if any) to the static record table and
+    // insert the call that logs it.
+    //
+    // With -log-per-block, the record is added to the pending segment
+    // instead, and its dynamic values are stored after those of the earlier
+    // records in the segment.
+    void flushStaticRecord();
+
+    // Flush the pending static record, then add the pending segment (if any)
+    // to the static record table and insert the call that logs it.
+    //
+    // This must be called wherever the records logged so far have to reach
+    // the trace: before calls, before updating the tracer status and at the
+    // end of every basic block.
+    void flushSegment();
+
+    // Return the stack buffer through which dynamic parameter values are
+    // passed to TL_log_static, allocating it if necessary.
+    //
+    // All static records in a function share this buffer. It is sized for
+    // the largest record once the whole function has been instrumented.
+    Value *getStaticValuesBuffer();
+
+    // Create an uninstrumented clone of every function this pass will
+    // instrument (see -native-clones).
+    //
+    // Calls in the clones are redirected to the clones of their callees,
+    // except for calls to top-level functions, which must go through the
+    // instrumented function to be dispatched.
+    void createNativeClones(Module &M);
+
+    // Insert a new entry block into the top-level function F that asks the
+    // runtime whether to trace this invocation, and calls native (the
+    // uninstrumented clone of F) instead if not.
+    void insertNativeDispatch(Function &F, Function *native);
+
+    // Wrap every run of logging instrumentation in F in a check of the
+    // runtime's thread-local logging_enabled flag (see -inline-log-guard).
+    //
+    // This must be done after all of F has been instrumented, since it
+    // splits basic blocks.
+    void guardLoggingCalls(Function &F);
+
+    // Is I part of the logging instrumentation of a run of instructions?
+    //
+    // in_run holds the instructions after I that are already known to be in
+    // the run.
+    bool isGuardedLoggingInst(Instruction *I,
+                              const std::set<Instruction*> &in_run);
+
+    // Print a warning about a parameter that cannot be logged.
+    void warnUnhandledDatatype(Type::TypeID datatype, const char *reg_id);
+
     // Print the first line of a top-level function signature.
     //
     // This has the form "entry,func_name,num_params".
@@ -227,6 +333,23 @@ class Tracer : public FunctionPass {
     // just return the Constant*.
     Constant *createStringArgIfNotExists(const char *str);
 
+    // Get the ID of str in this module's string table.
+    //
+    // The instrumentation logs names by ID rather than by pointer to a string
+    // constant. IDs are dense and local to the module; the runtime offsets
+    // them by a per-module base when the string table is registered, so the
+    // IDs in the trace are unique across modules.
+    Constant *createStringIdIfNotExists(const char *str);
+    unsigned getStringId(const char *str);
+
+    // Emit the string table, the static record table, the loop table, and
+    // the constructor that registers them with the runtime.
+    void emitModuleTables(Module &M);
+
+    // Add the latches and exits of a loop of the current function to the
+    // loop table.
+    void addLoopToTable(Loop *loop);
+
     // Collect debug information in the current function.
     //
     // Release builds of LLVM 6 discards value names when emitting LLVM IR. This
@@ -270,6 +393,21 @@ class Tracer : public FunctionPass {
     Value *TL_log_vector;
     Value *TL_log_entry;
     Value *TL_update_status;
+    Value *TL_register_module;
+    Value *TL_log_static;
+    Value *TL_log_block;
+
+    Value *TL_trace_invocation;
+
+    // The runtime's thread-local logging_enabled flag.
+    GlobalVariable *logging_enabled;
+
+    // Layout of struct trace_module in the runtime.
+    StructType *trace_module_ty;
+
+    // This module's trace_module descriptor, which is passed to every
+    // logging function so the runtime can resolve string IDs.
+    GlobalVariable *module_desc;
 
     // The current module.
     Module *curr_module;
@@ -302,6 +440,34 @@ class Tracer : public FunctionPass {
     // Map of strings to newly created global variables storing them.
     std::map<std::string, Constant*> global_strings;
 
+    // Map of strings to their IDs in the module string table.
+    std::map<std::string, unsigned> string_ids;
+
+    // The module string table, indexed by ID.
+    std::vector<Constant*> string_table;
+
+    // The serialized static record table, without the record count.
+    std::string static_table;
+
+    // Number of records in static_table.
+    unsigned num_static_records;
+
+    // The static record currently being built.
+    PendingStaticRecord pending_record;
+
+    // The serialized segment list of the static record table, without the
+    // segment count, and the number of segments in it.
+    std::string static_segments;
+    unsigned num_static_segments;
+
+    // The segment currently being built.
+    PendingSegment pending_segment;
+
+    // Buffer for dynamic parameter values in the current function, and the
+    // number of 64-bit slots it needs.
+    AllocaInst *static_values;
+    unsigned num_static_slots;
+
     // Stores names of local variables allocated by alloca.
     //
     // For alloca instructions that allocate local memory, this maps the
@@ -314,8 +480,15 @@ class Tracer : public FunctionPass {
     // Debug info cache of value names.
     std::map<Value*, StringRef> valueDebugName;
 
+    // Maps functions to their uninstrumented clones.
+    std::map<Function*, Function*> native_clones;
+
     // Preheader branch instructions and their line numbers.
     std::map<Instruction*, int> preheaderLineNum;
+
+    // The loop table of this module, TRACE_LOOP_ROW_SIZE fields per row (see
+    // trace_format.h).
+    std::vector<uint32_t> loop_table;
 };
 
 /* Reads a labelmap file and inserts it into the dynamic trace.
@@ -0,0 +1,128 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#ifdef LLVMTRACER_HAS_ZSTD
+#include <zstd.h>
+#endif
+#ifdef LLVMTRACER_HAS_LZ4
+#include <lz4frame.h>
+#endif
+
+#include "trace_codec.h"
+
+static void raw_compress(const char *data, size_t size, int /*level*/,
+                         const trace_chunk_tag & /*tag*/, std::string &frame) {
+  frame.assign(data, size);
+}
+
+static void zlib_compress(const char *data, size_t size, int level,
+                          const trace_chunk_tag &tag, std::string &frame) {
+  z_stream strm;
+  memset(&strm, 0, sizeof(strm));
+  // 16 + MAX_WBITS selects the gzip wrapper.
+  if (deflateInit2(&strm, level, Z_DEFLATED, 16 + MAX_WBITS, 8,
+                   Z_DEFAULT_STRATEGY) != Z_OK) {
+    fprintf(stderr, "Failed to initialize zlib!\n");
+    exit(-1);
+  }
+  // The tag is the only subfield of the extra field: two ID bytes, a 16-bit
+  // length and the tag itself.
+  std::string extra(4, '\0');
+  extra[0] = TRACE_GZIP_TAG_ID1;
+  extra[1] = TRACE_GZIP_TAG_ID2;
+  encode_chunk_tag(tag, extra);
+  size_t tag_size = extra.size() - 4;
+  extra[2] = tag_size & 0xff;
+  extra[3] = tag_size >> 8;
+  gz_header header;
+  memset(&header, 0, sizeof(header));
+  header.os = 3;  // Unix.
+  header.extra = (Bytef *)&extra[0];
+  header.extra_len = extra.size();
+  deflateSetHeader(&strm, &header);
+  frame.resize(deflateBound(&strm, size));
+  strm.next_in = (Bytef *)data;
+  strm.avail_in = size;
+  strm.next_out = (Bytef *)&frame[0];
+  strm.avail_out = frame.size();
+  if (deflate(&strm, Z_FINISH) != Z_STREAM_END) {
+    fprintf(stderr, "Failed to compress trace!\n");
+    exit(-1);
+  }
+  frame.resize(strm.total_out);
+  deflateEnd(&strm);
+}
+
+#if defined(LLVMTRACER_HAS_ZSTD) || defined(LLVMTRACER_HAS_LZ4)
+// Replace the contents of frame with a skippable frame holding the tag.
+static void assign_skippable_tag(const trace_chunk_tag &tag,
+                                 std::string &frame) {
+  frame.clear();
+  append_tag_field<uint32_t>(frame, TRACE_SKIPPABLE_TAG_MAGIC);
+  append_tag_field<uint32_t>(frame, 0);
+  encode_chunk_tag(tag, frame);
+  uint32_t size = frame.size() - 8;
+  memcpy(&frame[4], &size, 4);
+}
+#endif
+
+#ifdef LLVMTRACER_HAS_ZSTD
+static void zstd_compress(const char *data, size_t size, int level,
+                          const trace_chunk_tag &tag, std::string &frame) {
+  assign_skippable_tag(tag, frame);
+  size_t offset = frame.size();
+  frame.resize(offset + ZSTD_compressBound(size));
+  size_t frame_size = ZSTD_compress(&frame[offset], frame.size() - offset,
+                                    data, size, level);
+  if (ZSTD_isError(frame_size)) {
+    fprintf(stderr, "Failed to compress trace: %s\n",
+            ZSTD_getErrorName(frame_size));
+    exit(-1);
+  }
+  frame.resize(offset + frame_size);
+}
+#endif
+
+#ifdef LLVMTRACER_HAS_LZ4
+static void lz4_compress(const char *data, size_t size, int level,
+                         const trace_chunk_tag &tag, std::string &frame) {
+  LZ4F_preferences_t prefs;
+  memset(&prefs, 0, sizeof(prefs));
+  prefs.compressionLevel = level;
+  prefs.frameInfo.contentSize = size;
+  assign_skippable_tag(tag, frame);
+  size_t offset = frame.size();
+  frame.resize(offset + LZ4F_compressFrameBound(size, &prefs));
+  size_t frame_size = LZ4F_compressFrame(&frame[offset], frame.size() - offset,
+                                         data, size, &prefs);
+  if (LZ4F_isError(frame_size)) {
+    fprintf(stderr, "Failed to compress trace: %s\n",
+            LZ4F_getErrorName(frame_size));
+    exit(-1);
+  }
+  frame.resize(offset + frame_size);
+}
+#endif
+
+static const trace_codec codecs[] = {
+  { "raw", 0, 0, 0, &raw_compress },
+  { "zlib", 1, 9, 6, &zlib_compress },
+#ifdef LLVMTRACER_HAS_ZSTD
+  // Levels above 19 need far more memory per thread than they are worth.
+  { "zstd", 1, 19, 3, &zstd_compress },
+#endif
+#ifdef LLVMTRACER_HAS_LZ4
+  // Levels 3 and up select LZ4HC.
+  { "lz4", 0, 12, 0, &lz4_compress },
+#endif
+};
+
+const trace_codec *find_trace_codec(const char *name) {
+  for (size_t i = 0; i < sizeof(codecs) / sizeof(codecs[0]); i++) {
+    if (strcmp(codecs[i].name, name) == 0)
+      return &codecs[i];
+  }
+  return nullptr;
+}
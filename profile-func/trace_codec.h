@@ -0,0 +1,161 @@
+#ifndef __LLVM_TRACER_TRACE_CODEC_H__
+#define __LLVM_TRACER_TRACE_CODEC_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <string>
+
+// Compression codecs for trace output.
+//
+// The trace writer compresses every chunk independently into one complete,
+// self-contained frame, and a trace file is the concatenation of these
+// frames. Every codec here produces frames that its standard tools (gzip,
+// zstd, lz4) read back as a single stream when concatenated.
+//
+// The codec is selected with LLVMTRACER_COMPRESSION=<name>[:<level>]:
+//
+//   raw:  No compression. The trace is written as is.
+//   zlib: gzip members (the default, level 6).
+//   zstd: Zstandard frames (level 3). Only if built with libzstd.
+//   lz4:  LZ4 frames (level 0, the fast mode). Only if built with liblz4.
+//
+// Every thread writes its own chunks, and the chunks of all threads that
+// write to the same trace file are interleaved in it. So that readers can
+// reassemble the stream of each thread, every frame carries a chunk tag:
+//
+//   u32 thread_id, u32 flags (trace_chunk_flags), u64 seq
+//
+// where seq numbers the chunks of each thread. Chunks always start at a
+// record boundary (an instruction or a top-level entry), so given the trace
+// header, every chunk can be decoded on its own. The tag also holds what a
+// reader needs to decode chunks in parallel without decoding the ones before
+// them, which is the state of the thread when the chunk was started:
+//
+//   u64 num_insts:    Number of instructions in the chunk.
+//   u64 insts_before: Number of instructions the thread logged before it.
+//   i64 invocation:   The last top-level invocation the thread entered, from
+//                     0, or -1. Each entry record in the chunk starts the
+//                     next one.
+//   i64 inst_count:   The thread's inst_count, i.e. that of the chunk's first
+//                     instruction unless an entry record comes before it.
+//   u16 length, function name, u16 length, basic block name: Where the last
+//                     instruction before the chunk was. Both are empty
+//                     between top-level invocations.
+//
+// zlib frames store the tag in an extra field of the gzip header (subfield ID
+// "LT"), and zstd and lz4 frames are preceded by a skippable frame holding
+// it. Both are ignored by the standard tools. Raw traces are not tagged.
+
+enum trace_chunk_flags {
+  // The chunk holds the trace header (the labelmap and, in binary traces,
+  // the string and static record tables), which is shared by all threads.
+  CHUNK_IS_HEADER = 0x1,
+};
+
+// Where the thread was when a chunk was started.
+struct trace_chunk_context {
+  uint64_t insts_before;
+  int64_t invocation;
+  int64_t inst_count;
+  std::string function;
+  std::string basic_block;
+};
+
+struct trace_chunk_tag {
+  uint32_t thread_id;
+  uint32_t flags;
+  uint64_t seq;
+  uint64_t num_insts;
+  trace_chunk_context context;
+};
+
+// Size of the tag without the names.
+#define TRACE_CHUNK_TAG_FIXED_SIZE 48
+// Names are truncated to this length, which keeps the tag well within the
+// 64KB limit of gzip extra fields.
+#define TRACE_CHUNK_TAG_MAX_NAME 16384
+// Subfield ID of the tag in gzip extra fields.
+#define TRACE_GZIP_TAG_ID1 'L'
+#define TRACE_GZIP_TAG_ID2 'T'
+// Magic number of the skippable frames holding the tag. zstd and lz4 share
+// the same range of skippable frame magic numbers.
+#define TRACE_SKIPPABLE_TAG_MAGIC 0x184D2A54
+
+template <typename T>
+static inline void append_tag_field(std::string &buf, T value) {
+  buf.append(reinterpret_cast<const char *>(&value), sizeof(value));
+}
+
+static inline void append_tag_name(std::string &buf, const std::string &name) {
+  uint16_t length = name.size() < TRACE_CHUNK_TAG_MAX_NAME
+                        ? name.size()
+                        : TRACE_CHUNK_TAG_MAX_NAME;
+  append_tag_field<uint16_t>(buf, length);
+  buf.append(name, 0, length);
+}
+
+// Append the encoded tag to buf.
+static inline void encode_chunk_tag(const trace_chunk_tag &tag,
+                                    std::string &buf) {
+  append_tag_field<uint32_t>(buf, tag.thread_id);
+  append_tag_field<uint32_t>(buf, tag.flags);
+  append_tag_field<uint64_t>(buf, tag.seq);
+  append_tag_field<uint64_t>(buf, tag.num_insts);
+  append_tag_field<uint64_t>(buf, tag.context.insts_before);
+  append_tag_field<int64_t>(buf, tag.context.invocation);
+  append_tag_field<int64_t>(buf, tag.context.inst_count);
+  append_tag_name(buf, tag.context.function);
+  append_tag_name(buf, tag.context.basic_block);
+}
+
+static inline bool decode_tag_name(const uint8_t *buf, size_t size,
+                                   size_t &pos, std::string &name) {
+  uint16_t length;
+  if (pos + 2 > size)
+    return false;
+  memcpy(&length, buf + pos, 2);
+  pos += 2;
+  if (pos + length > size)
+    return false;
+  name.assign(reinterpret_cast<const char *>(buf + pos), length);
+  pos += length;
+  return true;
+}
+
+// Decode a tag of size bytes. Returns false if it is malformed.
+static inline bool decode_chunk_tag(const uint8_t *buf, size_t size,
+                                    trace_chunk_tag &tag) {
+  if (size < TRACE_CHUNK_TAG_FIXED_SIZE)
+    return false;
+  memcpy(&tag.thread_id, buf, 4);
+  memcpy(&tag.flags, buf + 4, 4);
+  memcpy(&tag.seq, buf + 8, 8);
+  memcpy(&tag.num_insts, buf + 16, 8);
+  memcpy(&tag.context.insts_before, buf + 24, 8);
+  memcpy(&tag.context.invocation, buf + 32, 8);
+  memcpy(&tag.context.inst_count, buf + 40, 8);
+  size_t pos = TRACE_CHUNK_TAG_FIXED_SIZE;
+  return decode_tag_name(buf, size, pos, tag.context.function) &&
+         decode_tag_name(buf, size, pos, tag.context.basic_block) &&
+         pos == size;
+}
+
+struct trace_codec {
+  const char *name;
+  // Range of valid levels. Codecs without levels have a range of one.
+  int min_level;
+  int max_level;
+  int default_level;
+  // Compress size bytes of data into a complete frame tagged with tag,
+  // replacing the contents of frame.
+  void (*compress)(const char *data, size_t size, int level,
+                   const trace_chunk_tag &tag, std::string &frame);
+};
+
+// Returns the codec called name, or null if there is no such codec or this
+// runtime was built without it.
+const trace_codec *find_trace_codec(const char *name);
+
+#endif
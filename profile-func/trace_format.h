@@ -0,0 +1,367 @@
+#ifndef __LLVM_TRACER_TRACE_FORMAT_H__
+#define __LLVM_TRACER_TRACE_FORMAT_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+// Binary dynamic trace format.
+//
+// This is an opt-in alternative to the default gzipped CSV text trace. It is
+// selected at runtime by setting LLVMTRACER_TRACE_FORMAT=binary before running
+// the instrumented binary, and converted back to text with trace-to-text.
+//
+// A binary trace begins with an eight byte magic string and a 32-bit format
+// version, followed by a stream of records. Each record starts with a one
+// byte tag (see trace_record_tag). All fields are fixed width and stored in
+// host (little-endian) byte order. Strings are a 32-bit length followed by the
+// characters, without a null terminator.
+//
+// The header is followed by the labelmap and the string table. Every name
+// logged by the instrumentation is interned into the string table by the
+// Tracer pass, so records refer to names by their 32-bit ID ("id" below)
+// rather than repeating the name.
+//
+// Parameter records (int, ptr, double, string and vector) share a common
+// layout:
+//
+//   i32 line, i32 size, <value>, u8 flags,
+//   [id label if flags & PARAM_IS_REG], [id prev_bbid if flags & PARAM_IS_PHI]
+//
+// where <value> is an i64, u64, f64, id, or size/8 raw bytes respectively.
+//
+// Version 1 traces stored every name inline as a str and had no string table.
+//
+// Modules instrumented with -static-inst-table also carry a static record
+// table (see below), which is copied into the header after the string table.
+// Records logged from those modules are just the static record ID plus the
+// dynamic operand values.
+//
+// Version 4 added timestamp records, which are only written when
+// LLVMTRACER_TIMESTAMPS is set.
+//
+// Version 5 added sampling records, which are only written when
+// LLVMTRACER_TRACE_BUDGET is set.
+//
+// Version 6 added window records, which are only written when
+// LLVMTRACER_SAMPLE_PERIOD is set.
+//
+// Version 7 added simpoint records, which are only written when
+// LLVMTRACER_SIMPOINTS is set.
+//
+// Version 8 added iteration and loop records, which are only written when
+// LLVMTRACER_LOOP_LABEL is set.
+
+#define TRACE_BINARY_MAGIC "LLVMTRBN"
+#define TRACE_BINARY_MAGIC_SIZE 8
+#define TRACE_BINARY_VERSION 8
+
+enum trace_format {
+  TRACE_FORMAT_TEXT,
+  TRACE_FORMAT_BINARY,
+};
+
+enum trace_record_tag {
+  // u32 size, followed by the contents of the labelmap.
+  TRACE_REC_LABELMAP = 1,
+  // id func_name, i32 num_parameters.
+  TRACE_REC_ENTRY = 2,
+  // i32 line, id func_name, id bbid, id instid, i32 opcode, i64 inst_count.
+  TRACE_REC_INST = 3,
+  // Parameter records.
+  TRACE_REC_INT = 4,
+  TRACE_REC_PTR = 5,
+  TRACE_REC_DOUBLE = 6,
+  TRACE_REC_STRING = 7,
+  TRACE_REC_VECTOR = 8,
+  // u32 num_strings, followed by that many strs in ID order.
+  TRACE_REC_STRING_TABLE = 9,
+  // u32 string_base, u32 record_base, u32 size, followed by the static record
+  // table of one module. IDs in the table are relative to the two bases.
+  TRACE_REC_STATIC_TABLE = 10,
+  // u32 record_id, [i64 inst_count if the static record is an instruction],
+  // followed by the value of every dynamic parameter of the static record:
+  // an i64, u64 or f64, or size/8 raw bytes for vectors.
+  TRACE_REC_STATIC = 11,
+  // u64 timestamp. Precedes the entry record and the first instruction of
+  // each basic block. Text traces write it as a "t,<timestamp>" line.
+  TRACE_REC_TIMESTAMP = 12,
+  // u64 insts, u64 logged_insts, u64 invocations, u64 logged_invocations,
+  // u64 sample_period. Written at the end of a trace that had a budget or
+  // was sampled periodically, to tell how much of the program it covers.
+  // Text traces write it as a "sampling,<insts>,<logged_insts>,<invocations>,
+  // <logged_invocations>,<sample_period>" line.
+  TRACE_REC_SAMPLING = 13,
+  // u64 skipped_insts, u64 warmup_insts. Starts every stretch of a
+  // periodically sampled trace that is logged after instructions were
+  // skipped, telling how many were skipped and how many of the following
+  // instructions only warm up the sampled window. Text traces write it as a
+  // "window,<skipped_insts>,<warmup_insts>" line.
+  TRACE_REC_WINDOW = 14,
+  // u64 interval, f64 weight. Starts every representative interval of a
+  // SimPoint trace, giving the fraction of the program's intervals it stands
+  // for. Text traces write it as a "simpoint,<interval>,<weight>" line.
+  TRACE_REC_SIMPOINT = 15,
+  // u64 iteration. Starts every logged iteration of the loop chosen with
+  // LLVMTRACER_LOOP_LABEL, numbered from 0 in every execution of the loop.
+  // Text traces write it as an "iteration,<iteration>" line.
+  TRACE_REC_ITERATION = 16,
+  // u64 executions, u64 iterations, u64 logged_iterations. Written at the
+  // end of a trace sampled by loop iterations, right before the sampling
+  // record, with the total trip count of the loop. Text traces write it as
+  // a "loop,<executions>,<iterations>,<logged_iterations>" line.
+  TRACE_REC_LOOP = 17,
+};
+
+// Clock used for timestamps, selected with LLVMTRACER_TIMESTAMPS.
+enum trace_timestamps {
+  TIMESTAMPS_OFF,
+  // CLOCK_MONOTONIC_RAW, in nanoseconds ("1" or "clock").
+  TIMESTAMPS_CLOCK,
+  // The x86 time stamp counter, in cycles ("tsc").
+  TIMESTAMPS_TSC,
+};
+
+enum trace_param_flags {
+  PARAM_IS_REG = 0x1,
+  PARAM_IS_PHI = 0x2,
+  // Only used in static record tables: the value of this parameter is only
+  // known at runtime and is logged, rather than stored in the table.
+  PARAM_IS_DYNAMIC = 0x4,
+};
+
+// Static record tables.
+//
+// With -static-inst-table, everything about an instrumented instruction that
+// is known at compile time (line number, opcode, names, operand sizes and
+// constant operand values) is stored once in a per-module table of static
+// records. A static record is either an instruction (the "0,..." line and its
+// operands) or a group of parameter lines with no instruction line (results
+// and function arguments). The serialized table is:
+//
+//   u32 num_records, followed by num_records of
+//     u8 kind, i32 line, u32 func, u32 bb, u32 inst, i32 opcode,
+//     u16 num_params, followed by num_params of
+//       i32 line, i32 size, u8 value kind (a parameter record tag), u8 flags,
+//       u32 label, u32 prev_bbid, u64 value
+//   u32 num_segments, followed by num_segments of
+//     u32 num_records, followed by num_records u32 record IDs
+//
+// Names are string IDs local to the module. For dynamic parameters, value is
+// unused; otherwise it holds the bits of the int, ptr or double, or the
+// string ID.
+//
+// At runtime, dynamic values are passed to the logger in an array of 64-bit
+// slots, in parameter order. Vectors occupy size/64 (rounded up) slots.
+//
+// With -log-per-block, consecutive static records of a basic block are
+// grouped into segments, which are logged with a single call. A segment ends
+// before every call and at the end of the block. The dynamic values of all of
+// its records are passed in one array, one record after another. Record IDs
+// in segments are local to the module.
+
+enum trace_static_kind {
+  STATIC_INST = 0,
+  STATIC_PARAMS = 1,
+};
+
+struct trace_static_param {
+  int32_t line;
+  int32_t size;
+  uint8_t kind;
+  uint8_t flags;
+  uint32_t label;
+  uint32_t prev_bbid;
+  uint64_t value;
+};
+
+struct trace_static_record {
+  uint8_t kind;
+  int32_t line;
+  uint32_t func;
+  uint32_t bb;
+  uint32_t inst;
+  int32_t opcode;
+  // Index of the first parameter of this record in trace_static_table.params.
+  uint32_t first_param;
+  uint16_t num_params;
+  // Number of 64-bit slots taken by the dynamic values of this record.
+  uint32_t num_slots;
+};
+
+struct trace_static_segment {
+  // Index of the first record ID of this segment in
+  // trace_static_table.segment_records.
+  uint32_t first_record;
+  uint32_t num_records;
+};
+
+struct trace_static_table {
+  std::vector<trace_static_record> records;
+  std::vector<trace_static_param> params;
+  std::vector<trace_static_segment> segments;
+  std::vector<uint32_t> segment_records;
+};
+
+static inline unsigned static_param_slots(const trace_static_param &param) {
+  if (!(param.flags & PARAM_IS_DYNAMIC))
+    return 0;
+  if (param.kind == TRACE_REC_VECTOR)
+    return (param.size + 63) / 64;
+  return 1;
+}
+
+template <typename T>
+static inline void append_static_field(std::string &buf, T value) {
+  buf.append(reinterpret_cast<const char *>(&value), sizeof(T));
+}
+
+static inline void encode_static_record(std::string &buf,
+                                        const trace_static_record &record) {
+  append_static_field<uint8_t>(buf, record.kind);
+  append_static_field<int32_t>(buf, record.line);
+  append_static_field<uint32_t>(buf, record.func);
+  append_static_field<uint32_t>(buf, record.bb);
+  append_static_field<uint32_t>(buf, record.inst);
+  append_static_field<int32_t>(buf, record.opcode);
+  append_static_field<uint16_t>(buf, record.num_params);
+}
+
+static inline void encode_static_param(std::string &buf,
+                                       const trace_static_param &param) {
+  append_static_field<int32_t>(buf, param.line);
+  append_static_field<int32_t>(buf, param.size);
+  append_static_field<uint8_t>(buf, param.kind);
+  append_static_field<uint8_t>(buf, param.flags);
+  append_static_field<uint32_t>(buf, param.label);
+  append_static_field<uint32_t>(buf, param.prev_bbid);
+  append_static_field<uint64_t>(buf, param.value);
+}
+
+template <typename T>
+static inline bool read_static_field(const uint8_t *&pos, const uint8_t *end,
+                                     T &value) {
+  if (end - pos < (ptrdiff_t)sizeof(T))
+    return false;
+  memcpy(&value, pos, sizeof(T));
+  pos += sizeof(T);
+  return true;
+}
+
+// Parse a serialized static record table, adding string_base to every string
+// ID. Returns false if the table is malformed.
+static inline bool parse_static_table(const uint8_t *buf, size_t size,
+                                      uint32_t string_base,
+                                      trace_static_table &table) {
+  const uint8_t *pos = buf;
+  const uint8_t *end = buf + size;
+  uint32_t num_records;
+  if (!read_static_field(pos, end, num_records))
+    return false;
+  table.records.reserve(table.records.size() + num_records);
+  for (uint32_t i = 0; i < num_records; i++) {
+    trace_static_record record;
+    bool ok = read_static_field(pos, end, record.kind) &&
+              read_static_field(pos, end, record.line) &&
+              read_static_field(pos, end, record.func) &&
+              read_static_field(pos, end, record.bb) &&
+              read_static_field(pos, end, record.inst) &&
+              read_static_field(pos, end, record.opcode) &&
+              read_static_field(pos, end, record.num_params);
+    if (!ok)
+      return false;
+    record.func += string_base;
+    record.bb += string_base;
+    record.inst += string_base;
+    record.first_param = table.params.size();
+    record.num_slots = 0;
+    for (uint16_t j = 0; j < record.num_params; j++) {
+      trace_static_param param;
+      ok = read_static_field(pos, end, param.line) &&
+           read_static_field(pos, end, param.size) &&
+           read_static_field(pos, end, param.kind) &&
+           read_static_field(pos, end, param.flags) &&
+           read_static_field(pos, end, param.label) &&
+           read_static_field(pos, end, param.prev_bbid) &&
+           read_static_field(pos, end, param.value);
+      if (!ok)
+        return false;
+      param.label += string_base;
+      param.prev_bbid += string_base;
+      if (param.kind == TRACE_REC_STRING && !(param.flags & PARAM_IS_DYNAMIC))
+        param.value += string_base;
+      record.num_slots += static_param_slots(param);
+      table.params.push_back(param);
+    }
+    table.records.push_back(record);
+  }
+
+  uint32_t num_segments;
+  if (!read_static_field(pos, end, num_segments))
+    return false;
+  table.segments.reserve(table.segments.size() + num_segments);
+  for (uint32_t i = 0; i < num_segments; i++) {
+    trace_static_segment segment;
+    if (!read_static_field(pos, end, segment.num_records))
+      return false;
+    segment.first_record = table.segment_records.size();
+    for (uint32_t j = 0; j < segment.num_records; j++) {
+      uint32_t record_id;
+      if (!read_static_field(pos, end, record_id) || record_id >= num_records)
+        return false;
+      table.segment_records.push_back(record_id);
+    }
+    table.segments.push_back(segment);
+  }
+  return pos == end;
+}
+
+// Loop tables.
+//
+// Every module also carries a table of the loops of its instrumented
+// functions, so that the runtime can tell where the iterations of a labeled
+// loop start and end. The table has one row of TRACE_LOOP_ROW_SIZE u32 fields
+// for every latch and exit block of every loop:
+//
+//   u32 func, u32 line, u32 header, u32 kind (a trace_loop_edge), u32 bb
+//
+// where line is the line the loop starts on, which is the line of its label
+// in the labelmap, and the blocks are module-local string IDs of their
+// names. Loops without debug info are left out.
+
+#define TRACE_LOOP_ROW_SIZE 5
+
+enum trace_loop_edge {
+  // A block that branches back to the header.
+  LOOP_LATCH = 0,
+  // A block outside the loop that the loop branches to.
+  LOOP_EXIT = 1,
+};
+
+// Parse the value of LLVMTRACER_TRACE_FORMAT. Unset or unknown values select
+// the text format.
+static inline trace_format parse_trace_format(const char *value) {
+  if (value && strcmp(value, "binary") == 0)
+    return TRACE_FORMAT_BINARY;
+  return TRACE_FORMAT_TEXT;
+}
+
+// Parse the value of LLVMTRACER_TIMESTAMPS. Unset, empty and "0" turn
+// timestamps off. Returns false for unknown values.
+static inline bool parse_trace_timestamps(const char *value,
+                                          trace_timestamps &timestamps) {
+  if (!value || !*value || strcmp(value, "0") == 0)
+    timestamps = TIMESTAMPS_OFF;
+  else if (strcmp(value, "1") == 0 || strcmp(value, "clock") == 0)
+    timestamps = TIMESTAMPS_CLOCK;
+  else if (strcmp(value, "tsc") == 0)
+    timestamps = TIMESTAMPS_TSC;
+  else
+    return false;
+  return true;
+}
+
+#endif
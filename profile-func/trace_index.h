@@ -0,0 +1,87 @@
+#ifndef __LLVM_TRACER_TRACE_INDEX_H__
+#define __LLVM_TRACER_TRACE_INDEX_H__
+
+#include <stdint.h>
+#include <string.h>
+
+#include <string>
+
+#include "trace_codec.h"
+
+// Index of a trace file.
+//
+// Every chunk of a trace is compressed into a self-contained frame (see
+// trace_codec.h), so decompression can start at any frame. If
+// LLVMTRACER_TRACE_INDEX is set, the runtime writes an index next to every
+// trace, named <trace>.idx, that records where each frame is and which part
+// of the program's execution it holds. With the index on, a chunk is also
+// flushed at every top-level entry and exit, so that each top-level
+// invocation starts on a frame of its own.
+//
+// The index starts with TRACE_INDEX_MAGIC, a u32 version and the u32 size of
+// an entry, followed by one entry per frame, in file order:
+//
+//   u64 offset:      Byte offset of the frame in the trace file. For zstd and
+//                    lz4 traces, this is the offset of the skippable frame
+//                    holding its tag.
+//   u64 size:        Size of the frame in bytes, including its tag.
+//   u32 thread_id, u32 flags, u64 seq: From the chunk's tag.
+//   i64 invocation:  Which top-level invocation of the thread the chunk
+//                    belongs to, numbered from 0, or -1 if none (the header,
+//                    or traces that are not in top-level mode).
+//   i64 first_inst, i64 end_inst: The inst_count range [first_inst, end_inst)
+//                    of the instructions in the chunk. inst_count restarts
+//                    from 0 at every top-level invocation.
+//
+// All fields are in native byte order.
+
+#define TRACE_INDEX_MAGIC "LTINDEX"
+#define TRACE_INDEX_MAGIC_SIZE 8
+#define TRACE_INDEX_VERSION 1
+#define TRACE_INDEX_HEADER_SIZE (TRACE_INDEX_MAGIC_SIZE + 8)
+#define TRACE_INDEX_ENTRY_SIZE 56
+
+struct trace_index_entry {
+  uint64_t offset;
+  uint64_t size;
+  uint32_t thread_id;
+  uint32_t flags;
+  uint64_t seq;
+  int64_t invocation;
+  int64_t first_inst;
+  int64_t end_inst;
+};
+
+static inline void encode_index_header(std::string &buf) {
+  uint32_t version = TRACE_INDEX_VERSION;
+  uint32_t entry_size = TRACE_INDEX_ENTRY_SIZE;
+  buf.assign(TRACE_INDEX_MAGIC, TRACE_INDEX_MAGIC_SIZE);
+  buf.append(reinterpret_cast<const char *>(&version), 4);
+  buf.append(reinterpret_cast<const char *>(&entry_size), 4);
+}
+
+static inline void encode_index_entry(const trace_index_entry &entry,
+                                      uint8_t *buf) {
+  memcpy(buf, &entry.offset, 8);
+  memcpy(buf + 8, &entry.size, 8);
+  memcpy(buf + 16, &entry.thread_id, 4);
+  memcpy(buf + 20, &entry.flags, 4);
+  memcpy(buf + 24, &entry.seq, 8);
+  memcpy(buf + 32, &entry.invocation, 8);
+  memcpy(buf + 40, &entry.first_inst, 8);
+  memcpy(buf + 48, &entry.end_inst, 8);
+}
+
+static inline void decode_index_entry(const uint8_t *buf,
+                                      trace_index_entry &entry) {
+  memcpy(&entry.offset, buf, 8);
+  memcpy(&entry.size, buf + 8, 8);
+  memcpy(&entry.thread_id, buf + 16, 4);
+  memcpy(&entry.flags, buf + 20, 4);
+  memcpy(&entry.seq, buf + 24, 8);
+  memcpy(&entry.invocation, buf + 32, 8);
+  memcpy(&entry.first_inst, buf + 40, 8);
+  memcpy(&entry.end_inst, buf + 48, 8);
+}
+
+#endif
@@ -1,47 +1,873 @@
+#include <dlfcn.h>
+#include <inttypes.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include <algorithm>
+#include <sstream>
+
 #include "trace_logger.h"
 
 thread_local trace_info *trace = nullptr;
-std::map<std::string, gzFile> gz_files;
+thread_local uint8_t trace_logger_logging_enabled = 0;
+// The traces of all threads, most recently created first.
+std::atomic<trace_info *> all_traces(nullptr);
+std::map<std::string, trace_output *> trace_outputs;
 pthread_mutex_t lock;
 std::string labelmap_str;
 const char* default_trace_name = "dynamic_trace.gz";
+// Format of all traces written by this process, selected by setting the
+// LLVMTRACER_TRACE_FORMAT environment variable to "text" or "binary".
+trace_format output_format =
+    parse_trace_format(getenv("LLVMTRACER_TRACE_FORMAT"));
+
+static trace_timestamps read_timestamps_config() {
+  const char *value = getenv("LLVMTRACER_TIMESTAMPS");
+  trace_timestamps result;
+  if (!parse_trace_timestamps(value, result)) {
+    fprintf(stderr, "Invalid LLVMTRACER_TIMESTAMPS \"%s\"!\n", value);
+    exit(-1);
+  }
+#if !defined(__x86_64__) && !defined(__i386__)
+  if (result == TIMESTAMPS_TSC) {
+    fprintf(stderr, "LLVMTRACER_TIMESTAMPS=tsc is only supported on x86!\n");
+    exit(-1);
+  }
+#endif
+  return result;
+}
+// Clock for timestamps, or TIMESTAMPS_OFF.
+trace_timestamps timestamps = read_timestamps_config();
+
+// Parse LLVMTRACER_TRACE_BUDGET, which is a size in bytes with an optional K,
+// M or G suffix, or a number of instructions followed by "insts", and
+// LLVMTRACER_SAMPLE_WINDOW. Unset or empty means no budget.
+static trace_budget read_budget_config() {
+  trace_budget result;
+  result.limit = 0;
+  result.in_insts = false;
+  result.window = 10000;
+  const char *value = getenv("LLVMTRACER_TRACE_BUDGET");
+  if (value && *value) {
+    char *end;
+    result.limit = strtoull(value, &end, 10);
+    if (strcmp(end, "insts") == 0) {
+      result.in_insts = true;
+      end += 5;
+    }
+    switch (result.in_insts ? 0 : *end) {
+      case 'G': case 'g':
+        result.limit <<= 10;
+        // Fall through.
+      case 'M': case 'm':
+        result.limit <<= 10;
+        // Fall through.
+      case 'K': case 'k':
+        result.limit <<= 10;
+        end++;
+    }
+    if (end == value || *end || result.limit == 0) {
+      fprintf(stderr, "Invalid LLVMTRACER_TRACE_BUDGET \"%s\"!\n", value);
+      exit(-1);
+    }
+  }
+  value = getenv("LLVMTRACER_SAMPLE_WINDOW");
+  if (value && *value) {
+    char *end;
+    result.window = strtoull(value, &end, 10);
+    if (end == value || *end) {
+      fprintf(stderr, "Invalid LLVMTRACER_SAMPLE_WINDOW \"%s\"!\n", value);
+      exit(-1);
+    }
+  }
+  return result;
+}
+// Size budget of every trace, if any.
+trace_budget budget = read_budget_config();
+
+// Parse LLVMTRACER_SAMPLE_PERIOD and LLVMTRACER_SAMPLE_WARMUP, which are
+// numbers of instructions. The window is LLVMTRACER_SAMPLE_WINDOW, as for
+// budgets.
+static trace_interval_sampling read_interval_config() {
+  trace_interval_sampling result;
+  result.period = 0;
+  result.window = budget.window;
+  result.warmup = 0;
+  const char *names[] = {"LLVMTRACER_SAMPLE_PERIOD",
+                         "LLVMTRACER_SAMPLE_WARMUP"};
+  uint64_t *fields[] = {&result.period, &result.warmup};
+  for (int i = 0; i < 2; i++) {
+    const char *value = getenv(names[i]);
+    if (!value || !*value)
+      continue;
+    char *end;
+    *fields[i] = strtoull(value, &end, 10);
+    if (end == value || *end) {
+      fprintf(stderr, "Invalid %s \"%s\"!\n", names[i], value);
+      exit(-1);
+    }
+  }
+  if (!result.period)
+    return result;
+  if (budget.limit) {
+    fprintf(stderr, "LLVMTRACER_SAMPLE_PERIOD cannot be used with "
+                    "LLVMTRACER_TRACE_BUDGET!\n");
+    exit(-1);
+  }
+  if (!result.window || result.window + result.warmup > result.period) {
+    fprintf(stderr, "LLVMTRACER_SAMPLE_WINDOW must be nonzero, and it must "
+                    "fit in LLVMTRACER_SAMPLE_PERIOD along with "
+                    "LLVMTRACER_SAMPLE_WARMUP!\n");
+    exit(-1);
+  }
+  return result;
+}
+// Periodic sampling of every trace, if any.
+trace_interval_sampling interval = read_interval_config();
+
+// Parse LLVMTRACER_BBV_INTERVAL, a number of instructions, and read the file
+// named by LLVMTRACER_SIMPOINTS, if set, which has an "<interval> <weight>"
+// line for every simpoint (as written by trace-simpoint).
+static trace_simpoint_config read_simpoint_config() {
+  trace_simpoint_config result;
+  result.interval = 0;
+  result.collect = false;
+  const char *value = getenv("LLVMTRACER_BBV_INTERVAL");
+  const char *file_name = getenv("LLVMTRACER_SIMPOINTS");
+  if (value && *value) {
+    char *end;
+    result.interval = strtoull(value, &end, 10);
+    if (end == value || *end || result.interval == 0) {
+      fprintf(stderr, "Invalid LLVMTRACER_BBV_INTERVAL \"%s\"!\n", value);
+      exit(-1);
+    }
+  }
+  bool has_file = file_name && *file_name;
+  if (!result.interval) {
+    if (has_file) {
+      fprintf(stderr, "LLVMTRACER_SIMPOINTS must be used with the "
+                      "LLVMTRACER_BBV_INTERVAL of the first pass!\n");
+      exit(-1);
+    }
+    return result;
+  }
+  if (budget.limit || interval.period) {
+    fprintf(stderr, "LLVMTRACER_BBV_INTERVAL cannot be used with "
+                    "LLVMTRACER_TRACE_BUDGET or LLVMTRACER_SAMPLE_PERIOD!\n");
+    exit(-1);
+  }
+  result.collect = !has_file;
+  if (result.collect)
+    return result;
+  FILE *file = fopen(file_name, "r");
+  if (!file) {
+    perror("Failed to open LLVMTRACER_SIMPOINTS");
+    exit(-1);
+  }
+  trace_simpoint simpoint;
+  while (fscanf(file, "%" SCNu64 " %lf", &simpoint.interval,
+                &simpoint.weight) == 2)
+    result.simpoints.push_back(simpoint);
+  if (!feof(file)) {
+    fprintf(stderr, "Malformed LLVMTRACER_SIMPOINTS file %s!\n", file_name);
+    exit(-1);
+  }
+  fclose(file);
+  std::sort(result.simpoints.begin(), result.simpoints.end(),
+            [](const trace_simpoint &a, const trace_simpoint &b) {
+              return a.interval < b.interval;
+            });
+  return result;
+}
+// SimPoint sampling of every trace, if any.
+trace_simpoint_config simpoint_config = read_simpoint_config();
+
+// Parse LLVMTRACER_LOOP_LABEL, LLVMTRACER_LOOP_FIRST (1 by default) and
+// LLVMTRACER_LOOP_EVERY (0, none, by default). The loops are found later, in
+// resolve_loop_label().
+static trace_loop_sampling read_loop_config() {
+  trace_loop_sampling result;
+  result.label = getenv("LLVMTRACER_LOOP_LABEL");
+  result.first = 1;
+  result.every = 0;
+  result.resolved = false;
+  if (result.label && !*result.label)
+    result.label = nullptr;
+  const char *names[] = {"LLVMTRACER_LOOP_FIRST", "LLVMTRACER_LOOP_EVERY"};
+  uint64_t *fields[] = {&result.first, &result.every};
+  for (int i = 0; i < 2; i++) {
+    const char *value = getenv(names[i]);
+    if (!value || !*value)
+      continue;
+    char *end;
+    *fields[i] = strtoull(value, &end, 10);
+    if (end == value || *end) {
+      fprintf(stderr, "Invalid %s \"%s\"!\n", names[i], value);
+      exit(-1);
+    }
+  }
+  if (result.label &&
+      (budget.limit || interval.period || simpoint_config.interval)) {
+    fprintf(stderr, "LLVMTRACER_LOOP_LABEL cannot be used with "
+                    "LLVMTRACER_TRACE_BUDGET, LLVMTRACER_SAMPLE_PERIOD or "
+                    "LLVMTRACER_BBV_INTERVAL!\n");
+    exit(-1);
+  }
+  return result;
+}
+// Loop-iteration sampling of every trace, if any.
+trace_loop_sampling loop_sampling = read_loop_config();
+// Print a message whenever logging starts or stops, unless LLVMTRACER_QUIET
+// is set.
+bool print_status_messages = !getenv("LLVMTRACER_QUIET");
+// Scratch space used to assemble a binary record before writing it out.
+thread_local std::string record_buf;
+// All instrumented modules, most recently registered first. Registration
+// happens from global constructors, before any of the globals above are
+// guaranteed to be constructed, so these must be constant initialized.
+trace_module *registered_modules = nullptr;
+int64_t num_registered_strings = 0;
+int64_t num_registered_records = 0;
+// In-process sinks (see trace_sink.h). These may also be registered from
+// global constructors.
+llvmtracer_sink trace_sinks[LLVMTRACER_MAX_SINKS];
+int num_trace_sinks = 0;
+// Whether traces are written anywhere. If not, records are only given to the
+// sinks and never formatted. The first SimPoint pass writes no traces.
+bool output_enabled = (get_trace_writer_config().to_file ||
+                       get_trace_writer_config().to_shm) &&
+                      !simpoint_config.collect;
 
 void create_trace(const char *trace_name) {
   assert(!trace && "Trace has already been created!");
   trace = new trace_info(trace_name);
+  trace->format = output_format;
+  trace->next_threshold = budget.limit / 2;
+  // Periodically sampled traces log one in this many windows.
+  if (interval.period)
+    trace->sample_period = interval.period / interval.window;
+  // SimPoint traces are not sampled at a fixed rate, and the first pass
+  // skips everything.
+  if (simpoint_config.interval)
+    trace->sample_period = 0;
+  // Loops are sampled at a fixed rate after their first iterations.
+  if (loop_sampling.label)
+    trace->sample_period = loop_sampling.every;
+  trace->skipping = simpoint_config.collect;
+  // Traces outlive their threads, so that fin_main() can write out whatever
+  // they still have buffered.
+  trace->next = all_traces.load();
+  while (!all_traces.compare_exchange_weak(trace->next, trace))
+    ;
 }
 
 void write_labelmap() {
-  gzFile gz_file = trace->trace_file;
+  if (trace->format == TRACE_FORMAT_BINARY) {
+    write_binary_header();
+    return;
+  }
+  trace_stream *stream = &trace->stream;
   const char *section_header = "%%%% LABEL MAP START %%%%\n";
   const char *section_footer = "%%%% LABEL MAP END %%%%\n\n";
-  gzwrite(gz_file, section_header, strlen(section_header));
-  gzwrite(gz_file, labelmap_str.c_str(), labelmap_str.length());
-  gzwrite(gz_file, section_footer, strlen(section_footer));
+  trace_stream_write(stream, section_header, strlen(section_header));
+  trace_stream_write(stream, labelmap_str.c_str(), labelmap_str.length());
+  trace_stream_write(stream, section_footer, strlen(section_footer));
+}
+
+template <typename T> void append_field(T value) {
+  record_buf.append(reinterpret_cast<const char *>(&value), sizeof(T));
+}
+
+void append_string(const char *str, size_t len) {
+  append_field<uint32_t>(len);
+  record_buf.append(str, len);
+}
+
+void append_string(const char *str) { append_string(str, strlen(str)); }
+
+// Strings are written to binary traces by their global ID.
+void append_string_id(trace_module *module, int id) {
+  append_field<uint32_t>(module->string_base + id);
+}
+
+void begin_record(trace_record_tag tag) {
+  record_buf.clear();
+  append_field<uint8_t>(tag);
+}
+
+void write_record() {
+  trace_stream_write(&trace->stream, record_buf.data(), record_buf.size());
+}
+
+static uint64_t read_timestamp() {
+#if defined(__x86_64__) || defined(__i386__)
+  if (timestamps == TIMESTAMPS_TSC)
+    return __rdtsc();
+#endif
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void write_timestamp() {
+  uint64_t timestamp = read_timestamp();
+  if (num_trace_sinks)
+    add_sink_record(trace, LLVMTRACER_RECORD_TIMESTAMP).timestamp = timestamp;
+  if (!output_enabled)
+    return;
+  if (trace->format == TRACE_FORMAT_BINARY) {
+    begin_record(TRACE_REC_TIMESTAMP);
+    append_field<uint64_t>(timestamp);
+    write_record();
+    return;
+  }
+  char buf[32] = "\nt,";
+  char *end = trace_format_uint(buf + 3, timestamp);
+  *end++ = '\n';
+  trace_stream_write(&trace->stream, buf, end - buf);
+}
+
+// Whether an instruction starts a basic block, that is, whether it is in a
+// different block than the last instruction or follows a terminator (which
+// may have branched back to the start of the same block).
+static inline bool starts_block(trace_module *module, int func_id,
+                                int bb_id) {
+  return trace->last_was_terminator || module != trace->last_module ||
+         func_id != trace->last_func || bb_id != trace->last_bb;
+}
+
+// Called before logging an instruction to keep track of where the thread is.
+// When timestamps are on, this also writes a timestamp if the instruction
+// starts a basic block.
+void begin_instruction(trace_module *module, int func_id, int bb_id,
+                       int opcode) {
+  if (timestamps != TIMESTAMPS_OFF) {
+    if (starts_block(module, func_id, bb_id) && !trace->entry_timestamped)
+      write_timestamp();
+    trace->entry_timestamped = false;
+  }
+  trace->last_was_terminator =
+      opcode >= RET_OP && opcode <= LAST_TERMINATOR_OP;
+  trace->last_module = module;
+  trace->last_func = func_id;
+  trace->last_bb = bb_id;
+}
+
+// Written at the end of every trace when there is a budget, so that tools can
+// scale what they measure on the sampled trace to the whole program.
+void write_sampling_record(trace_info *info) {
+  uint64_t fields[] = {info->total_insts + info->skipped_insts,
+                       info->total_insts, (uint64_t)info->num_invocations,
+                       (uint64_t)(info->num_invocations -
+                                  info->skipped_invocations),
+                       (uint64_t)info->sample_period};
+  if (num_trace_sinks) {
+    llvmtracer_record &record =
+        add_sink_record(info, LLVMTRACER_RECORD_SAMPLING);
+    record.insts = fields[0];
+    record.logged_insts = fields[1];
+    record.invocations = fields[2];
+    record.logged_invocations = fields[3];
+    record.sample_period = fields[4];
+  }
+  if (!output_enabled)
+    return;
+  if (info->format == TRACE_FORMAT_BINARY) {
+    begin_record(TRACE_REC_SAMPLING);
+    for (uint64_t field : fields)
+      append_field<uint64_t>(field);
+    trace_stream_write(&info->stream, record_buf.data(), record_buf.size());
+    return;
+  }
+  char buf[128] = "\nsampling";
+  char *p = buf + strlen(buf);
+  for (uint64_t field : fields) {
+    *p++ = ',';
+    p = trace_format_uint(p, field);
+  }
+  *p++ = '\n';
+  trace_stream_write(&info->stream, buf, p - buf);
+}
+
+// Add a record to the sink batch of info. Fields that the kind does not use
+// are zeroed.
+llvmtracer_record &add_sink_record(trace_info *info, uint32_t kind) {
+  info->sink_records.emplace_back();
+  llvmtracer_record &record = info->sink_records.back();
+  record.kind = kind;
+  return record;
+}
+
+void sink_entry(trace_module *module, int func_id, int num_parameters) {
+  llvmtracer_record &record = add_sink_record(trace, LLVMTRACER_RECORD_ENTRY);
+  record.function = lookup_string(module, func_id);
+  record.num_params = num_parameters;
+}
+
+void sink_inst(trace_module *module, int line_number, int func_id, int bb_id,
+               int inst_id, int opcode) {
+  llvmtracer_record &record = add_sink_record(trace, LLVMTRACER_RECORD_INST);
+  record.line = line_number;
+  record.function = lookup_string(module, func_id);
+  record.basic_block = lookup_string(module, bb_id);
+  record.inst = lookup_string(module, inst_id);
+  record.opcode = opcode;
+  record.inst_count = trace->inst_count;
+}
+
+// bits holds the value as it is written to binary traces: a string ID for
+// strings, and for vectors, a pointer to their bytes.
+void sink_param(trace_module *module, int line, int size,
+                trace_record_tag type, uint64_t bits, int is_reg, int label,
+                int is_phi, int prev_bbid) {
+  uint32_t kind = line == RESULT_LINE    ? LLVMTRACER_RECORD_RESULT
+                  : line == FORWARD_LINE ? LLVMTRACER_RECORD_FORWARD
+                                         : LLVMTRACER_RECORD_PARAM;
+  llvmtracer_record &record = add_sink_record(trace, kind);
+  record.line = line;
+  record.size = size;
+  switch (type) {
+    case TRACE_REC_INT:
+      record.value_type = LLVMTRACER_VALUE_INT;
+      record.value.i = bits;
+      break;
+    case TRACE_REC_PTR:
+      record.value_type = LLVMTRACER_VALUE_PTR;
+      record.value.ptr = bits;
+      break;
+    case TRACE_REC_DOUBLE:
+      record.value_type = LLVMTRACER_VALUE_DOUBLE;
+      memcpy(&record.value.d, &bits, sizeof(bits));
+      break;
+    case TRACE_REC_STRING:
+      record.value_type = LLVMTRACER_VALUE_STRING;
+      record.value.str = lookup_string(module, bits);
+      break;
+    default:
+      // The program may change the vector before the batch is passed on, so
+      // it is copied.
+      record.value_type = LLVMTRACER_VALUE_VECTOR;
+      record.value.ptr = trace->sink_vectors.size();
+      trace->sink_vectors.append(reinterpret_cast<const char *>(bits),
+                                 size / 8);
+      break;
+  }
+  record.is_reg = is_reg;
+  record.is_phi = is_phi;
+  if (is_reg)
+    record.label = lookup_string(module, label);
+  if (is_phi)
+    record.prev_bb = lookup_string(module, prev_bbid);
 }
 
+// Pass the sink batch of info on to every sink.
+void flush_sink_records(trace_info *info) {
+  std::vector<llvmtracer_record> &records = info->sink_records;
+  if (records.empty())
+    return;
+  if (!info->sink_vectors.empty()) {
+    const uint8_t *vectors =
+        reinterpret_cast<const uint8_t *>(info->sink_vectors.data());
+    for (llvmtracer_record &record : records) {
+      if (record.value_type == LLVMTRACER_VALUE_VECTOR)
+        record.value.vector = vectors + record.value.ptr;
+    }
+  }
+  for (int i = 0; i < num_trace_sinks; i++)
+    trace_sinks[i].records(trace_sinks[i].arg, info->trace_name.c_str(),
+                           info->stream.thread_id, records.data(),
+                           records.size());
+  records.clear();
+  info->sink_vectors.clear();
+}
+
+// Called before logging an entry or instruction, so that batches start at
+// one.
+static inline void flush_sink_records_if_full() {
+  if (trace->sink_records.size() >= LLVMTRACER_SINK_BATCH_SIZE)
+    flush_sink_records(trace);
+}
+
+int llvmtracer_register_sink(const llvmtracer_sink *sink) {
+  if (num_trace_sinks == LLVMTRACER_MAX_SINKS || !sink->records)
+    return -1;
+  trace_sinks[num_trace_sinks++] = *sink;
+  return 0;
+}
+
+// Load the plugins listed in LLVMTRACER_SINK_PLUGINS and register their
+// sinks.
+void load_trace_sink_plugins() {
+  const char *value = getenv("LLVMTRACER_SINK_PLUGINS");
+  std::string plugins = value ? value : "";
+  size_t pos = 0;
+  while (pos < plugins.size()) {
+    size_t end = plugins.find(':', pos);
+    if (end == std::string::npos)
+      end = plugins.size();
+    std::string path = plugins.substr(pos, end - pos);
+    pos = end + 1;
+    if (path.empty())
+      continue;
+    void *handle = dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL);
+    if (!handle) {
+      fprintf(stderr, "Failed to load trace sink plugin: %s\n", dlerror());
+      exit(-1);
+    }
+    llvmtracer_sink_init_fn init = reinterpret_cast<llvmtracer_sink_init_fn>(
+        dlsym(handle, "llvmtracer_sink_init"));
+    if (!init) {
+      fprintf(stderr, "%s has no llvmtracer_sink_init function!\n",
+              path.c_str());
+      exit(-1);
+    }
+    llvmtracer_sink sink;
+    memset(&sink, 0, sizeof(sink));
+    if (init(&sink) != 0 || llvmtracer_register_sink(&sink) != 0) {
+      fprintf(stderr, "Failed to register the trace sink of %s!\n",
+              path.c_str());
+      exit(-1);
+    }
+  }
+  if (!output_enabled && !num_trace_sinks && !simpoint_config.collect)
+    fprintf(stderr, "Warning: LLVMTRACER_TRACE_SINK=none but there are no "
+                    "trace sinks, so nothing will be traced.\n");
+}
+
+void finish_trace_sinks() {
+  for (int i = 0; i < num_trace_sinks; i++) {
+    if (trace_sinks[i].finish)
+      trace_sinks[i].finish(trace_sinks[i].arg);
+  }
+}
+
+// Written when sampling starts logging again after a gap, either at the start
+// of a block or at the entry of a top-level invocation.
+void write_window_record(uint64_t skipped_insts, uint64_t warmup_insts) {
+  if (num_trace_sinks) {
+    llvmtracer_record &record =
+        add_sink_record(trace, LLVMTRACER_RECORD_WINDOW);
+    record.skipped_insts = skipped_insts;
+    record.warmup_insts = warmup_insts;
+  }
+  if (!output_enabled)
+    return;
+  if (trace->format == TRACE_FORMAT_BINARY) {
+    begin_record(TRACE_REC_WINDOW);
+    append_field<uint64_t>(skipped_insts);
+    append_field<uint64_t>(warmup_insts);
+    write_record();
+    return;
+  }
+  char buf[64] = "\nwindow,";
+  char *p = trace_format_uint(buf + 8, skipped_insts);
+  *p++ = ',';
+  p = trace_format_uint(p, warmup_insts);
+  *p++ = '\n';
+  trace_stream_write(&trace->stream, buf, p - buf);
+}
+
+// Written at the start of every simpoint in the second SimPoint pass.
+void write_simpoint_record(const trace_simpoint &simpoint) {
+  if (num_trace_sinks) {
+    llvmtracer_record &record =
+        add_sink_record(trace, LLVMTRACER_RECORD_SIMPOINT);
+    record.interval = simpoint.interval;
+    record.weight = simpoint.weight;
+  }
+  if (!output_enabled)
+    return;
+  if (trace->format == TRACE_FORMAT_BINARY) {
+    begin_record(TRACE_REC_SIMPOINT);
+    append_field<uint64_t>(simpoint.interval);
+    append_field<double>(simpoint.weight);
+    write_record();
+    return;
+  }
+  char buf[TRACE_VALUE_TEXT_SIZE + 48] = "\nsimpoint,";
+  char *p = trace_format_uint(buf + 10, simpoint.interval);
+  *p++ = ',';
+  p = trace_format_double(p, simpoint.weight);
+  *p++ = '\n';
+  trace_stream_write(&trace->stream, buf, p - buf);
+}
+
+// Written at the start of every logged iteration of the sampled loop.
+void write_iteration_record(uint64_t iteration) {
+  if (num_trace_sinks) {
+    llvmtracer_record &record =
+        add_sink_record(trace, LLVMTRACER_RECORD_ITERATION);
+    record.iteration = iteration;
+  }
+  if (!output_enabled)
+    return;
+  if (trace->format == TRACE_FORMAT_BINARY) {
+    begin_record(TRACE_REC_ITERATION);
+    append_field<uint64_t>(iteration);
+    write_record();
+    return;
+  }
+  char buf[48] = "\niteration,";
+  char *p = trace_format_uint(buf + 11, iteration);
+  *p++ = '\n';
+  trace_stream_write(&trace->stream, buf, p - buf);
+}
+
+// Written at the end of a trace sampled by loop iterations, right before the
+// sampling record, so that tools can scale what they measure on the logged
+// iterations to all of them.
+void write_loop_record(trace_info *info) {
+  uint64_t fields[] = {info->loop_executions, info->loop_iterations,
+                       info->logged_iterations};
+  if (num_trace_sinks) {
+    llvmtracer_record &record = add_sink_record(info, LLVMTRACER_RECORD_LOOP);
+    record.executions = fields[0];
+    record.iterations = fields[1];
+    record.logged_iterations = fields[2];
+  }
+  if (!output_enabled)
+    return;
+  if (info->format == TRACE_FORMAT_BINARY) {
+    begin_record(TRACE_REC_LOOP);
+    for (uint64_t field : fields)
+      append_field<uint64_t>(field);
+    trace_stream_write(&info->stream, record_buf.data(), record_buf.size());
+    return;
+  }
+  char buf[96] = "\nloop";
+  char *p = buf + strlen(buf);
+  for (uint64_t field : fields) {
+    *p++ = ',';
+    p = trace_format_uint(p, field);
+  }
+  *p++ = '\n';
+  trace_stream_write(&info->stream, buf, p - buf);
+}
+
+// Append the basic block vector of the current interval of info to its
+// bbv_text, and start the next interval. Vectors are written in the format
+// of SimPoint's frequency vector files, one line per interval:
+//
+//   T:<block>:<count> :<block>:<count> ...
+//
+// where blocks are global string IDs plus one, since SimPoint's start at 1.
+void write_bbv(trace_info *info) {
+  std::vector<uint32_t> &blocks = info->bbv_blocks;
+  std::sort(blocks.begin(), blocks.end());
+  std::string &text = info->bbv_text;
+  text += 'T';
+  char buf[48];
+  for (uint32_t block : blocks) {
+    char *p = buf;
+    *p++ = ':';
+    p = trace_format_uint(p, block + 1);
+    *p++ = ':';
+    p = trace_format_uint(p, info->bbv_counts[block]);
+    *p++ = ' ';
+    text.append(buf, p - buf);
+    info->bbv_counts[block] = 0;
+  }
+  text += '\n';
+  blocks.clear();
+  info->period_pos = 0;
+}
+
+// Write the basic block vectors of info at exit, including the last,
+// partial interval. The main thread's go to <trace_name>.bbv, and those of
+// other threads to <trace_name>.<thread_id>.bbv.
+void write_bbv_file(trace_info *info) {
+  if (info->period_pos)
+    write_bbv(info);
+  if (info->bbv_text.empty())
+    return;
+  std::string name = info->trace_name;
+  if (info->stream.thread_id != 0)
+    name += "." + std::to_string(info->stream.thread_id);
+  name += ".bbv";
+  FILE *file = fopen(name.c_str(), "w");
+  if (!file ||
+      fwrite(info->bbv_text.data(), 1, info->bbv_text.size(), file) !=
+          info->bbv_text.size() ||
+      fclose(file) != 0) {
+    perror("Failed to write the basic block vectors");
+    exit(-1);
+  }
+}
+
+// Provides the context of a new chunk of the trace info points to.
+void trace_info::get_chunk_context(void *arg, trace_chunk_context &context) {
+  trace_info *info = static_cast<trace_info *>(arg);
+  context.insts_before = info->total_insts;
+  context.invocation = info->invocation;
+  context.inst_count = info->inst_count;
+  if (info->last_module) {
+    context.function = lookup_string(info->last_module, info->last_func);
+    context.basic_block = lookup_string(info->last_module, info->last_bb);
+  } else {
+    context.function.clear();
+    context.basic_block.clear();
+  }
+}
+
+// The binary trace header consists of the magic string and format version,
+// followed by the labelmap and the string table of every registered module.
+void write_binary_header() {
+  record_buf.clear();
+  record_buf.append(TRACE_BINARY_MAGIC, TRACE_BINARY_MAGIC_SIZE);
+  append_field<uint32_t>(TRACE_BINARY_VERSION);
+  append_field<uint8_t>(TRACE_REC_LABELMAP);
+  append_string(labelmap_str.c_str(), labelmap_str.length());
+
+  std::map<int64_t, trace_module *> modules_by_base;
+  for (trace_module *module = registered_modules; module;
+       module = module->next)
+    modules_by_base[module->string_base] = module;
+  append_field<uint8_t>(TRACE_REC_STRING_TABLE);
+  append_field<uint32_t>(num_registered_strings);
+  for (auto it = modules_by_base.begin(); it != modules_by_base.end(); ++it) {
+    trace_module *module = it->second;
+    for (int64_t i = 0; i < module->num_strings; i++)
+      append_string(module->strings[i]);
+  }
+  for (auto it = modules_by_base.begin(); it != modules_by_base.end(); ++it) {
+    trace_module *module = it->second;
+    if (!module->static_table)
+      continue;
+    append_field<uint8_t>(TRACE_REC_STATIC_TABLE);
+    append_field<uint32_t>(module->string_base);
+    append_field<uint32_t>(module->record_base);
+    append_field<uint32_t>(module->static_table_size);
+    record_buf.append(reinterpret_cast<const char *>(module->static_table),
+                      module->static_table_size);
+  }
+  write_record();
+}
+
+// Look up the output of the current trace. This only takes the lock the first
+// time a thread writes to a trace file.
 void open_trace_file() {
+  if (trace->output || !output_enabled)
+    return;
   pthread_mutex_lock(&lock);
-  if (gz_files.find(trace->trace_name) != gz_files.end()) {
-    // If the trace file is already opened, obtain the file pointer.
-    trace->trace_file = gz_files.at(trace->trace_name);
+  auto it = trace_outputs.find(trace->trace_name);
+  if (it != trace_outputs.end()) {
+    // If the trace file is already opened, write to it.
+    trace->output = it->second;
+    set_trace_stream_output(&trace->stream, it->second);
   } else {
-    // Open a new trace file and write the label map to it.
-    gzFile gz_file = gzopen(trace->trace_name.c_str(), "w");
-    if (!gz_file) {
+    // Open a new trace file and write the label map to it. This is flushed
+    // right away so that it is the first thing in the file.
+    trace_output *output = open_trace_output(trace->trace_name.c_str());
+    if (!output) {
       perror("Failed to open logfile \"dynamic_trace\"");
       exit(-1);
     }
-    gz_files[trace->trace_name] = gz_file;
-    trace->trace_file = gz_file;
+    trace_outputs[trace->trace_name] = output;
+    trace->output = output;
+    set_trace_stream_output(&trace->stream, output);
     write_labelmap();
+    flush_trace_stream(&trace->stream, CHUNK_IS_HEADER);
   }
   pthread_mutex_unlock(&lock);
 }
 
+// Called from a global constructor of every instrumented module.
+//
+// The module's strings are assigned the next range of global IDs. Module
+// constructors run before main, so this does not need to be thread safe.
+void trace_logger_register_module(trace_module *module) {
+  module->string_base = num_registered_strings;
+  num_registered_strings += module->num_strings;
+  module->next = registered_modules;
+  registered_modules = module;
+
+  if (!module->static_table)
+    return;
+  // The runtime logs static records by their module-local string IDs, so
+  // the table is parsed without offsetting them.
+  module->records = new trace_static_table();
+  if (!parse_static_table(module->static_table, module->static_table_size, 0,
+                          *module->records)) {
+    fprintf(stderr, "Malformed static record table!\n");
+    exit(-1);
+  }
+  module->record_base = num_registered_records;
+  num_registered_records += module->records->records.size();
+}
+
 void trace_logger_register_labelmap(const char *labelmap_buf,
                                     size_t labelmap_size) {
   labelmap_str.assign(labelmap_buf, labelmap_size);
+  if (loop_sampling.label)
+    resolve_loop_label();
+}
+
+// Find the loops that LLVMTRACER_LOOP_LABEL refers to. Labelmap lines are
+//
+//   <function>/<label> <line> [inline <caller>...]
+//
+// and the loops are those of the loop tables that start on that line, in the
+// function or, if it was inlined, in the functions it was inlined into.
+void resolve_loop_label() {
+  std::istringstream labelmap(labelmap_str);
+  std::string line, name;
+  int label_line = -1;
+  std::vector<std::string> functions;
+  while (std::getline(labelmap, line)) {
+    std::istringstream fields(line);
+    if (!(fields >> name) || name != loop_sampling.label ||
+        !(fields >> label_line))
+      continue;
+    functions.push_back(name.substr(0, name.find('/')));
+    std::string word;
+    if (fields >> word && word == "inline") {
+      while (fields >> word)
+        functions.push_back(word);
+    }
+    break;
+  }
+  if (functions.empty()) {
+    fprintf(stderr, "Label %s of LLVMTRACER_LOOP_LABEL is not in the "
+                    "labelmap!\n", loop_sampling.label);
+    exit(-1);
+  }
+
+  std::vector<trace_loop> &loops = loop_sampling.loops;
+  for (trace_module *module = registered_modules; module;
+       module = module->next) {
+    for (int64_t i = 0; i < module->num_loops; i++) {
+      const uint32_t *row = module->loops + i * TRACE_LOOP_ROW_SIZE;
+      if ((int)row[1] != label_line ||
+          std::find(functions.begin(), functions.end(),
+                    lookup_string(module, row[0])) == functions.end())
+        continue;
+      trace_loop *loop = nullptr;
+      for (trace_loop &other : loops) {
+        if (other.module == module && other.func == (int)row[0] &&
+            other.header == (int)row[2])
+          loop = &other;
+      }
+      if (!loop) {
+        loops.emplace_back();
+        loop = &loops.back();
+        loop->module = module;
+        loop->func = row[0];
+        loop->header = row[2];
+      }
+      if (row[3] == LOOP_LATCH)
+        loop->latches.push_back(row[4]);
+      else
+        loop->exits.push_back(row[4]);
+    }
+  }
+  if (loops.empty()) {
+    fprintf(stderr, "No instrumented loop starts at label %s (line %d)!\n",
+            loop_sampling.label, label_line);
+    exit(-1);
+  }
+  loop_sampling.resolved = true;
 }
 
 // Called from the main function.
@@ -50,6 +876,7 @@ void trace_logger_init() {
     perror("Failed to initialize the mutex\n");
     exit(-1);
   }
+  load_trace_sink_plugins();
   // Create a trace for the main thread.
   create_trace(default_trace_name);
   atexit(&fin_main);
@@ -59,23 +886,134 @@ void trace_logger_init() {
 void fin_main() {
   if (trace)
     fin_toplevel();
-  for (auto it = gz_files.begin(); it != gz_files.end(); ++it) {
-    gzclose(it->second);
+  trace_info *next;
+  for (trace_info *info = all_traces.exchange(nullptr); info; info = next) {
+    next = info->next;
+    // Sampling can skip every top-level invocation of a trace, so its file
+    // may not have been opened yet. The records below must still make it
+    // into the trace.
+    bool has_records = budget.limit || interval.period ||
+                       simpoint_config.interval || loop_sampling.label;
+    if (has_records && !simpoint_config.collect) {
+      trace = info;
+      open_trace_file();
+    }
+    if (loop_sampling.label)
+      write_loop_record(info);
+    if (simpoint_config.collect)
+      write_bbv_file(info);
+    else if (has_records)
+      write_sampling_record(info);
+    flush_sink_records(info);
+    delete info;
+  }
+  finish_trace_sinks();
+  trace = nullptr;
+  update_logging_enabled();
+  shutdown_trace_writer();
+  for (auto it = trace_outputs.begin(); it != trace_outputs.end(); ++it) {
+    close_trace_output(it->second);
   }
 }
 
 // Called when a top-level function returns or at the main function exit.
+// The trace is reset for the next top-level call on this thread, but keeps
+// its output and buffered data.
 void fin_toplevel() {
-  delete trace;
-  trace = nullptr;
+  // Close the invocation's last chunk while its inst_count is still known.
+  if (get_trace_writer_config().index &&
+      trace->current_toplevel_function != -1)
+    flush_trace_stream(&trace->stream);
+  trace->current_toplevel_function = -1;
+  trace->current_logging_status = DO_NOT_LOG;
+  trace->inst_count = 0;
+  trace->last_module = nullptr;
+  trace->last_was_terminator = false;
+  trace->entry_timestamped = false;
+  trace->loop = nullptr;
+  update_logging_enabled();
+}
+
+// Parse the value of LLVMTRACER_INVOCATIONS, a comma separated list of
+// top-level function invocations to trace. Invocations are numbered from 0,
+// separately for each top-level function. Each item of the list is either a
+// single invocation ("100"), an inclusive range ("100-102"), or "every:N" to
+// trace every Nth invocation starting from the first.
+//
+// Returns null, meaning trace everything, if spec is null or empty.
+invocation_policy *parse_invocation_policy(const char *spec) {
+  if (!spec || !*spec)
+    return nullptr;
+  invocation_policy *policy = new invocation_policy();
+  const char *pos = spec;
+  bool valid = true;
+  while (valid && *pos) {
+    char *end;
+    if (strncmp(pos, "every:", 6) == 0) {
+      policy->every = strtoll(pos + 6, &end, 10);
+      valid = end != pos + 6 && policy->every > 0;
+    } else {
+      invocation_range range;
+      range.first = range.last = strtoll(pos, &end, 10);
+      valid = end != pos && range.first >= 0;
+      if (valid && *end == '-') {
+        pos = end + 1;
+        range.last = strtoll(pos, &end, 10);
+        valid = end != pos && range.last >= range.first;
+      }
+      policy->ranges.push_back(range);
+    }
+    pos = end;
+    if (*pos == ',' && pos[1])
+      pos++;
+    else if (*pos)
+      valid = false;
+  }
+  if (!valid) {
+    fprintf(stderr, "Invalid LLVMTRACER_INVOCATIONS \"%s\"!\n", spec);
+    exit(-1);
+  }
+  policy->num_counts = num_registered_strings;
+  policy->counts = new std::atomic<int64_t>[policy->num_counts]();
+  return policy;
+}
+
+bool should_trace_invocation(invocation_policy *policy, int64_t invocation) {
+  if (policy->every && invocation % policy->every == 0)
+    return true;
+  for (auto &range : policy->ranges) {
+    if (invocation >= range.first && invocation <= range.last)
+      return true;
+  }
+  return false;
+}
+
+// Called on entry to a top-level function instrumented with -native-clones.
+// Returns false if this invocation should run the uninstrumented clone
+// instead.
+bool trace_logger_trace_invocation(trace_module *module, int func_id) {
+  static invocation_policy *policy =
+      parse_invocation_policy(getenv("LLVMTRACER_INVOCATIONS"));
+  if (!policy)
+    return true;
+  int64_t id = module->string_base + func_id;
+  // Only modules registered after the first top-level call are not counted.
+  if (id >= policy->num_counts)
+    return true;
+  int64_t invocation =
+      policy->counts[id].fetch_add(1, std::memory_order_relaxed);
+  return should_trace_invocation(policy, invocation);
 }
 
 // Called before calling a top-level function.
 void llvmtracer_set_trace_name(const char *trace_name) {
-  if (!trace)
+  if (!trace) {
     create_trace(trace_name);
-  else
+  } else if (trace->trace_name != trace_name) {
+    flush_sink_records(trace);
     trace->trace_name = trace_name;
+    trace->output = nullptr;
+  }
 }
 
 // Determine whether to trace the current and next instructions.
@@ -117,7 +1055,7 @@ void llvmtracer_set_trace_name(const char *trace_name) {
 // function (since this would defeat the purpose of having top level
 // functions).
 logging_status log_or_not(bool is_toplevel_mode, bool is_toplevel_function,
-                          int opcode, char *current_function) {
+                          int opcode, int64_t current_function) {
   if (!is_toplevel_mode)
     return is_toplevel_function ? LOG_AND_CONTINUE : DO_NOT_LOG;
 
@@ -127,11 +1065,11 @@ logging_status log_or_not(bool is_toplevel_mode, bool is_toplevel_function,
   if (opcode != RET_OP)
     return LOG_AND_CONTINUE;
 
-  if (trace->current_toplevel_function.length() == 0)
+  if (trace->current_toplevel_function == -1)
     assert(false &&
            "Returning from within a toplevel function before it was called!");
 
-  if (strcmp(current_function, trace->current_toplevel_function.c_str()) == 0)
+  if (current_function == trace->current_toplevel_function)
     return DO_NOT_LOG;
 
   assert(false && "Cannot call a top level function from within another one!");
@@ -145,18 +1083,13 @@ logging_status log_or_not(bool is_toplevel_mode, bool is_toplevel_function,
 // The output string is prefixed by 0x and is null terminated. The output does
 // NOT account for endianness!
 void convert_bytes_to_hex(char* buf, uint8_t* value, int size) {
-  sprintf(buf, "0x");
-  buf += 2;
-  for (int i = 0; i < size; i++) {
-    buf += sprintf(buf, "%02x", value[i]);
-  }
-  *buf = 0;
+  trace_format_vector(buf, value, size);
 }
 
 // This function is called after every return instruction to update the
 // tracer's status - that is, whether or not it should keep tracing.
-void trace_logger_update_status(char *name, int opcode,
-                                bool is_tracked_function,
+void trace_logger_update_status(trace_module *module, int func_id,
+                                int opcode, bool is_tracked_function,
                                 bool is_toplevel_mode) {
   if (!trace) {
     if (is_tracked_function)
@@ -164,184 +1097,760 @@ void trace_logger_update_status(char *name, int opcode,
     else
       return;
   }
+  // Function names are compared by their global string ID.
+  int64_t func = module->string_base + func_id;
   logging_status temp = trace->current_logging_status;
   trace->current_logging_status =
-      log_or_not(is_toplevel_mode, is_tracked_function, opcode, name);
+      log_or_not(is_toplevel_mode, is_tracked_function, opcode, func);
 
-  if (temp == LOG_AND_CONTINUE && trace->current_logging_status == DO_NOT_LOG) {
+  if (print_status_messages && temp == LOG_AND_CONTINUE &&
+      trace->current_logging_status == DO_NOT_LOG) {
     printf("%s: Stopping logging at inst %ld.\n", trace->trace_name.c_str(),
            trace->inst_count);
     fflush(stdout);
   }
 
-  if (temp == DO_NOT_LOG && trace->current_logging_status != temp) {
+  if (print_status_messages && temp == DO_NOT_LOG &&
+      trace->current_logging_status != temp) {
     printf("%s: Starting to log at inst = %ld.\n", trace->trace_name.c_str(),
            trace->inst_count);
     fflush(stdout);
   }
 
-  if (trace->current_toplevel_function.length() == 0 &&
+  if (trace->current_toplevel_function == -1 &&
       trace->current_logging_status == LOG_AND_CONTINUE) {
-    trace->current_toplevel_function = name;
+    trace->current_toplevel_function = func;
   } else if (trace->current_logging_status == DO_NOT_LOG) {
-    trace->current_toplevel_function = "";
     fin_toplevel();
   }
+  update_logging_enabled();
+}
+
+// Whether the thread is in a logged top-level function. Unlike do_not_log(),
+// this is still true while budget sampling skips instructions.
+bool is_logging() {
+  return trace && trace->current_logging_status != DO_NOT_LOG;
 }
 
 bool do_not_log() {
-  if (!trace)
+  return !is_logging() || trace->skipping;
+}
+
+// Must be called whenever the result of is_logging() may have changed.
+void update_logging_enabled() {
+  trace_logger_logging_enabled = is_logging();
+}
+
+// How much of its budget the current trace has used.
+static uint64_t budget_used() {
+  if (budget.in_insts)
+    return trace->total_insts;
+  return trace->stream.bytes_written + trace->stream.active->size;
+}
+
+static void set_skipping(bool skipping) {
+  if (skipping == trace->skipping)
+    return;
+  // With the index on, chunks never span skipped instructions, so that the
+  // instruction counts of every chunk are contiguous.
+  if (get_trace_writer_config().index)
+    flush_trace_stream(&trace->stream);
+  trace->skipping = skipping;
+  // Timestamp the first block that is logged again.
+  trace->last_was_terminator = true;
+}
+
+static void stop_sampling() {
+  trace->sample_period = 0;
+  if (print_status_messages) {
+    printf("%s: Trace budget used up, stopping logging at inst %ld.\n",
+           trace->trace_name.c_str(), trace->inst_count);
+    fflush(stdout);
+  }
+}
+
+// Start a sampling unit, after lowering the sampling rate if the trace has
+// used enough of its budget.
+void begin_sample_unit() {
+  uint64_t used = budget_used();
+  int64_t period = trace->sample_period;
+  while (trace->sample_period && used >= trace->next_threshold) {
+    if (used >= budget.limit) {
+      stop_sampling();
+      break;
+    }
+    trace->next_threshold += (budget.limit - trace->next_threshold + 1) / 2;
+    trace->sample_period *= 2;
+    trace->unit = 0;
+  }
+  if (print_status_messages && trace->sample_period &&
+      trace->sample_period != period) {
+    printf("%s: Logging 1 in %ld sampling units from inst %ld to stay within "
+           "the trace budget.\n",
+           trace->trace_name.c_str(), trace->sample_period, trace->inst_count);
+    fflush(stdout);
+  }
+  set_skipping(!trace->sample_period ||
+               trace->unit++ % trace->sample_period != 0);
+  trace->window_left = budget.window;
+}
+
+// Called for every instruction of a logged top-level function. Returns false
+// if sampling skips it, in which case it is only counted.
+bool sample_instruction(trace_module *module, int func_id, int bb_id,
+                        int opcode) {
+  if (interval.period)
+    return sample_interval(module, func_id, bb_id, opcode);
+  if (simpoint_config.collect)
+    return count_bbv(module, bb_id);
+  if (simpoint_config.interval)
+    return sample_simpoints(module, func_id, bb_id, opcode);
+  if (loop_sampling.label)
+    return sample_loop(module, func_id, bb_id, opcode);
+  if (!budget.limit)
     return true;
-  return trace->current_logging_status == DO_NOT_LOG;
+  if (budget.window) {
+    if (trace->window_left == 0)
+      begin_sample_unit();
+    trace->window_left--;
+  }
+  // Sampling units are not cut short, except when the budget runs out.
+  if (!trace->skipping && trace->sample_period &&
+      budget_used() >= budget.limit) {
+    stop_sampling();
+    set_skipping(true);
+  }
+  if (trace->skipping) {
+    trace->inst_count++;
+    trace->skipped_insts++;
+    return false;
+  }
+  return true;
+}
+
+// Turn logging on or off, as log says, if the instruction starts a block.
+// Returns true if logging was turned back on after instructions were
+// skipped.
+static bool switch_logging(bool log, trace_module *module, int func_id,
+                           int bb_id) {
+  if (log != trace->skipping || !starts_block(module, func_id, bb_id))
+    return false;
+  set_skipping(!log);
+  return log && trace->gap_insts;
+}
+
+// Count an instruction that periodic or SimPoint sampling skips. Blocks are
+// tracked through skipped instructions as well.
+static bool skip_instruction(trace_module *module, int func_id, int bb_id,
+                             int opcode) {
+  trace->last_was_terminator =
+      opcode >= RET_OP && opcode <= LAST_TERMINATOR_OP;
+  trace->last_module = module;
+  trace->last_func = func_id;
+  trace->last_bb = bb_id;
+  trace->inst_count++;
+  trace->skipped_insts++;
+  trace->gap_insts++;
+  return false;
+}
+
+// What is left of the warmup before the next window of periodic sampling,
+// for the instruction at pos in the period.
+static uint64_t warmup_left(uint64_t pos) {
+  if (!interval.period || pos < interval.window ||
+      pos < interval.period - interval.warmup)
+    return 0;
+  return interval.period - pos;
+}
+
+// sample_instruction() for periodic sampling. Whether an instruction should
+// be logged follows from its position in the period, but logging is only
+// turned on or off at the start of a block.
+bool sample_interval(trace_module *module, int func_id, int bb_id,
+                     int opcode) {
+  uint64_t pos = trace->period_pos;
+  if (++trace->period_pos == interval.period)
+    trace->period_pos = 0;
+  bool log = pos < interval.window || pos >= interval.period - interval.warmup;
+  if (switch_logging(log, module, func_id, bb_id)) {
+    write_window_record(trace->gap_insts, warmup_left(pos));
+    trace->gap_insts = 0;
+  }
+  if (trace->skipping)
+    return skip_instruction(module, func_id, bb_id, opcode);
+  return true;
+}
+
+// sample_instruction() for the second SimPoint pass, which logs the
+// intervals that are simpoints.
+bool sample_simpoints(trace_module *module, int func_id, int bb_id,
+                      int opcode) {
+  const std::vector<trace_simpoint> &simpoints = simpoint_config.simpoints;
+  if (trace->period_pos == 0) {
+    while (trace->next_simpoint < simpoints.size() &&
+           simpoints[trace->next_simpoint].interval < trace->interval_index)
+      trace->next_simpoint++;
+    trace->in_simpoint =
+        trace->next_simpoint < simpoints.size() &&
+        simpoints[trace->next_simpoint].interval == trace->interval_index;
+    trace->pending_simpoint = trace->in_simpoint;
+  }
+  if (++trace->period_pos == simpoint_config.interval) {
+    trace->period_pos = 0;
+    trace->interval_index++;
+  }
+  if (switch_logging(trace->in_simpoint, module, func_id, bb_id)) {
+    write_window_record(trace->gap_insts, 0);
+    trace->gap_insts = 0;
+  }
+  if (trace->skipping)
+    return skip_instruction(module, func_id, bb_id, opcode);
+  // Simpoints that follow another one start without a gap.
+  if (trace->pending_simpoint) {
+    write_simpoint_record(simpoints[trace->next_simpoint]);
+    trace->pending_simpoint = false;
+  }
+  return true;
+}
+
+// sample_instruction() for the first SimPoint pass, which skips every
+// instruction but counts it in the basic block vector of its interval.
+bool count_bbv(trace_module *module, int bb_id) {
+  std::vector<uint64_t> &counts = trace->bbv_counts;
+  uint32_t block = module->string_base + bb_id;
+  // Modules may be registered after the first instruction was counted.
+  if (block >= counts.size())
+    counts.resize(num_registered_strings);
+  if (counts[block]++ == 0)
+    trace->bbv_blocks.push_back(block);
+  trace->inst_count++;
+  trace->skipped_insts++;
+  if (++trace->period_pos == simpoint_config.interval)
+    write_bbv(trace);
+  return false;
+}
+
+static inline bool has_block(const std::vector<int> &blocks, int bb_id) {
+  return std::find(blocks.begin(), blocks.end(), bb_id) != blocks.end();
+}
+
+// sample_instruction() for loop-iteration sampling. Iterations start at the
+// loop header, so logging is turned on or off there, and turned back on when
+// the loop branches to an exit block or its function returns.
+bool sample_loop(trace_module *module, int func_id, int bb_id, int opcode) {
+  const trace_loop *loop = trace->loop;
+  bool new_iteration = false;
+  if (starts_block(module, func_id, bb_id)) {
+    const trace_loop *header = nullptr;
+    for (const trace_loop &other : loop_sampling.loops) {
+      if (other.header == bb_id && other.func == func_id &&
+          other.module == module)
+        header = &other;
+    }
+    if (header) {
+      if (header == loop && trace->last_module == module &&
+          trace->last_func == func_id &&
+          has_block(loop->latches, trace->last_bb)) {
+        trace->loop_iteration++;
+      } else {
+        trace->loop = header;
+        trace->loop_iteration = 0;
+        trace->loop_executions++;
+      }
+      trace->loop_iterations++;
+      uint64_t iteration = trace->loop_iteration;
+      new_iteration =
+          iteration < loop_sampling.first ||
+          (loop_sampling.every && iteration % loop_sampling.every == 0);
+      set_skipping(!new_iteration);
+    } else if (loop && loop->module == module && loop->func == func_id &&
+               has_block(loop->exits, bb_id)) {
+      trace->loop = nullptr;
+      set_skipping(false);
+    }
+    loop = trace->loop;
+  }
+  if (trace->skipping) {
+    skip_instruction(module, func_id, bb_id, opcode);
+    // Returning from inside the loop also ends its execution.
+    if (opcode == RET_OP && loop && loop->module == module &&
+        loop->func == func_id) {
+      trace->loop = nullptr;
+      set_skipping(false);
+    }
+    return false;
+  }
+  if (trace->gap_insts) {
+    write_window_record(trace->gap_insts, 0);
+    trace->gap_insts = 0;
+  }
+  if (new_iteration) {
+    trace->logged_iterations++;
+    write_iteration_record(trace->loop_iteration);
+  }
+  if (opcode == RET_OP && loop && loop->module == module &&
+      loop->func == func_id)
+    trace->loop = nullptr;
+  return true;
 }
 
 // Prints an entry block upon calling a top level function. This also needs to
 // reinitialize the trace state, since the last top level function exit would
 // have deleted it.
-void trace_logger_log_entry(char *func_name, int num_parameters) {
+void trace_logger_log_entry(trace_module *module, int func_id,
+                            int num_parameters) {
   if (!trace) {
     create_trace(default_trace_name);
   }
 
-  if (do_not_log())
+  if (!is_logging())
     return;
 
   open_trace_file();
-  gzprintf(trace->trace_file, "\nentry,%s,%d,\n", func_name, num_parameters);
+  // With the index on, every invocation starts on a new chunk, so that it
+  // can be found in the index.
+  if (get_trace_writer_config().index)
+    flush_trace_stream(&trace->stream);
+  else
+    flush_trace_stream_if_full(&trace->stream);
+  flush_sink_records_if_full();
+  trace->invocation = trace->num_invocations++;
+  // The first SimPoint pass logs nothing.
+  if (simpoint_config.collect)
+    return;
+  if (loop_sampling.label && !loop_sampling.resolved) {
+    fprintf(stderr, "LLVMTRACER_LOOP_LABEL is set, but the program has no "
+                    "labelmap!\n");
+    exit(-1);
+  }
+  // Entries of periodically, SimPoint or loop sampled traces are always
+  // logged, along with the arguments that follow them.
+  if (interval.period || simpoint_config.interval || loop_sampling.label)
+    set_skipping(false);
+  if (budget.limit) {
+    if (budget.window) {
+      // Invocations are cut into windows from their first instruction on, but
+      // their entries are logged while the budget lasts, so that readers see
+      // where they start.
+      set_skipping(!trace->sample_period);
+      trace->window_left = 0;
+    } else {
+      begin_sample_unit();
+    }
+    if (trace->skipping) {
+      trace->skipped_invocations++;
+      return;
+    }
+  }
+  if (timestamps != TIMESTAMPS_OFF) {
+    write_timestamp();
+    trace->entry_timestamped = true;
+  }
+  // An entry that ends a skipped stretch accounts for it, so that the next
+  // window record only counts what is skipped after the entry.
+  if (trace->gap_insts) {
+    write_window_record(trace->gap_insts, warmup_left(trace->period_pos));
+    trace->gap_insts = 0;
+  }
+  if (num_trace_sinks)
+    sink_entry(module, func_id, num_parameters);
+  if (!output_enabled)
+    return;
+  if (trace->format == TRACE_FORMAT_BINARY) {
+    begin_record(TRACE_REC_ENTRY);
+    append_string_id(module, func_id);
+    append_field<int32_t>(num_parameters);
+    write_record();
+    return;
+  }
+  trace_stream_printf(&trace->stream, "\nentry,%s,%d,\n",
+                      lookup_string(module, func_id), num_parameters);
 }
 
-void trace_logger_log0(int line_number, char *name, char *bbid, char *instid,
-                       int opcode, bool is_tracked_function, bool is_toplevel_mode) {
-  if (!trace)
-    return;
+// Write the text of an instruction or parameter line by looking up its names.
+// Lines logged directly by the instrumentation come with their text prebuilt
+// by the Tracer pass, so this is only needed for static records.
+void write_inst_text(trace_module *module, int line_number, int func_id,
+                     int bb_id, int inst_id, int opcode) {
+  trace_stream *stream = &trace->stream;
+  char buf[48];
+  char *p = buf;
+  *p++ = '\n';
+  *p++ = '0';
+  *p++ = ',';
+  p = trace_format_int(p, line_number);
+  *p++ = ',';
+  trace_stream_write(stream, buf, p - buf);
+  const char *names[] = {lookup_string(module, func_id),
+                         lookup_string(module, bb_id),
+                         lookup_string(module, inst_id)};
+  for (int i = 0; i < 3; i++) {
+    trace_stream_write(stream, names[i], strlen(names[i]));
+    trace_stream_write(stream, ",", 1);
+  }
+  p = trace_format_int(buf, opcode);
+  *p++ = ',';
+  p = trace_format_int(p, trace->inst_count);
+  *p++ = '\n';
+  trace_stream_write(stream, buf, p - buf);
+}
+
+void write_param_text(trace_module *module, int line, int size,
+                      const char *value_str, int is_reg, int label,
+                      int is_phi, int prev_bbid) {
+  trace_stream *stream = &trace->stream;
+  char buf[32];
+  char *p = buf;
+  if (line == RESULT_LINE)
+    *p++ = 'r';
+  else if (line == FORWARD_LINE)
+    *p++ = 'f';
+  else
+    p = trace_format_int(p, line);
+  *p++ = ',';
+  p = trace_format_int(p, size);
+  *p++ = ',';
+  trace_stream_write(stream, buf, p - buf);
+  trace_stream_write(stream, value_str, strlen(value_str));
+  buf[0] = ',';
+  p = trace_format_int(buf + 1, is_reg);
+  *p++ = ',';
+  trace_stream_write(stream, buf, p - buf);
+  if (is_reg) {
+    const char *label_str = lookup_string(module, label);
+    trace_stream_write(stream, label_str, strlen(label_str));
+  } else {
+    trace_stream_write(stream, " ", 1);
+  }
+  if (is_phi) {
+    const char *prev_bb_str = lookup_string(module, prev_bbid);
+    trace_stream_write(stream, ",", 1);
+    trace_stream_write(stream, prev_bb_str, strlen(prev_bb_str));
+  }
+  trace_stream_write(stream, ",\n", 2);
+}
+
+// Write a parameter line whose constant parts were built by the Tracer pass.
+void write_prebuilt_param_text(const char *text, int prefix_size,
+                               int suffix_size, const char *value_str,
+                               size_t value_size) {
+  trace_stream *stream = &trace->stream;
+  trace_stream_write(stream, text, prefix_size);
+  trace_stream_write(stream, value_str, value_size);
+  trace_stream_write(stream, text + prefix_size, suffix_size);
+}
 
-  if (do_not_log())
+void trace_logger_log0(trace_module *module, int line_number, int func_id,
+                       int bb_id, int inst_id, int opcode,
+                       bool /*is_tracked_function*/,
+                       bool /*is_toplevel_mode*/, const char *text,
+                       int text_size) {
+  if (!is_logging() || !sample_instruction(module, func_id, bb_id, opcode))
     return;
 
-  gzprintf(trace->trace_file, "\n0,%d,%s,%s,%s,%d,%ld\n", line_number, name,
-           bbid, instid, opcode, trace->inst_count);
+  flush_trace_stream_if_full(&trace->stream);
+  flush_sink_records_if_full();
+  begin_instruction(module, func_id, bb_id, opcode);
+  if (num_trace_sinks)
+    sink_inst(module, line_number, func_id, bb_id, inst_id, opcode);
+  if (output_enabled && trace->format == TRACE_FORMAT_BINARY) {
+    begin_record(TRACE_REC_INST);
+    append_field<int32_t>(line_number);
+    append_string_id(module, func_id);
+    append_string_id(module, bb_id);
+    append_string_id(module, inst_id);
+    append_field<int32_t>(opcode);
+    append_field<int64_t>(trace->inst_count);
+    write_record();
+  } else if (output_enabled) {
+    // Only the instruction count is formatted here.
+    char buf[24];
+    char *end = trace_format_int(buf, trace->inst_count);
+    *end++ = '\n';
+    trace_stream_write(&trace->stream, text, text_size);
+    trace_stream_write(&trace->stream, buf, end - buf);
+  }
   trace->inst_count++;
+  trace->total_insts++;
+}
+
+void begin_param_record(trace_record_tag tag, int line, int size) {
+  begin_record(tag);
+  append_field<int32_t>(line);
+  append_field<int32_t>(size);
 }
 
-void trace_logger_log_int(int line, int size, int64_t value, int is_reg,
-                          char *label, int is_phi, char *prev_bbid) {
+void end_param_record(trace_module *module, int is_reg, int label, int is_phi,
+                      int prev_bbid) {
+  append_field<uint8_t>((is_reg ? PARAM_IS_REG : 0) |
+                        (is_phi ? PARAM_IS_PHI : 0));
+  if (is_reg)
+    append_string_id(module, label);
+  if (is_phi)
+    append_string_id(module, prev_bbid);
+  write_record();
+}
+
+void trace_logger_log_int(trace_module *module, int line, int size,
+                          int64_t value, int is_reg, int label, int is_phi,
+                          int prev_bbid, const char *text, int prefix_size,
+                          int suffix_size) {
   if (!trace || do_not_log())
     return;
+  if (num_trace_sinks)
+    sink_param(module, line, size, TRACE_REC_INT, value, is_reg, label, is_phi,
+               prev_bbid);
+  if (!output_enabled)
+    return;
 
-  gzFile gz_file = trace->trace_file;
+  if (trace->format == TRACE_FORMAT_BINARY) {
+    begin_param_record(TRACE_REC_INT, line, size);
+    append_field<int64_t>(value);
+    end_param_record(module, is_reg, label, is_phi, prev_bbid);
+    return;
+  }
 
-  if (line == RESULT_LINE)
-    gzprintf(gz_file, "r,%d,%ld,%d", size, value, is_reg);
-  else if (line == FORWARD_LINE)
-    gzprintf(gz_file, "f,%d,%ld,%d", size, value, is_reg);
-  else
-    gzprintf(gz_file, "%d,%d,%ld,%d", line, size, value, is_reg);
-  if (is_reg)
-    gzprintf(gz_file, ",%s", label);
-  else
-    gzprintf(gz_file, ", ");
-  if (is_phi)
-    gzprintf(gz_file, ",%s,\n", prev_bbid);
-  else
-    gzprintf(gz_file, ",\n");
+  char value_str[TRACE_VALUE_TEXT_SIZE];
+  char *end = trace_format_int(value_str, value);
+  write_prebuilt_param_text(text, prefix_size, suffix_size, value_str,
+                            end - value_str);
 }
 
-void trace_logger_log_ptr(int line, int size, uint64_t value, int is_reg,
-                          char *label, int is_phi, char *prev_bbid) {
+void trace_logger_log_ptr(trace_module *module, int line, int size,
+                          uint64_t value, int is_reg, int label, int is_phi,
+                          int prev_bbid, const char *text, int prefix_size,
+                          int suffix_size) {
   if (!trace || do_not_log())
     return;
+  if (num_trace_sinks)
+    sink_param(module, line, size, TRACE_REC_PTR, value, is_reg, label, is_phi,
+               prev_bbid);
+  if (!output_enabled)
+    return;
 
-  gzFile gz_file = trace->trace_file;
+  if (trace->format == TRACE_FORMAT_BINARY) {
+    begin_param_record(TRACE_REC_PTR, line, size);
+    append_field<uint64_t>(value);
+    end_param_record(module, is_reg, label, is_phi, prev_bbid);
+    return;
+  }
 
-  if (line == RESULT_LINE)
-    gzprintf(gz_file, "r,%d,%#llx,%d", size, value, is_reg);
-  else if (line == FORWARD_LINE)
-    gzprintf(gz_file, "f,%d,%#llx,%d", size, value, is_reg);
-  else
-    gzprintf(gz_file, "%d,%d,%#llx,%d", line, size, value, is_reg);
-  if (is_reg)
-    gzprintf(gz_file, ",%s", label);
-  else
-    gzprintf(gz_file, ", ");
-  if (is_phi)
-    gzprintf(gz_file, ",%s,\n", prev_bbid);
-  else
-    gzprintf(gz_file, ",\n");
+  char value_str[TRACE_VALUE_TEXT_SIZE];
+  char *end = trace_format_ptr(value_str, value);
+  write_prebuilt_param_text(text, prefix_size, suffix_size, value_str,
+                            end - value_str);
 }
 
-void trace_logger_log_string(int line,
+void trace_logger_log_string(trace_module *module,
+                             int line,
                              int size,
-                             char *value,
+                             int value,
                              int is_reg,
-                             char *label,
+                             int label,
                              int is_phi,
-                             char *prev_bbid) {
+                             int prev_bbid,
+                             const char *text,
+                             int prefix_size,
+                             int suffix_size) {
   if (!trace || do_not_log())
     return;
+  if (num_trace_sinks)
+    sink_param(module, line, size, TRACE_REC_STRING, value, is_reg, label,
+               is_phi, prev_bbid);
+  if (!output_enabled)
+    return;
 
-  gzFile gz_file = trace->trace_file;
+  if (trace->format == TRACE_FORMAT_BINARY) {
+    begin_param_record(TRACE_REC_STRING, line, size);
+    append_string_id(module, value);
+    end_param_record(module, is_reg, label, is_phi, prev_bbid);
+    return;
+  }
 
-  if (line == RESULT_LINE)
-    gzprintf(gz_file, "r,%d,%s,%d", size, value, is_reg);
-  else if (line == FORWARD_LINE)
-    gzprintf(gz_file, "f,%d,%s,%d", size, value, is_reg);
-  else
-    gzprintf(gz_file, "%d,%d,%s,%d", line, size, value, is_reg);
-  if (is_reg)
-    gzprintf(gz_file, ",%s", label);
-  else
-    gzprintf(gz_file, ", ");
-  if (is_phi)
-    gzprintf(gz_file, ",%s,\n", prev_bbid);
-  else
-    gzprintf(gz_file, ",\n");
+  const char *value_str = lookup_string(module, value);
+  write_prebuilt_param_text(text, prefix_size, suffix_size, value_str,
+                            strlen(value_str));
 }
 
-void trace_logger_log_double(int line, int size, double value, int is_reg,
-                             char *label, int is_phi, char *prev_bbid) {
+void trace_logger_log_double(trace_module *module, int line, int size,
+                             double value, int is_reg, int label, int is_phi,
+                             int prev_bbid, const char *text, int prefix_size,
+                             int suffix_size) {
   if (!trace || do_not_log())
     return;
+  if (num_trace_sinks) {
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    sink_param(module, line, size, TRACE_REC_DOUBLE, bits, is_reg, label,
+               is_phi, prev_bbid);
+  }
+  if (!output_enabled)
+    return;
 
-  gzFile gz_file = trace->trace_file;
+  if (trace->format == TRACE_FORMAT_BINARY) {
+    begin_param_record(TRACE_REC_DOUBLE, line, size);
+    append_field<double>(value);
+    end_param_record(module, is_reg, label, is_phi, prev_bbid);
+    return;
+  }
 
-  if (line == RESULT_LINE)
-    gzprintf(gz_file, "r,%d,%f,%d", size, value, is_reg);
-  else if (line == FORWARD_LINE)
-    gzprintf(gz_file, "f,%d,%f,%d", size, value, is_reg);
-  else
-    gzprintf(gz_file, "%d,%d,%f,%d", line, size, value, is_reg);
-  if (is_reg)
-    gzprintf(gz_file, ",%s", label);
-  else
-    gzprintf(gz_file, ", ");
-  if (is_phi)
-    gzprintf(gz_file, ",%s,\n", prev_bbid);
-  else
-    gzprintf(gz_file, ",\n");
+  char value_str[TRACE_VALUE_TEXT_SIZE];
+  char *end = trace_format_double(value_str, value);
+  write_prebuilt_param_text(text, prefix_size, suffix_size, value_str,
+                            end - value_str);
 }
 
-void trace_logger_log_vector(int line, int size, uint8_t* value, int is_reg,
-                             char *label, int is_phi, char *prev_bbid) {
+void trace_logger_log_vector(trace_module *module, int line, int size,
+                             uint8_t *value, int is_reg, int label, int is_phi,
+                             int prev_bbid, const char *text, int prefix_size,
+                             int suffix_size) {
   if (!trace || do_not_log())
     return;
+  if (num_trace_sinks)
+    sink_param(module, line, size, TRACE_REC_VECTOR, (uintptr_t)value, is_reg,
+               label, is_phi, prev_bbid);
+  if (!output_enabled)
+    return;
 
-  char value_str[size/4+3];  // +3 for "0x" and null termination.
-  convert_bytes_to_hex(&value_str[0], value, size/8);
+  if (trace->format == TRACE_FORMAT_BINARY) {
+    begin_param_record(TRACE_REC_VECTOR, line, size);
+    record_buf.append(reinterpret_cast<char *>(value), size / 8);
+    end_param_record(module, is_reg, label, is_phi, prev_bbid);
+    return;
+  }
 
-  gzFile gz_file = trace->trace_file;
+  char value_str[TRACE_VECTOR_TEXT_SIZE(size)];
+  char *end = trace_format_vector(value_str, value, size / 8);
+  write_prebuilt_param_text(text, prefix_size, suffix_size, value_str,
+                            end - value_str);
+}
 
-  if (line == RESULT_LINE)
-    gzprintf(gz_file, "r,%d,%s,%d", size, value_str, is_reg);
-  else if (line == FORWARD_LINE)
-    gzprintf(gz_file, "f,%d,%s,%d", size, value_str, is_reg);
-  else
-    gzprintf(gz_file, "%d,%d,%s,%d", line, size, value_str, is_reg);
-  if (is_reg)
-    gzprintf(gz_file, ",%s", label);
-  else
-    gzprintf(gz_file, ", ");
-  if (is_phi)
-    gzprintf(gz_file, ",%s,\n", prev_bbid);
-  else
-    gzprintf(gz_file, ",\n");
+// Expand one parameter of a static record to text. value points to the
+// parameter's dynamic value slots, if it has any.
+void write_static_param_text(trace_module *module,
+                             const trace_static_param &param,
+                             const uint64_t *value) {
+  uint64_t bits = (param.flags & PARAM_IS_DYNAMIC) ? *value : param.value;
+  char buf[param.kind == TRACE_REC_VECTOR ? TRACE_VECTOR_TEXT_SIZE(param.size)
+                                          : TRACE_VALUE_TEXT_SIZE];
+  const char *value_str = buf;
+  switch (param.kind) {
+    case TRACE_REC_INT:
+      trace_format_int(buf, bits);
+      break;
+    case TRACE_REC_PTR:
+      trace_format_ptr(buf, bits);
+      break;
+    case TRACE_REC_DOUBLE: {
+      double d;
+      memcpy(&d, &bits, sizeof(d));
+      trace_format_double(buf, d);
+      break;
+    }
+    case TRACE_REC_STRING:
+      value_str = lookup_string(module, bits);
+      break;
+    case TRACE_REC_VECTOR:
+      // Vectors are always dynamic.
+      trace_format_vector(buf, (const uint8_t *)value, param.size / 8);
+      break;
+  }
+  write_param_text(module, param.line, param.size, value_str,
+                   param.flags & PARAM_IS_REG, param.label,
+                   param.flags & PARAM_IS_PHI, param.prev_bbid);
+}
+
+// Give one static record to the sinks, like write_static_param_text().
+void sink_static_record(trace_module *module,
+                        const trace_static_record &record,
+                        const trace_static_param *params,
+                        const uint64_t *values) {
+  if (record.kind == STATIC_INST)
+    sink_inst(module, record.line, record.func, record.bb, record.inst,
+              record.opcode);
+  for (uint16_t i = 0; i < record.num_params; i++) {
+    const trace_static_param &param = params[i];
+    uint64_t bits = (param.flags & PARAM_IS_DYNAMIC) ? *values : param.value;
+    if (param.kind == TRACE_REC_VECTOR)
+      bits = (uintptr_t)values;
+    sink_param(module, param.line, param.size, (trace_record_tag)param.kind,
+               bits, param.flags & PARAM_IS_REG, param.label,
+               param.flags & PARAM_IS_PHI, param.prev_bbid);
+    values += static_param_slots(param);
+  }
+}
+
+// Writes one static record, whose dynamic values start at values.
+void write_static_record(trace_module *module, int record_id,
+                         const uint64_t *values) {
+  trace_static_table *table = module->records;
+  const trace_static_record &record = table->records[record_id];
+  const trace_static_param *params = &table->params[record.first_param];
+
+  if (record.kind == STATIC_INST
+          ? !sample_instruction(module, record.func, record.bb, record.opcode)
+          : trace->skipping)
+    return;
+  if (record.kind == STATIC_INST) {
+    flush_trace_stream_if_full(&trace->stream);
+    flush_sink_records_if_full();
+    begin_instruction(module, record.func, record.bb, record.opcode);
+  }
+  if (num_trace_sinks)
+    sink_static_record(module, record, params, values);
+  if (output_enabled && trace->format == TRACE_FORMAT_BINARY) {
+    begin_record(TRACE_REC_STATIC);
+    append_field<uint32_t>(module->record_base + record_id);
+    if (record.kind == STATIC_INST)
+      append_field<int64_t>(trace->inst_count);
+    for (uint16_t i = 0; i < record.num_params; i++) {
+      if (!(params[i].flags & PARAM_IS_DYNAMIC))
+        continue;
+      if (params[i].kind == TRACE_REC_VECTOR) {
+        record_buf.append(reinterpret_cast<const char *>(values),
+                          params[i].size / 8);
+        values += static_param_slots(params[i]);
+      } else {
+        append_field<uint64_t>(*values++);
+      }
+    }
+    write_record();
+  } else if (output_enabled) {
+    if (record.kind == STATIC_INST)
+      write_inst_text(module, record.line, record.func, record.bb, record.inst,
+                      record.opcode);
+    for (uint16_t i = 0; i < record.num_params; i++) {
+      write_static_param_text(module, params[i], values);
+      values += static_param_slots(params[i]);
+    }
+  }
+  if (record.kind == STATIC_INST) {
+    trace->inst_count++;
+    trace->total_insts++;
+  }
+}
+
+// Logs a static record. Everything but the dynamic parameter values, which
+// are passed in values, comes from the module's static record table.
+void trace_logger_log_static(trace_module *module, int record_id,
+                             uint64_t *values) {
+  if (!is_logging())
+    return;
+  write_static_record(module, record_id, values);
+}
+
+// Logs every static record of a segment. The dynamic values of the records
+// are packed one after another in values.
+void trace_logger_log_block(trace_module *module, int segment_id,
+                            uint64_t *values) {
+  if (!is_logging())
+    return;
+
+  trace_static_table *table = module->records;
+  const trace_static_segment &segment = table->segments[segment_id];
+  const uint32_t *record_ids = &table->segment_records[segment.first_record];
+  for (uint32_t i = 0; i < segment.num_records; i++) {
+    write_static_record(module, record_ids[i], values);
+    values += table->records[record_ids[i]].num_slots;
+  }
 }
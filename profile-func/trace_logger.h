@@ -7,11 +7,21 @@
 #include <assert.h>
 #include <zlib.h>
 #include <pthread.h>
+#include <atomic>
 #include <map>
+#include <string>
+#include <vector>
+
+#include "trace_format.h"
+#include "trace_sink.h"
+#include "trace_text.h"
+#include "trace_writer.h"
 
 #define RESULT_LINE 19134
 #define FORWARD_LINE 24601
 #define RET_OP 1
+// Terminator instructions have opcodes RET_OP to LAST_TERMINATOR_OP.
+#define LAST_TERMINATOR_OP 10
 
 enum logging_status {
   // Log the current instruction and continue logging.
@@ -20,48 +30,349 @@ enum logging_status {
   DO_NOT_LOG,
 };
 
+// Static tables of an instrumented module.
+//
+// The Tracer pass emits one of these into every module it instruments and
+// registers it from a global constructor. All names the instrumentation logs
+// (functions, basic blocks, instructions, operands) are interned into
+// strings, and the logging functions take indices into it instead of the names
+// themselves. The layout must match the struct built by the Tracer pass.
+struct trace_module {
+  // Global ID of strings[0], assigned when the module is registered.
+  int64_t string_base;
+  int64_t num_strings;
+  const char *const *strings;
+  trace_module *next;
+  // Serialized static record table, if the module was instrumented with
+  // -static-inst-table. See trace_format.h.
+  const uint8_t *static_table;
+  int64_t static_table_size;
+  // Global ID of the first static record, assigned at registration.
+  int64_t record_base;
+  // The parsed static record table, owned by the runtime.
+  trace_static_table *records;
+  // The loop table, num_loops rows of TRACE_LOOP_ROW_SIZE fields. See
+  // trace_format.h.
+  const uint32_t *loops;
+  int64_t num_loops;
+};
+
+static inline const char *lookup_string(trace_module *module, int id) {
+  return module->strings[id];
+}
+
+// Trace size budget, set with LLVMTRACER_TRACE_BUDGET.
+//
+// Every trace may use up to limit bytes of (uncompressed) output, or limit
+// logged instructions if in_insts is set. Once half of the budget is used,
+// the logger only logs one in every two sampling units, and the rate halves
+// again whenever half of the remaining budget is used, until the budget runs
+// out and logging stops. Sampling units are windows of
+// LLVMTRACER_SAMPLE_WINDOW instructions (default 10000), starting at the first
+// instruction of every top-level invocation, or whole invocations if it is 0.
+// Skipped instructions are still counted, and the sampling record at the end
+// of the trace tells how many there were.
+//
+// The budget is kept by every thread's trace_info rather than by trace name:
+// threads that write to the same trace each get the whole budget and each
+// write their own sampling record, and a thread that switches to another
+// trace name keeps using the budget it has left.
+struct trace_budget {
+  // Zero if there is no budget.
+  uint64_t limit;
+  bool in_insts;
+  uint64_t window;
+};
+
+// Periodic sampling, set with LLVMTRACER_SAMPLE_PERIOD.
+//
+// Out of every period instructions, the logger logs a window of window
+// instructions (LLVMTRACER_SAMPLE_WINDOW), preceded by warmup instructions
+// (LLVMTRACER_SAMPLE_WARMUP, default 0) for simulators to warm up their
+// state with, and skips the rest. Periods run on across top-level
+// invocations, and logging is only turned on and off at the start of a basic
+// block, so windows end up a little longer or shorter than asked for. Every
+// stretch that is logged after a gap starts with a window record.
+struct trace_interval_sampling {
+  // Zero if periodic sampling is off.
+  uint64_t period;
+  uint64_t window;
+  uint64_t warmup;
+};
+
+// SimPoint-style sampling, set with LLVMTRACER_BBV_INTERVAL.
+//
+// Instructions of logged top-level functions are cut into intervals of that
+// many instructions, which run on across invocations like periods. In the
+// first pass, nothing is traced; the logger only counts the instructions
+// executed in every basic block (by global string ID) during each interval,
+// and writes these basic block vectors to <trace_name>.bbv at exit.
+// trace-simpoint clusters them into phases and picks one representative
+// interval of each phase. In the second pass, with LLVMTRACER_SIMPOINTS
+// naming the file it wrote, only those intervals are logged, each after a
+// simpoint record with its weight. As with periodic sampling, logging only
+// starts and stops at the start of a basic block.
+struct trace_simpoint {
+  uint64_t interval;
+  double weight;
+};
+
+struct trace_simpoint_config {
+  // Zero if SimPoint sampling is off.
+  uint64_t interval;
+  // Whether this is the first pass, which collects basic block vectors.
+  bool collect;
+  // The intervals to trace in the second pass, in order.
+  std::vector<trace_simpoint> simpoints;
+};
+
+// Loop-iteration sampling, set with LLVMTRACER_LOOP_LABEL.
+//
+// The label names a labeled loop in the labelmap, as <function>/<label>.
+// Everything outside the loop is logged, but of every execution of the loop
+// only the first LLVMTRACER_LOOP_FIRST iterations and every
+// LLVMTRACER_LOOP_EVERY-th one after them are. An iteration starts whenever
+// the loop header is reached; it is the first of a new execution of the loop
+// unless it was reached from a latch. Logged iterations start with an
+// iteration record, and the loop record at the end of the trace gives the
+// trip counts.
+struct trace_loop {
+  trace_module *module;
+  int func;
+  int header;
+  std::vector<int> latches;
+  std::vector<int> exits;
+};
+
+struct trace_loop_sampling {
+  // Null if loop-iteration sampling is off.
+  const char *label;
+  uint64_t first;
+  uint64_t every;
+  // The loops the label refers to, found once the labelmap is registered.
+  // There may be several if the function of the loop was inlined.
+  std::vector<trace_loop> loops;
+  bool resolved;
+};
+
+// The trace of one thread. It is created the first time the thread calls a
+// top-level function, reused for all later calls, and only destroyed at exit.
 struct trace_info {
   std::string trace_name;
-  gzFile trace_file;
+  // The output for trace_name, looked up on first use.
+  trace_output *output;
+  trace_stream stream;
   int64_t inst_count;
-  std::string current_toplevel_function;
+  // Number of instructions logged over all invocations.
+  uint64_t total_insts;
+  // The last top-level invocation that was logged, and how many there were.
+  int64_t invocation;
+  int64_t num_invocations;
+  // Global string ID of the top-level function being traced, or -1.
+  int64_t current_toplevel_function;
   logging_status current_logging_status;
+  trace_format format;
+  // The basic block of the last logged instruction, and whether that
+  // instruction was a terminator. Used for the context of chunks, and to find
+  // the start of a basic block when timestamps are on.
+  trace_module *last_module;
+  int last_func;
+  int last_bb;
+  bool last_was_terminator;
+  // The entry record was just timestamped, so the first block needs none.
+  bool entry_timestamped;
+  // Budget sampling state (see trace_budget). One in every sample_period
+  // units is logged, or none if it is 0. The rate drops again once the budget
+  // use reaches next_threshold. unit counts the units since the last change
+  // of rate, and window_left the instructions left in the current unit.
+  int64_t sample_period;
+  uint64_t next_threshold;
+  int64_t unit;
+  uint64_t window_left;
+  // Whether the current unit is skipped.
+  bool skipping;
+  // Number of instructions and top-level invocations that were skipped.
+  uint64_t skipped_insts;
+  int64_t skipped_invocations;
+  // Periodic sampling state (see trace_interval_sampling): the position in
+  // the current period, and the number of instructions skipped since the
+  // last logged one.
+  uint64_t period_pos;
+  uint64_t gap_insts;
+  // SimPoint state (see trace_simpoint_config). The first pass counts the
+  // instructions of each block in bbv_counts, lists the blocks counted in
+  // the current interval in bbv_blocks, and keeps the vectors of completed
+  // intervals in bbv_text. The second pass tracks the current interval, the
+  // next simpoint, whether the interval is one, and whether its simpoint
+  // record is still to be written.
+  std::vector<uint64_t> bbv_counts;
+  std::vector<uint32_t> bbv_blocks;
+  std::string bbv_text;
+  uint64_t interval_index;
+  size_t next_simpoint;
+  bool in_simpoint;
+  bool pending_simpoint;
+  // Loop-iteration sampling state (see trace_loop_sampling): the loop whose
+  // execution is under way, if any, the current iteration of it, and the
+  // totals for the loop record.
+  const trace_loop *loop;
+  uint64_t loop_iteration;
+  uint64_t loop_executions;
+  uint64_t loop_iterations;
+  uint64_t logged_iterations;
+  // The batch of records for in-process sinks, and the bytes of the vector
+  // values in it, which its records point to by offset until it is passed on.
+  std::vector<llvmtracer_record> sink_records;
+  std::string sink_vectors;
+  // Link in the list of all traces.
+  trace_info *next;
 
   trace_info(const char *_trace_name)
-      : trace_name(_trace_name), inst_count(0),
-        current_logging_status(DO_NOT_LOG) {}
+      : trace_name(_trace_name), output(nullptr), inst_count(0),
+        total_insts(0), invocation(-1), num_invocations(0),
+        current_toplevel_function(-1),
+        current_logging_status(DO_NOT_LOG), format(TRACE_FORMAT_TEXT),
+        last_module(nullptr), last_func(-1), last_bb(-1),
+        last_was_terminator(false), entry_timestamped(false),
+        sample_period(1), next_threshold(0), unit(0), window_left(0),
+        skipping(false), skipped_insts(0), skipped_invocations(0),
+        period_pos(0), gap_insts(0), interval_index(0), next_simpoint(0),
+        in_simpoint(false), pending_simpoint(false), loop(nullptr),
+        loop_iteration(0), loop_executions(0), loop_iterations(0),
+        logged_iterations(0), next(nullptr) {
+    init_trace_stream(&stream);
+    stream.get_context = &get_chunk_context;
+    stream.context_arg = this;
+  }
+  ~trace_info() { destroy_trace_stream(&stream); }
+
+  static void get_chunk_context(void *arg, trace_chunk_context &context);
+};
+
+// Which invocations of each top-level function to trace when the program was
+// instrumented with -native-clones. The rest run the uninstrumented clone.
+struct invocation_range {
+  int64_t first;
+  int64_t last;
+};
+
+struct invocation_policy {
+  // Trace invocations whose index is a multiple of every, if nonzero.
+  int64_t every;
+  // Trace invocations whose index is in one of these ranges.
+  std::vector<invocation_range> ranges;
+  // Number of invocations so far of each top-level function, indexed by the
+  // global string ID of its name.
+  std::atomic<int64_t> *counts;
+  int64_t num_counts;
+
+  invocation_policy() : every(0), counts(nullptr), num_counts(0) {}
 };
 
 void create_trace(const char *trace_name);
+void write_inst_text(trace_module *module, int line_number, int func_id,
+                     int bb_id, int inst_id, int opcode);
+void write_param_text(trace_module *module, int line, int size,
+                      const char *value_str, int is_reg, int label,
+                      int is_phi, int prev_bbid);
+void write_prebuilt_param_text(const char *text, int prefix_size,
+                               int suffix_size, const char *value_str,
+                               size_t value_size);
 void write_labelmap();
+void write_timestamp();
+void write_sampling_record(trace_info *info);
+void write_window_record(uint64_t skipped_insts, uint64_t warmup_insts);
+void write_simpoint_record(const trace_simpoint &simpoint);
+void write_iteration_record(uint64_t iteration);
+void write_loop_record(trace_info *info);
+void write_bbv(trace_info *info);
+void write_bbv_file(trace_info *info);
+llvmtracer_record &add_sink_record(trace_info *info, uint32_t kind);
+void sink_entry(trace_module *module, int func_id, int num_parameters);
+void sink_inst(trace_module *module, int line_number, int func_id, int bb_id,
+               int inst_id, int opcode);
+void sink_param(trace_module *module, int line, int size,
+                trace_record_tag type, uint64_t bits, int is_reg, int label,
+                int is_phi, int prev_bbid);
+void flush_sink_records(trace_info *info);
+void load_trace_sink_plugins();
+void finish_trace_sinks();
+void begin_instruction(trace_module *module, int func_id, int bb_id,
+                       int opcode);
+void write_binary_header();
 void open_trace_file();
 extern "C" {
+  // Nonzero when the calling thread is in a logged top-level function. The
+  // instrumentation reads this inline to skip logging calls entirely when
+  // tracing is off. Calls are still made while sampling skips instructions,
+  // so that they are counted.
+  extern thread_local uint8_t trace_logger_logging_enabled;
+
   void trace_logger_init();
+  void trace_logger_register_module(trace_module *module);
   void trace_logger_register_labelmap(const char *labelmap_buf,
                                       size_t labelmap_size);
-  void trace_logger_log0(int line_number, char *name, char *bbid, char *instid,
-                         int opcode, bool is_tracked_function,
-                         bool is_toplevel_mode);
+  // The logging functions for instructions and parameters also take the
+  // parts of the text trace line that are the same every time the call
+  // executes, as built by the Tracer pass: text holds the line up to the
+  // dynamic instruction count (text_size bytes) for trace_logger_log0, and
+  // the prefix_size bytes before the parameter value followed by the
+  // suffix_size bytes after it for the parameter functions. They are only
+  // used for text traces.
+  void trace_logger_log0(trace_module *module, int line_number, int func_id,
+                         int bb_id, int inst_id, int opcode,
+                         bool is_tracked_function, bool is_toplevel_mode,
+                         const char *text, int text_size);
   void trace_logger_log_label();
-  void trace_logger_log_entry(char *func_name, int num_parameters);
-  void trace_logger_log_ptr(int line, int size, uint64_t value, int is_reg,
-                            char *label, int is_phi, char *prev_bbid);
-  void trace_logger_log_string(int line, int size, char *value, int is_reg,
-                               char *label, int is_phi, char *prev_bbid);
-  void trace_logger_log_int(int line, int size, int64_t value, int is_reg,
-                            char *label, int is_phi, char *prev_bbid);
-  void trace_logger_log_double(int line, int size, double value, int is_reg,
-                               char *label, int is_phi, char *prev_bbid);
-  void trace_logger_log_vector(int line, int size, uint8_t *value, int is_reg,
-                               char *label, int is_phi, char *prev_bbid);
-  void trace_logger_update_status(char *name, int opcode,
-                                  bool is_tracked_function,
+  void trace_logger_log_entry(trace_module *module, int func_id,
+                              int num_parameters);
+  void trace_logger_log_ptr(trace_module *module, int line, int size,
+                            uint64_t value, int is_reg, int label, int is_phi,
+                            int prev_bbid, const char *text, int prefix_size,
+                            int suffix_size);
+  void trace_logger_log_string(trace_module *module, int line, int size,
+                               int value, int is_reg, int label, int is_phi,
+                               int prev_bbid, const char *text,
+                               int prefix_size, int suffix_size);
+  void trace_logger_log_int(trace_module *module, int line, int size,
+                            int64_t value, int is_reg, int label, int is_phi,
+                            int prev_bbid, const char *text, int prefix_size,
+                            int suffix_size);
+  void trace_logger_log_double(trace_module *module, int line, int size,
+                               double value, int is_reg, int label, int is_phi,
+                               int prev_bbid, const char *text,
+                               int prefix_size, int suffix_size);
+  void trace_logger_log_vector(trace_module *module, int line, int size,
+                               uint8_t *value, int is_reg, int label,
+                               int is_phi, int prev_bbid, const char *text,
+                               int prefix_size, int suffix_size);
+  void trace_logger_log_static(trace_module *module, int record_id,
+                               uint64_t *values);
+  void trace_logger_log_block(trace_module *module, int segment_id,
+                              uint64_t *values);
+  void trace_logger_update_status(trace_module *module, int func_id,
+                                  int opcode, bool is_tracked_function,
                                   bool is_toplevel_mode);
   void llvmtracer_set_trace_name(const char *trace_name);
+  bool trace_logger_trace_invocation(trace_module *module, int func_id);
 }
 void fin_main();
 void fin_toplevel();
 logging_status log_or_not(bool is_toplevel_mode, bool is_toplevel_function,
-                          int opcode, char *current_function);
+                          int opcode, int64_t current_function);
 void convert_bytes_to_hex(char *buf, uint8_t *value, int size);
 bool do_not_log();
+bool is_logging();
+bool sample_instruction(trace_module *module, int func_id, int bb_id,
+                        int opcode);
+bool sample_interval(trace_module *module, int func_id, int bb_id,
+                     int opcode);
+bool sample_simpoints(trace_module *module, int func_id, int bb_id,
+                      int opcode);
+bool count_bbv(trace_module *module, int bb_id);
+bool sample_loop(trace_module *module, int func_id, int bb_id, int opcode);
+void resolve_loop_label();
+void begin_sample_unit();
+invocation_policy *parse_invocation_policy(const char *spec);
+bool should_trace_invocation(invocation_policy *policy, int64_t invocation);
+void update_logging_enabled();
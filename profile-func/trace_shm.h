@@ -0,0 +1,174 @@
+#ifndef __LLVM_TRACER_TRACE_SHM_H__
+#define __LLVM_TRACER_TRACE_SHM_H__
+
+#include <errno.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include <atomic>
+#include <string>
+
+#include "trace_codec.h"
+
+// Shared memory trace rings.
+//
+// With LLVMTRACER_TRACE_SINK=shm (or shm+file, which writes the trace file as
+// well), the runtime does not compress traces but streams every chunk into a
+// ring buffer in POSIX shared memory, one per trace name, from which another
+// process on the same machine reads it while the program runs. The ring is
+// named by trace_shm_name() and holds LLVMTRACER_SHM_SIZE bytes (default 64MB,
+// rounded up to a power of two).
+//
+// Each ring has a single producer (the runtime, which writes chunks in the
+// same order as it would write them to the file) and a single consumer. When
+// the ring is full, the producer waits for the consumer, so a program whose
+// trace is not consumed stops once its ring fills up. The data in the ring is
+// a stream of messages, one per chunk:
+//
+//   u32 tag_size, the chunk tag (see trace_codec.h), u64 size, size bytes of
+//   the chunk
+//
+// so the chunks of different threads can be told apart like in trace files.
+// The stream ends when the producer closes the ring. The producer removes
+// the ring's name when it is done if a consumer is attached. Otherwise the
+// ring stays until a consumer has read it, which then removes it.
+//
+// trace_input::open_shm() (and trace_reader::open_shm()) attach to a ring as
+// its consumer; see trace-shm-consume for an example.
+
+#define TRACE_SHM_MAGIC 0x474e4952544c4cull  // "LLTRING"
+#define TRACE_SHM_VERSION 1
+// Offset of the data from the start of the ring.
+#define TRACE_SHM_DATA_OFFSET 256
+
+struct trace_shm_ring {
+  // Set to TRACE_SHM_MAGIC by the producer once the ring is initialized.
+  std::atomic<uint64_t> magic;
+  uint32_t version;
+  // Size of the data, a power of two.
+  uint64_t capacity;
+  // Process IDs of the producer and the consumer, or 0 if none is attached.
+  std::atomic<int32_t> producer;
+  std::atomic<int32_t> consumer;
+  // Set by the producer after the last message.
+  std::atomic<uint32_t> closed;
+  // Set by the consumer if it stops reading before the end.
+  std::atomic<uint32_t> detached;
+  // Number of bytes ever written and read. Both only grow, and the data
+  // between them is at their offsets modulo the capacity.
+  alignas(64) std::atomic<uint64_t> head;
+  alignas(64) std::atomic<uint64_t> tail;
+
+  char *data() {
+    return reinterpret_cast<char *>(this) + TRACE_SHM_DATA_OFFSET;
+  }
+};
+
+static_assert(sizeof(trace_shm_ring) <= TRACE_SHM_DATA_OFFSET,
+              "The ring header overlaps its data.");
+
+// The shared memory name of the ring of the trace called trace_name.
+static inline std::string trace_shm_name(const std::string &trace_name) {
+  std::string name = "/llvm-tracer." + trace_name;
+  for (size_t i = 1; i < name.size(); i++) {
+    if (name[i] == '/')
+      name[i] = '_';
+  }
+  return name;
+}
+
+// Called while waiting on the other side of the ring: spin for a while, then
+// sleep for longer and longer, up to 100us.
+static inline void trace_shm_wait(unsigned &waits) {
+  if (waits++ < 64)
+    return;
+  unsigned shift = waits - 64 < 7 ? waits - 64 : 7;
+  struct timespec delay = {0, 1000l << shift};
+  if (delay.tv_nsec > 100000)
+    delay.tv_nsec = 100000;
+  nanosleep(&delay, NULL);
+}
+
+// Whether the process pid has exited. Only checked every so often while
+// waiting, so that a ring does not wait forever for a process that died.
+static inline bool trace_shm_peer_died(int32_t pid, unsigned waits) {
+  return pid && waits % 1024 == 1023 && kill(pid, 0) != 0 && errno == ESRCH;
+}
+
+// Write size bytes to the ring, waiting for the consumer whenever it is
+// full. Returns false if the consumer exited or detached first.
+static inline bool trace_shm_write(trace_shm_ring *ring, const void *src,
+                                   size_t size) {
+  const char *pos = static_cast<const char *>(src);
+  uint64_t head = ring->head.load(std::memory_order_relaxed);
+  unsigned waits = 0;
+  while (size) {
+    uint64_t space =
+        ring->capacity - (head - ring->tail.load(std::memory_order_acquire));
+    if (space == 0) {
+      if (ring->detached.load(std::memory_order_relaxed) ||
+          trace_shm_peer_died(ring->consumer, waits))
+        return false;
+      trace_shm_wait(waits);
+      continue;
+    }
+    waits = 0;
+    size_t n = size < space ? size : space;
+    size_t offset = head & (ring->capacity - 1);
+    size_t first = n < ring->capacity - offset ? n : ring->capacity - offset;
+    memcpy(ring->data() + offset, pos, first);
+    memcpy(ring->data(), pos + first, n - first);
+    head += n;
+    ring->head.store(head, std::memory_order_release);
+    pos += n;
+    size -= n;
+  }
+  return true;
+}
+
+// Read up to size bytes from the ring, waiting until there is at least one.
+// Returns the number of bytes read, 0 once the producer has closed the ring
+// and everything has been read, and -1 if the producer exited without
+// closing it.
+static inline long trace_shm_read(trace_shm_ring *ring, void *dst,
+                                  size_t size) {
+  uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+  unsigned waits = 0;
+  uint64_t available;
+  while ((available = ring->head.load(std::memory_order_acquire) - tail) ==
+         0) {
+    if (ring->closed.load(std::memory_order_acquire)) {
+      // The producer may have written more before closing.
+      if (ring->head.load(std::memory_order_acquire) == tail)
+        return 0;
+      continue;
+    }
+    if (trace_shm_peer_died(ring->producer, waits))
+      return -1;
+    trace_shm_wait(waits);
+  }
+  size_t n = size < available ? size : available;
+  size_t offset = tail & (ring->capacity - 1);
+  size_t first = n < ring->capacity - offset ? n : ring->capacity - offset;
+  memcpy(dst, ring->data() + offset, first);
+  memcpy(static_cast<char *>(dst) + first, ring->data(), n - first);
+  ring->tail.store(tail + n, std::memory_order_release);
+  return n;
+}
+
+// The header of the message of a chunk, which is followed by the chunk.
+static inline void encode_shm_message_header(const trace_chunk_tag &tag,
+                                             uint64_t size, std::string &buf) {
+  buf.clear();
+  append_tag_field<uint32_t>(buf, 0);
+  encode_chunk_tag(tag, buf);
+  uint32_t tag_size = buf.size() - 4;
+  memcpy(&buf[0], &tag_size, 4);
+  append_tag_field<uint64_t>(buf, size);
+}
+
+#endif
@@ -0,0 +1,147 @@
+#ifndef __LLVM_TRACER_TRACE_SINK_H__
+#define __LLVM_TRACER_TRACE_SINK_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* In-process trace sinks.
+ *
+ * A sink is given the records of every trace as the program runs, already
+ * decoded, so that an analysis that only needs to see each record once can
+ * run inside the traced program instead of reading a trace file afterwards.
+ * Records go to the sinks in addition to the trace files, or instead of them
+ * with LLVMTRACER_TRACE_SINK=none, in which case traces are never formatted
+ * or compressed at all.
+ *
+ * Sinks are registered either by the program itself, with
+ * llvmtracer_register_sink() before main (from a constructor) or at the
+ * start of main, or by shared objects listed in LLVMTRACER_SINK_PLUGINS,
+ * separated by colons. Each of these must export
+ *
+ *   int llvmtracer_sink_init(struct llvmtracer_sink *sink);
+ *
+ * which fills in the zeroed sink and returns 0, or returns nonzero to make
+ * the program exit. Plugins are loaded when the program starts.
+ *
+ * Each thread collects its records into batches and calls every sink's
+ * records() callback once a batch has LLVMTRACER_SINK_BATCH_SIZE records,
+ * when the thread switches to another trace name, and for the last batch of
+ * every trace at exit, right before calling finish(). Batches always start
+ * at an entry or instruction record, so they may run a little over that
+ * size. The batches of each thread are passed in the order they were logged,
+ * but threads call records() concurrently, so sinks that are used by
+ * multithreaded programs must be thread safe. Every pointer in a batch
+ * stays valid until records() returns; the names of functions, basic blocks
+ * and so on stay valid until the program exits.
+ *
+ * This header is C, so that sinks can be written in either language.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define LLVMTRACER_MAX_SINKS 8
+#define LLVMTRACER_SINK_BATCH_SIZE 4096
+
+/* The kinds of records, which are the same as in text traces. */
+enum llvmtracer_record_kind {
+  LLVMTRACER_RECORD_ENTRY,
+  LLVMTRACER_RECORD_INST,
+  LLVMTRACER_RECORD_PARAM,
+  LLVMTRACER_RECORD_RESULT,
+  LLVMTRACER_RECORD_FORWARD,
+  LLVMTRACER_RECORD_TIMESTAMP,
+  LLVMTRACER_RECORD_SAMPLING,
+  LLVMTRACER_RECORD_WINDOW,
+  LLVMTRACER_RECORD_SIMPOINT,
+  LLVMTRACER_RECORD_ITERATION,
+  LLVMTRACER_RECORD_LOOP,
+};
+
+/* The types of parameter values. */
+enum llvmtracer_value_type {
+  LLVMTRACER_VALUE_INT,
+  LLVMTRACER_VALUE_PTR,
+  LLVMTRACER_VALUE_DOUBLE,
+  LLVMTRACER_VALUE_STRING,
+  LLVMTRACER_VALUE_VECTOR,
+};
+
+/* One record. Which fields are set depends on the kind. */
+struct llvmtracer_record {
+  uint32_t kind;
+  /* INST: source line. PARAM: operand number. */
+  int32_t line;
+  /* ENTRY and INST. */
+  const char *function;
+  /* INST. */
+  const char *basic_block;
+  const char *inst;
+  int32_t opcode;
+  /* ENTRY. */
+  int32_t num_params;
+  /* INST. */
+  int64_t inst_count;
+  /* PARAM, RESULT and FORWARD. size is in bits, and vector values hold
+   * size / 8 bytes. label is null unless is_reg is set, and prev_bb is null
+   * unless is_phi is set. */
+  int32_t size;
+  uint32_t value_type;
+  union {
+    int64_t i;
+    uint64_t ptr;
+    double d;
+    const char *str;
+    const uint8_t *vector;
+  } value;
+  uint8_t is_reg;
+  uint8_t is_phi;
+  const char *label;
+  const char *prev_bb;
+  /* TIMESTAMP (see LLVMTRACER_TIMESTAMPS). */
+  uint64_t timestamp;
+  /* SAMPLING, the last record of a sampled trace (see
+   * LLVMTRACER_TRACE_BUDGET and LLVMTRACER_SAMPLE_PERIOD). */
+  uint64_t insts;
+  uint64_t logged_insts;
+  uint64_t invocations;
+  uint64_t logged_invocations;
+  uint64_t sample_period;
+  /* WINDOW (see LLVMTRACER_SAMPLE_PERIOD). */
+  uint64_t skipped_insts;
+  uint64_t warmup_insts;
+  /* SIMPOINT (see LLVMTRACER_SIMPOINTS). */
+  uint64_t interval;
+  double weight;
+  /* ITERATION (see LLVMTRACER_LOOP_LABEL). */
+  uint64_t iteration;
+  /* LOOP, the trip counts of the sampled loop, right before SAMPLING. */
+  uint64_t executions;
+  uint64_t iterations;
+  uint64_t logged_iterations;
+};
+
+struct llvmtracer_sink {
+  /* Called with every batch of records. thread_id is the ID that tags the
+   * thread's chunks in trace files. */
+  void (*records)(void *arg, const char *trace_name, uint32_t thread_id,
+                  const struct llvmtracer_record *records,
+                  size_t num_records);
+  /* Called once at exit, after the last batch. May be null. */
+  void (*finish)(void *arg);
+  void *arg;
+};
+
+/* Register a sink, which is copied. Returns nonzero if there are already
+ * LLVMTRACER_MAX_SINKS sinks. Not thread safe: sinks must be registered
+ * before the program starts tracing. */
+int llvmtracer_register_sink(const struct llvmtracer_sink *sink);
+
+typedef int (*llvmtracer_sink_init_fn)(struct llvmtracer_sink *sink);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,356 @@
+#ifndef __LLVM_TRACER_TRACE_TEXT_H__
+#define __LLVM_TRACER_TRACE_TEXT_H__
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Formatting of parameter values for text traces.
+//
+// Integers are written like "%ld" and pointers like "%#llx". Vectors are
+// written as "0x" followed by two lowercase hex digits for each byte, in
+// memory order. Doubles are written like "%f" whenever that reads back as the
+// same double, which it does for most values that occur in practice, and
+// otherwise with as many more fraction digits as it takes to read back
+// exactly (the shortest such string, except in rare cases where a digit more
+// than necessary is written). So a double never has an exponent and always
+// has at least six fraction digits.
+//
+// Each function writes a null-terminated string to buf and returns a pointer
+// to its terminating null. This is shared by the runtime and by the tools
+// that write text traces, so that they all write exactly the same text.
+
+// Size of a buffer that holds any formatted int, ptr or double, including the
+// null terminator. Vectors need TRACE_VECTOR_TEXT_SIZE(size) bytes.
+#define TRACE_VALUE_TEXT_SIZE 512
+#define TRACE_VECTOR_TEXT_SIZE(bits) ((bits) / 4 + 3)
+
+static const char trace_hex_digits[] = "0123456789abcdef";
+
+// Pairs of decimal digits "00" to "99".
+static const char trace_decimal_pairs[] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536"
+    "37383940414243444546474849505152535455565758596061626364656667686970717273"
+    "7475767778798081828384858687888990919293949596979899";
+
+static inline char *trace_format_uint(char *buf, uint64_t value) {
+  char digits[20];
+  char *p = digits + sizeof(digits);
+  while (value >= 100) {
+    p -= 2;
+    memcpy(p, &trace_decimal_pairs[(value % 100) * 2], 2);
+    value /= 100;
+  }
+  if (value >= 10) {
+    p -= 2;
+    memcpy(p, &trace_decimal_pairs[value * 2], 2);
+  } else {
+    *--p = '0' + value;
+  }
+  size_t size = digits + sizeof(digits) - p;
+  memcpy(buf, p, size);
+  buf[size] = 0;
+  return buf + size;
+}
+
+static inline char *trace_format_int(char *buf, int64_t value) {
+  if (value < 0) {
+    *buf++ = '-';
+    return trace_format_uint(buf, 0 - (uint64_t)value);
+  }
+  return trace_format_uint(buf, value);
+}
+
+static inline char *trace_format_ptr(char *buf, uint64_t value) {
+  // Like "%#llx", zero has no prefix.
+  if (value == 0) {
+    buf[0] = '0';
+    buf[1] = 0;
+    return buf + 1;
+  }
+  int digits = (67 - __builtin_clzll(value)) / 4;
+  buf[0] = '0';
+  buf[1] = 'x';
+  char *end = buf + 2 + digits;
+  for (char *p = end; p > buf + 2; value >>= 4)
+    *--p = trace_hex_digits[value & 0xf];
+  *end = 0;
+  return end;
+}
+
+static inline char *trace_format_vector(char *buf, const uint8_t *value,
+                                        int size) {
+  *buf++ = '0';
+  *buf++ = 'x';
+  for (int i = 0; i < size; i++) {
+    *buf++ = trace_hex_digits[value[i] >> 4];
+    *buf++ = trace_hex_digits[value[i] & 0xf];
+  }
+  *buf = 0;
+  return buf;
+}
+
+// Shortest decimal digits of a double, with the Grisu2 algorithm of Florian
+// Loitsch, "Printing Floating-Point Numbers Quickly and Accurately with
+// Integers" (PLDI 2010). The digits always read back as the same double, and
+// are the shortest ones that do in all but a few cases in ten thousand.
+
+// A floating-point number f * 2^e.
+struct trace_diy_fp {
+  uint64_t f;
+  int e;
+};
+
+// The product, rounded to the upper 64 bits.
+static inline trace_diy_fp trace_diy_fp_mul(trace_diy_fp x, trace_diy_fp y) {
+  uint64_t a = x.f >> 32, b = x.f & 0xffffffff;
+  uint64_t c = y.f >> 32, d = y.f & 0xffffffff;
+  uint64_t ac = a * c, bc = b * c, ad = a * d, bd = b * d;
+  uint64_t mid = (bd >> 32) + (ad & 0xffffffff) + (bc & 0xffffffff);
+  mid += 1u << 31;  // Round.
+  trace_diy_fp result = {ac + (ad >> 32) + (bc >> 32) + (mid >> 32),
+                         x.e + y.e + 64};
+  return result;
+}
+
+static inline trace_diy_fp trace_diy_fp_normalize(trace_diy_fp x) {
+  int shift = __builtin_clzll(x.f);
+  x.f <<= shift;
+  x.e -= shift;
+  return x;
+}
+
+// Normalized powers of ten f * 2^e = 10^k, from 10^-300 to 10^324 in steps
+// of 10^8.
+struct trace_cached_power {
+  uint64_t f;
+  int e;
+  int k;
+};
+
+static inline trace_cached_power trace_cached_power_for(int e) {
+  static const trace_cached_power powers[] = {
+      {0xAB70FE17C79AC6CAULL, -1060, -300}, {0xFF77B1FCBEBCDC4FULL, -1034, -292},
+      {0xBE5691EF416BD60CULL, -1007, -284}, {0x8DD01FAD907FFC3CULL, -980, -276},
+      {0xD3515C2831559A83ULL, -954, -268}, {0x9D71AC8FADA6C9B5ULL, -927, -260},
+      {0xEA9C227723EE8BCBULL, -901, -252}, {0xAECC49914078536DULL, -874, -244},
+      {0x823C12795DB6CE57ULL, -847, -236}, {0xC21094364DFB5637ULL, -821, -228},
+      {0x9096EA6F3848984FULL, -794, -220}, {0xD77485CB25823AC7ULL, -768, -212},
+      {0xA086CFCD97BF97F4ULL, -741, -204}, {0xEF340A98172AACE5ULL, -715, -196},
+      {0xB23867FB2A35B28EULL, -688, -188}, {0x84C8D4DFD2C63F3BULL, -661, -180},
+      {0xC5DD44271AD3CDBAULL, -635, -172}, {0x936B9FCEBB25C996ULL, -608, -164},
+      {0xDBAC6C247D62A584ULL, -582, -156}, {0xA3AB66580D5FDAF6ULL, -555, -148},
+      {0xF3E2F893DEC3F126ULL, -529, -140}, {0xB5B5ADA8AAFF80B8ULL, -502, -132},
+      {0x87625F056C7C4A8BULL, -475, -124}, {0xC9BCFF6034C13053ULL, -449, -116},
+      {0x964E858C91BA2655ULL, -422, -108}, {0xDFF9772470297EBDULL, -396, -100},
+      {0xA6DFBD9FB8E5B88FULL, -369, -92},  {0xF8A95FCF88747D94ULL, -343, -84},
+      {0xB94470938FA89BCFULL, -316, -76},  {0x8A08F0F8BF0F156BULL, -289, -68},
+      {0xCDB02555653131B6ULL, -263, -60},  {0x993FE2C6D07B7FACULL, -236, -52},
+      {0xE45C10C42A2B3B06ULL, -210, -44},  {0xAA242499697392D3ULL, -183, -36},
+      {0xFD87B5F28300CA0EULL, -157, -28},  {0xBCE5086492111AEBULL, -130, -20},
+      {0x8CBCCC096F5088CCULL, -103, -12},  {0xD1B71758E219652CULL, -77, -4},
+      {0x9C40000000000000ULL, -50, 4},     {0xE8D4A51000000000ULL, -24, 12},
+      {0xAD78EBC5AC620000ULL, 3, 20},      {0x813F3978F8940984ULL, 30, 28},
+      {0xC097CE7BC90715B3ULL, 56, 36},     {0x8F7E32CE7BEA5C70ULL, 83, 44},
+      {0xD5D238A4ABE98068ULL, 109, 52},    {0x9F4F2726179A2245ULL, 136, 60},
+      {0xED63A231D4C4FB27ULL, 162, 68},    {0xB0DE65388CC8ADA8ULL, 189, 76},
+      {0x83C7088E1AAB65DBULL, 216, 84},    {0xC45D1DF942711D9AULL, 242, 92},
+      {0x924D692CA61BE758ULL, 269, 100},   {0xDA01EE641A708DEAULL, 295, 108},
+      {0xA26DA3999AEF774AULL, 322, 116},   {0xF209787BB47D6B85ULL, 348, 124},
+      {0xB454E4A179DD1877ULL, 375, 132},   {0x865B86925B9BC5C2ULL, 402, 140},
+      {0xC83553C5C8965D3DULL, 428, 148},   {0x952AB45CFA97A0B3ULL, 455, 156},
+      {0xDE469FBD99A05FE3ULL, 481, 164},   {0xA59BC234DB398C25ULL, 508, 172},
+      {0xF6C69A72A3989F5CULL, 534, 180},   {0xB7DCBF5354E9BECEULL, 561, 188},
+      {0x88FCF317F22241E2ULL, 588, 196},   {0xCC20CE9BD35C78A5ULL, 614, 204},
+      {0x98165AF37B2153DFULL, 641, 212},   {0xE2A0B5DC971F303AULL, 667, 220},
+      {0xA8D9D1535CE3B396ULL, 694, 228},   {0xFB9B7CD9A4A7443CULL, 720, 236},
+      {0xBB764C4CA7A44410ULL, 747, 244},   {0x8BAB8EEFB6409C1AULL, 774, 252},
+      {0xD01FEF10A657842CULL, 800, 260},   {0x9B10A4E5E9913129ULL, 827, 268},
+      {0xE7109BFBA19C0C9DULL, 853, 276},   {0xAC2820D9623BF429ULL, 880, 284},
+      {0x80444B5E7AA7CF85ULL, 907, 292},   {0xBF21E44003ACDD2DULL, 933, 300},
+      {0x8E679C2F5E44FF8FULL, 960, 308},   {0xD433179D9C8CB841ULL, 986, 316},
+      {0x9E19DB92B4E31BA9ULL, 1013, 324},
+  };
+  // Pick the power that scales a number with binary exponent e to an
+  // exponent between -60 and -32, so that the integer part of the scaled
+  // number fits in 32 bits. 78913 / 2^18 approximates log10(2).
+  int f = -61 - e;
+  int k = (f * 78913) / (1 << 18) + (f > 0);
+  return powers[(300 + k + 7) / 8];
+}
+
+// Move the last digit towards w, the exact value, as long as the digits stay
+// within the range that reads back as the same double.
+static inline void trace_grisu_round(char *digits, int length, uint64_t dist,
+                                     uint64_t delta, uint64_t rest,
+                                     uint64_t ten_k) {
+  while (rest < dist && delta - rest >= ten_k &&
+         (rest + ten_k < dist || dist - rest > rest + ten_k - dist)) {
+    digits[length - 1]--;
+    rest += ten_k;
+  }
+}
+
+// Write the digits of a number between low and high, as close to w as
+// possible, to digits. The number is digits * 10^exponent.
+static inline int trace_grisu_digits(char *digits, int &exponent,
+                                     trace_diy_fp low, trace_diy_fp w,
+                                     trace_diy_fp high) {
+  static const uint32_t powers_of_ten[] = {
+      1,      10,      100,      1000,      10000,
+      100000, 1000000, 10000000, 100000000, 1000000000};
+  uint64_t delta = high.f - low.f;
+  uint64_t dist = high.f - w.f;
+  int shift = -high.e;
+  uint64_t one = (uint64_t)1 << shift;
+  uint32_t integral = high.f >> shift;
+  uint64_t fraction = high.f & (one - 1);
+  int length = 0;
+
+  int n = 10;
+  while (n > 1 && integral < powers_of_ten[n - 1])
+    n--;
+  while (n > 0) {
+    uint32_t ten_n = powers_of_ten[n - 1];
+    digits[length++] = '0' + integral / ten_n;
+    integral %= ten_n;
+    n--;
+    uint64_t rest = ((uint64_t)integral << shift) + fraction;
+    if (rest <= delta) {
+      exponent += n;
+      trace_grisu_round(digits, length, dist, delta, rest,
+                        (uint64_t)ten_n << shift);
+      return length;
+    }
+  }
+
+  int m = 0;
+  for (;;) {
+    fraction *= 10;
+    delta *= 10;
+    dist *= 10;
+    digits[length++] = '0' + (fraction >> shift);
+    fraction &= one - 1;
+    m++;
+    if (fraction <= delta)
+      break;
+  }
+  exponent -= m;
+  trace_grisu_round(digits, length, dist, delta, fraction, one);
+  return length;
+}
+
+// The shortest digits of a positive, finite double value, such that value
+// reads back from digits * 10^exponent. Writes at most 17 digits.
+static inline int trace_grisu2(char *digits, int &exponent, double value) {
+  uint64_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  const uint64_t hidden_bit = (uint64_t)1 << 52;
+  uint64_t significand = bits & (hidden_bit - 1);
+  int biased_exponent = bits >> 52;
+  trace_diy_fp v;
+  if (biased_exponent == 0) {
+    v.f = significand;
+    v.e = 1 - 1075;
+  } else {
+    v.f = significand | hidden_bit;
+    v.e = biased_exponent - 1075;
+  }
+
+  // The doubles closest to value are the boundaries of the numbers that read
+  // back as value. The lower one is closer if value is a power of two.
+  trace_diy_fp high = {(v.f << 1) + 1, v.e - 1};
+  high = trace_diy_fp_normalize(high);
+  trace_diy_fp low;
+  if (v.f == hidden_bit && biased_exponent > 1) {
+    low.f = (v.f << 2) - 1;
+    low.e = v.e - 2;
+  } else {
+    low.f = (v.f << 1) - 1;
+    low.e = v.e - 1;
+  }
+  low.f <<= low.e - high.e;
+  low.e = high.e;
+  trace_diy_fp w = trace_diy_fp_normalize(v);
+
+  trace_cached_power cached = trace_cached_power_for(high.e);
+  trace_diy_fp power = {cached.f, cached.e};
+  w = trace_diy_fp_mul(w, power);
+  low = trace_diy_fp_mul(low, power);
+  high = trace_diy_fp_mul(high, power);
+  // The products may be off by one in the last place, so stay clear of the
+  // boundaries.
+  low.f++;
+  high.f--;
+  exponent = -cached.k;
+  return trace_grisu_digits(digits, exponent, low, w, high);
+}
+
+static inline char *trace_format_double(char *buf, double value) {
+  double magnitude = fabs(value);
+  // Doubles below 2^20 that "%f" writes exactly (to within the rounding of a
+  // double) are written directly from their millionths. Then the division
+  // reads back the same way strtod reads the text, and the millionths are
+  // what "%f" would have written, as the rounding of value * 1e6 is far less
+  // than half a millionth.
+  if (magnitude < (1 << 20)) {
+    double millionths = nearbyint(magnitude * 1e6);
+    if (millionths / 1e6 == magnitude) {
+      uint64_t n = millionths;
+      char *p = buf;
+      if (signbit(value))
+        *p++ = '-';
+      p = trace_format_uint(p, n / 1000000);
+      *p++ = '.';
+      uint32_t fraction = n % 1000000;
+      for (int i = 5; i >= 0; i--, fraction /= 10)
+        p[i] = '0' + fraction % 10;
+      p[6] = 0;
+      return p + 6;
+    }
+  } else {
+    // Larger doubles are rare. "%f" writes them exactly if they are
+    // integers, and also covers infinities and NaNs.
+    int size = snprintf(buf, TRACE_VALUE_TEXT_SIZE, "%f", value);
+    if (!isfinite(value) || strtod(buf, NULL) == value)
+      return buf + size;
+  }
+
+  // "%f" would lose precision, so write the shortest digits instead.
+  char digits[18];
+  int exponent;
+  int length = trace_grisu2(digits, exponent, magnitude);
+  char *p = buf;
+  if (value < 0)
+    *p++ = '-';
+  int integral = length + exponent;
+  if (integral <= 0) {
+    *p++ = '0';
+    *p++ = '.';
+    memset(p, '0', -integral);
+    p += -integral;
+    memcpy(p, digits, length);
+    p += length;
+  } else if (exponent >= 0) {
+    memcpy(p, digits, length);
+    memset(p + length, '0', exponent);
+    p += integral;
+    *p++ = '.';
+  } else {
+    memcpy(p, digits, integral);
+    p += integral;
+    *p++ = '.';
+    memcpy(p, digits + integral, -exponent);
+    p += -exponent;
+  }
+  // Pad the fraction to six digits, like "%f".
+  int fraction_digits = exponent < 0 ? -exponent : 0;
+  for (; fraction_digits < 6; fraction_digits++)
+    *p++ = '0';
+  *p = 0;
+  return p;
+}
+
+#endif
@@ -0,0 +1,629 @@
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <utility>
+#include <vector>
+
+#include "trace_writer.h"
+
+// Chunks are allocated with some room to spare, since they are only flushed
+// between instructions and will usually overshoot the buffer size a little.
+#define CHUNK_SLACK (64 * 1024)
+// The first chunk of a stream starts this small and grows as it fills, so
+// that threads that log little or nothing do not hold a whole buffer.
+#define FIRST_CHUNK_CAPACITY (4 * 1024)
+
+// Chunks waiting to be compressed by one writer thread. The owner takes
+// chunks from the front, and other threads steal from the back.
+struct writer_queue {
+  pthread_mutex_t lock;
+  std::deque<trace_chunk *> chunks;
+};
+
+// Protects the writer thread state, num_queued, and the free lists and
+// in-flight counts of all streams.
+static pthread_mutex_t writer_lock = PTHREAD_MUTEX_INITIALIZER;
+// Signalled when a chunk is queued or the writer threads should stop.
+static pthread_cond_t writer_wakeup = PTHREAD_COND_INITIALIZER;
+// Broadcast when a chunk has been compressed and returned to its stream.
+static pthread_cond_t chunk_written = PTHREAD_COND_INITIALIZER;
+static std::vector<writer_queue *> writer_queues;
+static std::vector<pthread_t> writer_threads;
+// Number of queued chunks not yet claimed by a writer thread.
+static int num_queued = 0;
+// Queue that the next chunk is handed to.
+static unsigned next_queue = 0;
+static bool writer_running = false;
+static bool writer_stopping = false;
+
+// Adaptive compression state, shared by all streams.
+static std::atomic<int> compression_level(0);
+// Number of consecutive chunks handed off without a significant stall.
+static std::atomic<int> calm_chunks(0);
+// ID of the next stream.
+static std::atomic<uint32_t> next_thread_id(0);
+// Number of calm chunks after which the level is raised.
+#define CALM_CHUNKS_TO_RAISE 8
+
+// Parse a size in bytes, with an optional K, M or G suffix.
+static size_t parse_size(const char *value, size_t default_size) {
+  if (!value || !*value)
+    return default_size;
+  char *end;
+  unsigned long long size = strtoull(value, &end, 10);
+  switch (*end) {
+    case 'G': case 'g':
+      size <<= 10;
+      // Fall through.
+    case 'M': case 'm':
+      size <<= 10;
+      // Fall through.
+    case 'K': case 'k':
+      size <<= 10;
+      end++;
+  }
+  if (end == value || *end || size == 0) {
+    fprintf(stderr, "Invalid trace buffer size \"%s\"!\n", value);
+    exit(-1);
+  }
+  return size;
+}
+
+// Parse LLVMTRACER_COMPRESSION, which is a codec name optionally followed by
+// a colon and a level.
+static void parse_compression(const char *value, trace_writer_config &config) {
+  if (!value || !*value)
+    value = "zlib";
+  std::string name(value);
+  const char *level = nullptr;
+  size_t colon = name.find(':');
+  if (colon != std::string::npos) {
+    level = value + colon + 1;
+    name.resize(colon);
+  }
+  config.codec = find_trace_codec(name.c_str());
+  if (!config.codec) {
+    fprintf(stderr, "Unknown or unsupported trace compression \"%s\"!\n",
+            name.c_str());
+    exit(-1);
+  }
+  config.level = config.codec->default_level;
+  if (!level)
+    return;
+  char *end;
+  config.level = strtol(level, &end, 10);
+  if (end == level || *end || config.level < config.codec->min_level ||
+      config.level > config.codec->max_level) {
+    fprintf(stderr, "Invalid %s compression level \"%s\" (must be %d-%d)!\n",
+            config.codec->name, level, config.codec->min_level,
+            config.codec->max_level);
+    exit(-1);
+  }
+}
+
+static trace_writer_config read_trace_writer_config() {
+  trace_writer_config config;
+  const char *async = getenv("LLVMTRACER_ASYNC_WRITER");
+  config.async = async && *async && strcmp(async, "0") != 0;
+  config.buffer_size =
+      parse_size(getenv("LLVMTRACER_BUFFER_SIZE"), 4 * 1024 * 1024);
+  const char *queue_depth = getenv("LLVMTRACER_WRITER_QUEUE");
+  config.queue_depth = queue_depth ? atoi(queue_depth) : 1;
+  if (config.queue_depth < 1) {
+    fprintf(stderr, "LLVMTRACER_WRITER_QUEUE must be at least 1!\n");
+    exit(-1);
+  }
+  const char *num_threads = getenv("LLVMTRACER_WRITER_THREADS");
+  config.num_threads =
+      num_threads ? atoi(num_threads) : sysconf(_SC_NPROCESSORS_ONLN);
+  if (config.num_threads < 1) {
+    if (num_threads) {
+      fprintf(stderr, "LLVMTRACER_WRITER_THREADS must be at least 1!\n");
+      exit(-1);
+    }
+    config.num_threads = 1;
+  }
+  parse_compression(getenv("LLVMTRACER_COMPRESSION"), config);
+  const char *adaptive = getenv("LLVMTRACER_ADAPTIVE_COMPRESSION");
+  config.adaptive = adaptive && *adaptive && strcmp(adaptive, "0") != 0;
+  const char *sink = getenv("LLVMTRACER_TRACE_SINK");
+  config.to_file = true;
+  config.to_shm = false;
+  if (sink && *sink && strcmp(sink, "file") != 0) {
+    config.to_file = strcmp(sink, "shm+file") == 0;
+    config.to_shm = config.to_file || strcmp(sink, "shm") == 0;
+    if (!config.to_shm && strcmp(sink, "none") != 0) {
+      fprintf(stderr, "Unknown LLVMTRACER_TRACE_SINK \"%s\"!\n", sink);
+      exit(-1);
+    }
+  }
+  // Rings wrap around with a mask, so their size is a power of two.
+  size_t shm_size = parse_size(getenv("LLVMTRACER_SHM_SIZE"), 64 * 1024 * 1024);
+  for (config.shm_size = 4096; config.shm_size < shm_size;)
+    config.shm_size *= 2;
+  // Indices point into trace files.
+  const char *index = getenv("LLVMTRACER_TRACE_INDEX");
+  config.index =
+      index && *index && strcmp(index, "0") != 0 && config.to_file;
+  compression_level = config.level;
+  return config;
+}
+
+const trace_writer_config &get_trace_writer_config() {
+  static trace_writer_config config = read_trace_writer_config();
+  return config;
+}
+
+// Create the shared memory ring of the trace called name, replacing any ring
+// that an earlier run left behind.
+static trace_shm_ring *create_trace_shm(const std::string &shm_name,
+                                        size_t capacity) {
+  shm_unlink(shm_name.c_str());
+  int fd = shm_open(shm_name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (fd < 0)
+    return nullptr;
+  size_t size = TRACE_SHM_DATA_OFFSET + capacity;
+  void *mem = MAP_FAILED;
+  if (ftruncate(fd, size) == 0)
+    mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mem == MAP_FAILED) {
+    shm_unlink(shm_name.c_str());
+    return nullptr;
+  }
+  // The new ring is zeroed, which leaves it empty and without a consumer.
+  trace_shm_ring *ring = static_cast<trace_shm_ring *>(mem);
+  ring->version = TRACE_SHM_VERSION;
+  ring->capacity = capacity;
+  ring->producer = getpid();
+  ring->magic.store(TRACE_SHM_MAGIC, std::memory_order_release);
+  return ring;
+}
+
+static void close_trace_shm(trace_output *output) {
+  trace_shm_ring *ring = output->shm;
+  ring->closed.store(1, std::memory_order_release);
+  // An attached consumer keeps the ring mapped, so its name can go now.
+  // Otherwise, it is left for a consumer to read later.
+  if (ring->consumer)
+    shm_unlink(output->shm_name.c_str());
+  munmap(ring, TRACE_SHM_DATA_OFFSET + ring->capacity);
+  output->shm = nullptr;
+}
+
+trace_output *open_trace_output(const char *name) {
+  const trace_writer_config &config = get_trace_writer_config();
+  FILE *file = nullptr;
+  if (config.to_file && !(file = fopen(name, "wb")))
+    return nullptr;
+  trace_output *output = new trace_output();
+  output->file = file;
+  output->index = nullptr;
+  output->shm = nullptr;
+  if (config.to_shm) {
+    output->shm_name = trace_shm_name(name);
+    output->shm = create_trace_shm(output->shm_name, config.shm_size);
+    if (!output->shm) {
+      perror("Failed to create the shared memory trace ring");
+      exit(-1);
+    }
+  }
+  if (config.index) {
+    std::string index_name = std::string(name) + ".idx";
+    output->index = fopen(index_name.c_str(), "wb");
+    std::string header;
+    encode_index_header(header);
+    if (!output->index ||
+        fwrite(header.data(), 1, header.size(), output->index) !=
+            header.size()) {
+      perror("Failed to open the trace index");
+      exit(-1);
+    }
+  }
+  pthread_mutex_init(&output->lock, NULL);
+  output->next_chunk = 0;
+  output->next_frame = 0;
+  output->next_offset = 0;
+  return output;
+}
+
+void close_trace_output(trace_output *output) {
+  assert(output->pending_frames.empty() &&
+         "Closing a trace with unwritten chunks!");
+  if (output->file)
+    fclose(output->file);
+  if (output->index)
+    fclose(output->index);
+  if (output->shm)
+    close_trace_shm(output);
+  pthread_mutex_destroy(&output->lock);
+  delete output;
+}
+
+// The capacity of a chunk that holds a whole buffer.
+static size_t full_chunk_capacity() {
+  return get_trace_writer_config().buffer_size + CHUNK_SLACK;
+}
+
+static trace_chunk *new_trace_chunk(trace_stream *owner, size_t capacity) {
+  trace_chunk *chunk = new trace_chunk();
+  chunk->capacity = capacity;
+  chunk->data = (char *)malloc(chunk->capacity);
+  if (!chunk->data) {
+    perror("Failed to allocate a trace buffer");
+    exit(-1);
+  }
+  chunk->size = 0;
+  chunk->output = nullptr;
+  chunk->owner = owner;
+  chunk->next = nullptr;
+  return chunk;
+}
+
+static void free_trace_chunk(trace_chunk *chunk) {
+  free(chunk->data);
+  delete chunk;
+}
+
+void grow_trace_chunk(trace_chunk *chunk, size_t min_capacity) {
+  size_t capacity = chunk->capacity * 2;
+  // A small first chunk grows no further than a full one, unless a record
+  // needs more.
+  size_t full_capacity = full_chunk_capacity();
+  if (chunk->capacity < full_capacity && capacity > full_capacity)
+    capacity = full_capacity;
+  if (capacity < min_capacity)
+    capacity = min_capacity;
+  chunk->data = (char *)realloc(chunk->data, capacity);
+  if (!chunk->data) {
+    perror("Failed to grow a trace buffer");
+    exit(-1);
+  }
+  chunk->capacity = capacity;
+}
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Adjust the compression level after a chunk took fill_time to fill and its
+// hand-off stalled the logging thread for stall_time.
+static void adapt_compression_level(uint64_t fill_time, uint64_t stall_time) {
+  const trace_codec *codec = get_trace_writer_config().codec;
+  int level = compression_level;
+  if (stall_time * 20 > fill_time) {
+    calm_chunks = 0;
+    if (level > codec->min_level)
+      compression_level.compare_exchange_strong(level, level - 1);
+  } else if (stall_time * 100 <= fill_time) {
+    if (++calm_chunks >= CALM_CHUNKS_TO_RAISE) {
+      calm_chunks = 0;
+      if (level < codec->max_level)
+        compression_level.compare_exchange_strong(level, level + 1);
+    }
+  }
+}
+
+static void compress_chunk(const trace_chunk *chunk, std::string &frame) {
+  get_trace_writer_config().codec->compress(chunk->data, chunk->size,
+                                            chunk->level, chunk->tag, frame);
+}
+
+// The index entry of a chunk. Its offset and size are filled in when the
+// frame is written.
+static trace_index_entry make_index_entry(const trace_chunk *chunk) {
+  trace_index_entry entry;
+  entry.offset = 0;
+  entry.size = 0;
+  entry.thread_id = chunk->tag.thread_id;
+  entry.flags = chunk->tag.flags;
+  entry.seq = chunk->tag.seq;
+  entry.invocation =
+      chunk->tag.flags & CHUNK_IS_HEADER ? -1 : chunk->invocation;
+  entry.first_inst = chunk->tag.context.inst_count;
+  entry.end_inst = entry.first_inst + chunk->tag.num_insts;
+  return entry;
+}
+
+// Prepare a handed off chunk for each destination of its output: compress it
+// for the file, and copy it into a message for the shared memory ring.
+static void encode_chunk(const trace_chunk *chunk, trace_pending_frame &frame) {
+  if (chunk->output->file) {
+    compress_chunk(chunk, frame.frame);
+    frame.entry = make_index_entry(chunk);
+  }
+  if (chunk->output->shm) {
+    encode_shm_message_header(chunk->tag, chunk->size, frame.message);
+    frame.message.append(chunk->data, chunk->size);
+  }
+}
+
+// Write the chunk at position in output, along with any later chunks that
+// were waiting for it, and add them to the index.
+static void write_frame(trace_output *output, uint64_t position,
+                        trace_pending_frame &frame) {
+  pthread_mutex_lock(&output->lock);
+  auto &pending = output->pending_frames[position];
+  pending.frame.swap(frame.frame);
+  pending.entry = frame.entry;
+  pending.message.swap(frame.message);
+  auto it = output->pending_frames.begin();
+  while (it != output->pending_frames.end() &&
+         it->first == output->next_frame) {
+    const std::string &message = it->second.message;
+    if (output->shm &&
+        !trace_shm_write(output->shm, message.data(), message.size())) {
+      fprintf(stderr, "The consumer of %s stopped reading, so the rest of "
+                      "the trace is not written to it.\n",
+              output->shm_name.c_str());
+      close_trace_shm(output);
+    }
+    const std::string &data = it->second.frame;
+    if (output->file &&
+        fwrite(data.data(), 1, data.size(), output->file) != data.size()) {
+      perror("Failed to write trace");
+      exit(-1);
+    }
+    if (output->index) {
+      trace_index_entry &indexed = it->second.entry;
+      indexed.offset = output->next_offset;
+      indexed.size = data.size();
+      uint8_t buf[TRACE_INDEX_ENTRY_SIZE];
+      encode_index_entry(indexed, buf);
+      if (fwrite(buf, 1, sizeof(buf), output->index) != sizeof(buf)) {
+        perror("Failed to write the trace index");
+        exit(-1);
+      }
+    }
+    output->next_offset += data.size();
+    output->next_frame++;
+    it = output->pending_frames.erase(it);
+  }
+  pthread_mutex_unlock(&output->lock);
+}
+
+// Take a chunk from queue index's front, or steal one from the back of
+// another queue.
+static trace_chunk *take_chunk(unsigned index) {
+  for (unsigned i = 0; i < writer_queues.size(); i++) {
+    writer_queue *queue = writer_queues[(index + i) % writer_queues.size()];
+    trace_chunk *chunk = nullptr;
+    pthread_mutex_lock(&queue->lock);
+    if (!queue->chunks.empty()) {
+      if (i == 0) {
+        chunk = queue->chunks.front();
+        queue->chunks.pop_front();
+      } else {
+        chunk = queue->chunks.back();
+        queue->chunks.pop_back();
+      }
+    }
+    pthread_mutex_unlock(&queue->lock);
+    if (chunk)
+      return chunk;
+  }
+  return nullptr;
+}
+
+static void *writer_thread_main(void *arg) {
+  unsigned index = (uintptr_t)arg;
+  trace_pending_frame frame;
+  while (true) {
+    // Claim one of the queued chunks before looking for it, so that every
+    // thread that gets past this point is guaranteed to find one.
+    pthread_mutex_lock(&writer_lock);
+    while (num_queued == 0 && !writer_stopping)
+      pthread_cond_wait(&writer_wakeup, &writer_lock);
+    if (num_queued == 0) {
+      pthread_mutex_unlock(&writer_lock);
+      break;
+    }
+    num_queued--;
+    pthread_mutex_unlock(&writer_lock);
+
+    trace_chunk *chunk = nullptr;
+    while (!chunk)
+      chunk = take_chunk(index);
+    trace_output *output = chunk->output;
+    uint64_t position = chunk->position;
+    encode_chunk(chunk, frame);
+
+    // The chunk can be refilled as soon as it is compressed.
+    pthread_mutex_lock(&writer_lock);
+    trace_stream *owner = chunk->owner;
+    chunk->size = 0;
+    chunk->next = owner->free_chunks;
+    owner->free_chunks = chunk;
+    owner->in_flight--;
+    pthread_cond_broadcast(&chunk_written);
+    pthread_mutex_unlock(&writer_lock);
+
+    write_frame(output, position, frame);
+  }
+  return nullptr;
+}
+
+// Must be called with the writer lock held.
+static void start_writer_threads() {
+  int num_threads = get_trace_writer_config().num_threads;
+  for (int i = 0; i < num_threads; i++) {
+    writer_queue *queue = new writer_queue();
+    pthread_mutex_init(&queue->lock, NULL);
+    writer_queues.push_back(queue);
+  }
+  for (int i = 0; i < num_threads; i++) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, &writer_thread_main,
+                       (void *)(uintptr_t)i) != 0) {
+      perror("Failed to start a trace writer thread");
+      exit(-1);
+    }
+    writer_threads.push_back(thread);
+  }
+  writer_running = true;
+}
+
+void init_trace_stream(trace_stream *stream) {
+  stream->output = nullptr;
+  stream->thread_id = next_thread_id++;
+  stream->next_seq = 0;
+  stream->get_context = nullptr;
+  stream->context_arg = nullptr;
+  stream->context.insts_before = 0;
+  stream->context.invocation = -1;
+  stream->context.inst_count = 0;
+  stream->active = new_trace_chunk(
+      stream, std::min<size_t>(FIRST_CHUNK_CAPACITY, full_chunk_capacity()));
+  stream->free_chunks = nullptr;
+  stream->in_flight = 0;
+  stream->fill_start = 0;
+  stream->bytes_written = 0;
+}
+
+void destroy_trace_stream(trace_stream *stream) {
+  flush_trace_stream(stream);
+  pthread_mutex_lock(&writer_lock);
+  while (stream->in_flight > 0)
+    pthread_cond_wait(&chunk_written, &writer_lock);
+  while (stream->free_chunks) {
+    trace_chunk *chunk = stream->free_chunks;
+    stream->free_chunks = chunk->next;
+    free_trace_chunk(chunk);
+  }
+  pthread_mutex_unlock(&writer_lock);
+  free_trace_chunk(stream->active);
+  stream->active = nullptr;
+}
+
+void set_trace_stream_output(trace_stream *stream, trace_output *output) {
+  if (stream->output == output)
+    return;
+  flush_trace_stream(stream);
+  stream->output = output;
+}
+
+// Account for a hand-off that started at flush_start. The first chunk of a
+// stream has no fill time and is not counted.
+static void finish_adaptive_flush(trace_stream *stream, uint64_t flush_start) {
+  uint64_t flush_end = now_ns();
+  if (stream->fill_start)
+    adapt_compression_level(flush_end - stream->fill_start,
+                            flush_end - flush_start);
+  stream->fill_start = flush_end;
+}
+
+void flush_trace_stream(trace_stream *stream, uint32_t flags) {
+  trace_chunk *chunk = stream->active;
+  if (chunk->size == 0 || !stream->output) {
+    // Nothing can be logged before the trace file is opened.
+    chunk->size = 0;
+    if (stream->get_context)
+      stream->get_context(stream->context_arg, stream->context);
+    return;
+  }
+  trace_output *output = stream->output;
+  stream->bytes_written += chunk->size;
+  chunk->output = output;
+  chunk->position = output->next_chunk++;
+  chunk->tag.thread_id = stream->thread_id;
+  chunk->tag.flags = flags;
+  chunk->tag.seq = stream->next_seq++;
+  // The chunk takes the context it was started with, and the next chunk
+  // starts where this one ends.
+  if (stream->get_context) {
+    std::swap(chunk->tag.context, stream->context);
+    stream->get_context(stream->context_arg, stream->context);
+  } else {
+    chunk->tag.context = stream->context;
+  }
+  chunk->tag.num_insts =
+      stream->context.insts_before - chunk->tag.context.insts_before;
+  chunk->invocation = stream->context.invocation;
+
+  const trace_writer_config &config = get_trace_writer_config();
+  chunk->level = compression_level;
+  uint64_t flush_start = config.adaptive ? now_ns() : 0;
+  if (!config.async) {
+    trace_pending_frame frame;
+    encode_chunk(chunk, frame);
+    write_frame(output, chunk->position, frame);
+    chunk->size = 0;
+    if (config.adaptive)
+      finish_adaptive_flush(stream, flush_start);
+    return;
+  }
+
+  pthread_mutex_lock(&writer_lock);
+  if (!writer_running)
+    start_writer_threads();
+  writer_queue *queue = writer_queues[next_queue++ % writer_queues.size()];
+  pthread_mutex_lock(&queue->lock);
+  queue->chunks.push_back(chunk);
+  pthread_mutex_unlock(&queue->lock);
+  num_queued++;
+  stream->in_flight++;
+  pthread_cond_signal(&writer_wakeup);
+
+  // Each stream has at most queue_depth chunks in flight plus the one it is
+  // filling.
+  while (!stream->free_chunks && stream->in_flight > config.queue_depth)
+    pthread_cond_wait(&chunk_written, &writer_lock);
+  if (stream->free_chunks) {
+    stream->active = stream->free_chunks;
+    stream->free_chunks = stream->active->next;
+  } else {
+    stream->active = nullptr;
+  }
+  pthread_mutex_unlock(&writer_lock);
+  if (!stream->active)
+    stream->active = new_trace_chunk(stream, full_chunk_capacity());
+  if (config.adaptive)
+    finish_adaptive_flush(stream, flush_start);
+}
+
+void trace_stream_printf(trace_stream *stream, const char *format, ...) {
+  trace_chunk *chunk = stream->active;
+  size_t space = chunk->capacity - chunk->size;
+  va_list args;
+  va_start(args, format);
+  int size = vsnprintf(chunk->data + chunk->size, space, format, args);
+  va_end(args);
+  if ((size_t)size >= space) {
+    grow_trace_chunk(chunk, chunk->size + size + 1);
+    va_start(args, format);
+    vsnprintf(chunk->data + chunk->size, size + 1, format, args);
+    va_end(args);
+  }
+  chunk->size += size;
+}
+
+void shutdown_trace_writer() {
+  pthread_mutex_lock(&writer_lock);
+  if (!writer_running) {
+    pthread_mutex_unlock(&writer_lock);
+    return;
+  }
+  writer_stopping = true;
+  pthread_cond_broadcast(&writer_wakeup);
+  pthread_mutex_unlock(&writer_lock);
+  for (size_t i = 0; i < writer_threads.size(); i++)
+    pthread_join(writer_threads[i], NULL);
+  for (size_t i = 0; i < writer_queues.size(); i++) {
+    pthread_mutex_destroy(&writer_queues[i]->lock);
+    delete writer_queues[i];
+  }
+  writer_threads.clear();
+  writer_queues.clear();
+  writer_running = false;
+  writer_stopping = false;
+}
@@ -0,0 +1,204 @@
+#ifndef __LLVM_TRACER_TRACE_WRITER_H__
+#define __LLVM_TRACER_TRACE_WRITER_H__
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <pthread.h>
+
+#include <atomic>
+#include <map>
+#include <string>
+
+#include "trace_codec.h"
+#include "trace_index.h"
+#include "trace_shm.h"
+
+// Buffered trace output.
+//
+// Traces are not written to their files directly. Each trace appends its
+// formatted records to an in-memory chunk owned by its trace_stream, and full
+// chunks are handed off to be compressed and written to the trace_output (the
+// file) in one go. Chunks are only cut between instructions.
+//
+// Any number of threads can write to the same trace file. Each thread has
+// its own stream and fills its own chunks, which are tagged with the thread's
+// ID and their sequence number in that thread (see trace_codec.h), so the
+// chunks of different threads can be interleaved in the file and still be
+// told apart by readers. A thread commits a full chunk by atomically taking
+// the next position in the output's order of chunks; chunks are then written
+// in that order by whichever thread finishes compressing them.
+//
+// Every chunk is compressed independently into a complete frame of the
+// selected codec (see trace_codec.h), and frames are written to their file in
+// the order their chunks were handed off. With the default zlib codec, a
+// trace file is thus a multi-member gzip file: it can be read by any gzip
+// reader as if it were a single stream, and its members can also be located
+// and decompressed in parallel.
+//
+// By default, full chunks are compressed and written out on the logging
+// thread. If LLVMTRACER_ASYNC_WRITER is set, they are compressed by a pool of
+// writer threads instead while the logging thread fills another chunk. The
+// pool is shared by all traces; each thread has its own queue and steals
+// chunks from the other queues when it runs out. This is configured through
+// environment variables:
+//
+//   LLVMTRACER_BUFFER_SIZE:    Size of a chunk in bytes (default 4MB).
+//   LLVMTRACER_WRITER_QUEUE:   Number of full chunks per trace that may be
+//                              waiting for the writer threads (default 1,
+//                              i.e. double buffering). When they are all in
+//                              flight, the logging thread waits for one to
+//                              be compressed.
+//   LLVMTRACER_WRITER_THREADS: Number of writer threads (default: the number
+//                              of online CPUs).
+//
+// If LLVMTRACER_ADAPTIVE_COMPRESSION is set, the compression level starts at
+// the selected level and follows the time that logging threads spend stalled
+// in flush_trace_stream(): it is lowered whenever they stall for more than
+// 1/20 of the time it took to fill the chunk, and raised again after a run
+// of chunks during which they (almost) did not stall at all.
+//
+// If LLVMTRACER_TRACE_INDEX is set, every frame is also recorded in an index
+// file next to its trace (see trace_index.h).
+//
+// LLVMTRACER_TRACE_SINK selects where traces go: "file" (the default), "shm"
+// to stream uncompressed chunks to another process through a shared memory
+// ring (see trace_shm.h) instead, or "shm+file" for both. Traces are only
+// compressed, and only indexed, if they are written to files. "none" writes
+// traces nowhere, for programs that only give them to in-process sinks (see
+// trace_sink.h).
+
+struct trace_writer_config {
+  bool async;
+  size_t buffer_size;
+  int queue_depth;
+  int num_threads;
+  const trace_codec *codec;
+  // Level of the first chunk, and whether the level adapts to stalls.
+  int level;
+  bool adaptive;
+  // Whether to write an index for every trace.
+  bool index;
+  // Whether traces are written to files and to shared memory rings, and the
+  // size of the rings.
+  bool to_file;
+  bool to_shm;
+  size_t shm_size;
+};
+
+// A chunk ready to be written: its compressed frame and index entry for the
+// file, and its message for the shared memory ring.
+struct trace_pending_frame {
+  std::string frame;
+  trace_index_entry entry;
+  std::string message;
+};
+
+// An open trace file. Traces with the same name share their output.
+struct trace_output {
+  // The trace file, if traces are written to files.
+  FILE *file;
+  // The index file, if indexing is on.
+  FILE *index;
+  // The shared memory ring and its name, if traces are written to rings.
+  trace_shm_ring *shm;
+  std::string shm_name;
+  // Position of the next chunk handed off for this output.
+  std::atomic<uint64_t> next_chunk;
+  // Protects everything below.
+  pthread_mutex_t lock;
+  // Position of the next frame to be written, and its byte offset.
+  uint64_t next_frame;
+  uint64_t next_offset;
+  // Chunks that are waiting for earlier chunks to be written.
+  std::map<uint64_t, trace_pending_frame> pending_frames;
+};
+
+struct trace_stream;
+
+struct trace_chunk {
+  char *data;
+  size_t size;
+  size_t capacity;
+  // Where this chunk is going, its position in that output, and the stream
+  // it goes back to when it has been compressed.
+  trace_output *output;
+  uint64_t position;
+  trace_stream *owner;
+  // Compression level and tag, fixed when the chunk is handed off.
+  int level;
+  trace_chunk_tag tag;
+  // The top-level invocation the thread was in when the chunk was handed
+  // off. With the index on, a chunk never spans invocations, so this is the
+  // invocation it belongs to.
+  int64_t invocation;
+  // Link in the owner's free list.
+  trace_chunk *next;
+};
+
+struct trace_stream {
+  trace_output *output;
+  // Tags the chunks of this stream.
+  uint32_t thread_id;
+  uint64_t next_seq;
+  // Context of the active chunk (see trace_codec.h). When a chunk is handed
+  // off, get_context(context_arg) is called for the context of the next one.
+  // This is set by the logger; without it, chunks have no context.
+  trace_chunk_context context;
+  void (*get_context)(void *arg, trace_chunk_context &context);
+  void *context_arg;
+  // The chunk being filled. Never null.
+  trace_chunk *active;
+  // Compressed chunks that can be reused, and the number of chunks waiting
+  // for the writer threads. Both are protected by the writer lock.
+  trace_chunk *free_chunks;
+  int in_flight;
+  // When the active chunk started filling, in nanoseconds. Only used for
+  // adaptive compression.
+  uint64_t fill_start;
+  // Uncompressed size of all chunks handed off so far.
+  uint64_t bytes_written;
+};
+
+const trace_writer_config &get_trace_writer_config();
+
+trace_output *open_trace_output(const char *name);
+void close_trace_output(trace_output *output);
+
+void init_trace_stream(trace_stream *stream);
+// Write out everything in the stream and free its chunks.
+void destroy_trace_stream(trace_stream *stream);
+// Direct future writes to output, writing out anything buffered for the
+// previous output first.
+void set_trace_stream_output(trace_stream *stream, trace_output *output);
+
+// Hand off the active chunk to be written and start a new one. flags are
+// added to the chunk's tag. If the active chunk is empty, only its context is
+// updated.
+void flush_trace_stream(trace_stream *stream, uint32_t flags = 0);
+// Called between instructions: flush the active chunk if it is full.
+static inline void flush_trace_stream_if_full(trace_stream *stream) {
+  if (stream->active->size >= get_trace_writer_config().buffer_size)
+    flush_trace_stream(stream);
+}
+
+void grow_trace_chunk(trace_chunk *chunk, size_t min_capacity);
+
+static inline void trace_stream_write(trace_stream *stream, const void *data,
+                                      size_t size) {
+  trace_chunk *chunk = stream->active;
+  if (chunk->size + size > chunk->capacity)
+    grow_trace_chunk(chunk, chunk->size + size);
+  memcpy(chunk->data + chunk->size, data, size);
+  chunk->size += size;
+}
+
+void trace_stream_printf(trace_stream *stream, const char *format, ...)
+    __attribute__((format(printf, 2, 3)));
+
+// Wait for the writer threads to write out every queued chunk and stop them.
+void shutdown_trace_writer();
+
+#endif
@@ -0,0 +1,73 @@
+#include <stdio.h>
+
+#include "trace_index_reader.h"
+
+bool read_trace_index(const char *name,
+                      std::vector<trace_index_entry> &entries) {
+  entries.clear();
+  FILE *file = fopen(name, "rb");
+  if (!file)
+    return false;
+  uint8_t header[TRACE_INDEX_HEADER_SIZE];
+  uint32_t version, entry_size;
+  bool ok = fread(header, 1, sizeof(header), file) == sizeof(header) &&
+            memcmp(header, TRACE_INDEX_MAGIC, TRACE_INDEX_MAGIC_SIZE) == 0;
+  if (ok) {
+    memcpy(&version, header + TRACE_INDEX_MAGIC_SIZE, 4);
+    memcpy(&entry_size, header + TRACE_INDEX_MAGIC_SIZE + 4, 4);
+    ok = version == TRACE_INDEX_VERSION &&
+         entry_size == TRACE_INDEX_ENTRY_SIZE;
+  }
+  uint8_t buf[TRACE_INDEX_ENTRY_SIZE];
+  size_t n;
+  while (ok && (n = fread(buf, 1, sizeof(buf), file)) > 0) {
+    // A partial entry means the index was cut off.
+    if (n != sizeof(buf)) {
+      ok = false;
+      break;
+    }
+    trace_index_entry entry;
+    decode_index_entry(buf, entry);
+    entries.push_back(entry);
+  }
+  ok = ok && !ferror(file);
+  fclose(file);
+  return ok;
+}
+
+long find_trace_chunk(const std::vector<trace_index_entry> &entries,
+                      uint32_t thread_id, int64_t invocation, int64_t inst) {
+  for (size_t i = 0; i < entries.size(); i++) {
+    const trace_index_entry &entry = entries[i];
+    if (entry.thread_id != thread_id ||
+        (entry.flags & CHUNK_IS_HEADER) ||
+        entry.invocation != invocation)
+      continue;
+    // Chunks of an invocation are indexed in order, so the first one that
+    // ends after inst holds it.
+    if (inst == 0 || inst < entry.end_inst)
+      return i;
+  }
+  return -1;
+}
+
+bool read_indexed_chunk(trace_input &in, const trace_index_entry &entry,
+                        std::string &data) {
+  if (!in.seek(entry.offset))
+    return false;
+  if (in.is_raw()) {
+    // Raw traces have no frames to stop at, so read exactly the chunk.
+    data.resize(entry.size);
+    size_t size = 0;
+    while (size < entry.size) {
+      long n = in.read(&data[size], entry.size - size);
+      if (n <= 0)
+        return false;
+      size += n;
+    }
+    return true;
+  }
+  trace_chunk_tag tag;
+  bool has_tag;
+  return in.read_chunk(data, tag, has_tag) > 0;
+}
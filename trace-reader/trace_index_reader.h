@@ -0,0 +1,26 @@
+#ifndef __LLVM_TRACER_TRACE_INDEX_READER_H__
+#define __LLVM_TRACER_TRACE_INDEX_READER_H__
+
+#include <string>
+#include <vector>
+
+#include "trace_index.h"
+#include "trace_input.h"
+
+// Read the index written next to a trace (see trace_index.h in profile-func)
+// into entries. Returns false if it cannot be read or is malformed.
+bool read_trace_index(const char *name,
+                      std::vector<trace_index_entry> &entries);
+
+// Returns the position in entries of the first chunk of thread_id that holds
+// instruction inst of the given top-level invocation, or -1 if there is none.
+// An inst of 0 finds the start of the invocation.
+long find_trace_chunk(const std::vector<trace_index_entry> &entries,
+                      uint32_t thread_id, int64_t invocation, int64_t inst);
+
+// Read the chunk of entry from in into data, without reading anything before
+// it. Returns false on errors.
+bool read_indexed_chunk(trace_input &in, const trace_index_entry &entry,
+                        std::string &data);
+
+#endif
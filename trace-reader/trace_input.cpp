@@ -0,0 +1,427 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef LLVMTRACER_HAS_ZSTD
+#include <zstd.h>
+#endif
+#ifdef LLVMTRACER_HAS_LZ4
+#include <lz4frame.h>
+#endif
+
+#include "trace_input.h"
+
+#define INPUT_BUFFER_SIZE (1 << 20)
+// The largest possible gzip extra field.
+#define GZIP_EXTRA_MAX 65535
+
+#define ZSTD_FRAME_MAGIC 0xFD2FB528
+#define LZ4_FRAME_MAGIC 0x184D2204
+// zstd and lz4 skippable frames use magic numbers 0x184D2A50-0x184D2A5F.
+#define SKIPPABLE_MAGIC_MASK 0xFFFFFFF0
+#define SKIPPABLE_MAGIC 0x184D2A50
+
+static uint32_t load_u32(const char *buf) {
+  uint32_t value;
+  memcpy(&value, buf, sizeof(value));
+  return value;
+}
+
+trace_input::trace_input()
+    : kind(CODEC_RAW), file(nullptr), inflater_ready(false), context(nullptr),
+      gzip_extra(GZIP_EXTRA_MAX), in_pos(0), in_end(0), frame_done(true),
+      shm(nullptr), shm_left(0), shm_failed(false) {}
+
+trace_input::~trace_input() { close(); }
+
+bool trace_input::open(const char *name) {
+  file = fopen(name, "rb");
+  if (!file)
+    return false;
+  in_buf.resize(INPUT_BUFFER_SIZE);
+  in_pos = in_end = 0;
+  frame_done = true;
+
+  // zstd and lz4 traces start with the skippable frame of the first tag, so
+  // the codec is told by the magic number of the first frame after those.
+  size_t offset = 0;
+  uint32_t magic = 0;
+  while (true) {
+    if (!fill(offset + 8))
+      return false;
+    if (in_end < offset + 4)
+      break;
+    magic = load_u32(&in_buf[offset]);
+    if ((magic & SKIPPABLE_MAGIC_MASK) != SKIPPABLE_MAGIC ||
+        in_end < offset + 8)
+      break;
+    offset += 8 + load_u32(&in_buf[offset + 4]);
+  }
+
+  if (in_end >= 2 && (uint8_t)in_buf[0] == 0x1f && (uint8_t)in_buf[1] == 0x8b) {
+    kind = CODEC_GZIP;
+    memset(&inflater, 0, sizeof(inflater));
+    // 16 + MAX_WBITS only accepts gzip streams.
+    if (inflateInit2(&inflater, 16 + MAX_WBITS) != Z_OK)
+      return false;
+    inflater_ready = true;
+  } else if (magic == ZSTD_FRAME_MAGIC) {
+#ifdef LLVMTRACER_HAS_ZSTD
+    kind = CODEC_ZSTD;
+    context = ZSTD_createDCtx();
+#else
+    fprintf(stderr, "This trace is zstd compressed, but this tool was built "
+                    "without zstd support.\n");
+    return false;
+#endif
+  } else if (magic == LZ4_FRAME_MAGIC) {
+#ifdef LLVMTRACER_HAS_LZ4
+    kind = CODEC_LZ4;
+    LZ4F_dctx *dctx;
+    if (LZ4F_isError(LZ4F_createDecompressionContext(&dctx, LZ4F_VERSION)))
+      return false;
+    context = dctx;
+#else
+    fprintf(stderr, "This trace is lz4 compressed, but this tool was built "
+                    "without lz4 support.\n");
+    return false;
+#endif
+  } else {
+    kind = CODEC_RAW;
+  }
+  return true;
+}
+
+bool trace_input::open_shm(const char *trace_name) {
+  shm_name = trace_shm_name(trace_name);
+  int fd;
+  unsigned waits = 0;
+  while ((fd = shm_open(shm_name.c_str(), O_RDWR, 0)) < 0) {
+    if (errno != ENOENT)
+      return false;
+    trace_shm_wait(waits);
+  }
+  // The producer sizes and initializes the ring right after creating it.
+  struct stat st;
+  waits = 0;
+  while (fstat(fd, &st) == 0 && st.st_size <= TRACE_SHM_DATA_OFFSET)
+    trace_shm_wait(waits);
+  void *mem = MAP_FAILED;
+  if (st.st_size > TRACE_SHM_DATA_OFFSET)
+    mem = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (mem == MAP_FAILED)
+    return false;
+  trace_shm_ring *ring = static_cast<trace_shm_ring *>(mem);
+  waits = 0;
+  while (ring->magic.load(std::memory_order_acquire) != TRACE_SHM_MAGIC)
+    trace_shm_wait(waits);
+  int32_t none = 0;
+  if (ring->version != TRACE_SHM_VERSION ||
+      TRACE_SHM_DATA_OFFSET + ring->capacity != (uint64_t)st.st_size ||
+      !ring->consumer.compare_exchange_strong(none, getpid())) {
+    munmap(mem, st.st_size);
+    return false;
+  }
+  shm = ring;
+  shm_inode = st.st_ino;
+  shm_left = 0;
+  shm_failed = false;
+  kind = CODEC_SHM;
+  in_buf.resize(INPUT_BUFFER_SIZE);
+  in_pos = in_end = 0;
+  frame_done = true;
+  return true;
+}
+
+bool trace_input::fill(size_t size) {
+  if (in_end - in_pos >= size)
+    return true;
+  memmove(&in_buf[0], &in_buf[in_pos], in_end - in_pos);
+  in_end -= in_pos;
+  in_pos = 0;
+  if (in_buf.size() < size)
+    in_buf.resize(size);
+  while (in_end < size) {
+    size_t n;
+    if (shm) {
+      long ret = trace_shm_read(shm, &in_buf[in_end], in_buf.size() - in_end);
+      shm_failed = ret < 0;
+      n = ret < 0 ? 0 : ret;
+    } else {
+      n = fread(&in_buf[in_end], 1, in_buf.size() - in_end, file);
+    }
+    if (n == 0)
+      break;
+    in_end += n;
+  }
+  return shm ? !shm_failed : !ferror(file);
+}
+
+int trace_input::read_shm_message(trace_chunk_tag &tag) {
+  if (!fill(4))
+    return -1;
+  if (in_pos == in_end)
+    return 0;
+  if (in_end - in_pos < 4)
+    return -1;
+  size_t tag_size = load_u32(&in_buf[in_pos]);
+  if (!fill(4 + tag_size + 8) || in_end - in_pos < 4 + tag_size + 8 ||
+      !decode_chunk_tag((const uint8_t *)&in_buf[in_pos + 4], tag_size, tag))
+    return -1;
+  memcpy(&shm_left, &in_buf[in_pos + 4 + tag_size], 8);
+  in_pos += 4 + tag_size + 8;
+  return 1;
+}
+
+bool trace_input::start_frame() {
+  if (kind == CODEC_GZIP) {
+    if (inflateReset(&inflater) != Z_OK)
+      return false;
+    memset(&gzip_header, 0, sizeof(gzip_header));
+    gzip_header.extra = gzip_extra.data();
+    gzip_header.extra_max = gzip_extra.size();
+    if (inflateGetHeader(&inflater, &gzip_header) != Z_OK)
+      return false;
+  }
+  // zstd and lz4 contexts start a new frame by themselves once the last one
+  // is complete.
+  frame_done = false;
+  return true;
+}
+
+bool trace_input::decompress(char *out, size_t size, size_t &out_size) {
+  out_size = 0;
+  while (out_size == 0 && !frame_done) {
+    if (!fill(1) || in_pos == in_end)
+      return false;
+    size_t in_size = in_end - in_pos;
+    switch (kind) {
+      case CODEC_GZIP: {
+        inflater.next_in = (Bytef *)&in_buf[in_pos];
+        inflater.avail_in = in_size;
+        inflater.next_out = (Bytef *)out;
+        inflater.avail_out = size;
+        int ret = inflate(&inflater, Z_NO_FLUSH);
+        if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR)
+          return false;
+        in_pos += in_size - inflater.avail_in;
+        out_size = size - inflater.avail_out;
+        frame_done = ret == Z_STREAM_END;
+        break;
+      }
+      case CODEC_ZSTD: {
+#ifdef LLVMTRACER_HAS_ZSTD
+        ZSTD_outBuffer zout = { out, size, 0 };
+        ZSTD_inBuffer zin = { in_buf.data(), in_end, in_pos };
+        size_t ret = ZSTD_decompressStream((ZSTD_DCtx *)context, &zout, &zin);
+        if (ZSTD_isError(ret))
+          return false;
+        in_pos = zin.pos;
+        out_size = zout.pos;
+        frame_done = ret == 0;
+#endif
+        break;
+      }
+      case CODEC_LZ4: {
+#ifdef LLVMTRACER_HAS_LZ4
+        size_t dst_size = size;
+        size_t ret = LZ4F_decompress((LZ4F_dctx *)context, out, &dst_size,
+                                     &in_buf[in_pos], &in_size, NULL);
+        if (LZ4F_isError(ret))
+          return false;
+        in_pos += in_size;
+        out_size = dst_size;
+        frame_done = ret == 0;
+#endif
+        break;
+      }
+      case CODEC_RAW:
+      case CODEC_SHM:
+        return false;
+    }
+  }
+  return true;
+}
+
+long trace_input::read(void *dst, size_t size) {
+  if (kind == CODEC_SHM) {
+    while (shm_left == 0) {
+      trace_chunk_tag tag;
+      int ret = read_shm_message(tag);
+      if (ret <= 0)
+        return ret;
+    }
+    if (!fill(1) || in_pos == in_end)
+      return -1;
+    size_t n = in_end - in_pos < size ? in_end - in_pos : size;
+    if (n > shm_left)
+      n = shm_left;
+    memcpy(dst, &in_buf[in_pos], n);
+    in_pos += n;
+    shm_left -= n;
+    return n;
+  }
+  if (kind == CODEC_RAW) {
+    if (!fill(1))
+      return -1;
+    size_t n = in_end - in_pos < size ? in_end - in_pos : size;
+    memcpy(dst, &in_buf[in_pos], n);
+    in_pos += n;
+    return n;
+  }
+  size_t out_size = 0;
+  while (out_size == 0) {
+    if (frame_done) {
+      if (!fill(1))
+        return -1;
+      if (in_pos == in_end)
+        return 0;
+      if (!start_frame())
+        return -1;
+    }
+    if (!decompress((char *)dst, size, out_size))
+      return -1;
+  }
+  return out_size;
+}
+
+int trace_input::read_skippable_tag(trace_chunk_tag &tag, bool &has_tag) {
+  if (!fill(8))
+    return -1;
+  if (in_end - in_pos < 8 ||
+      load_u32(&in_buf[in_pos]) != TRACE_SKIPPABLE_TAG_MAGIC)
+    return 1;
+  size_t size = load_u32(&in_buf[in_pos + 4]);
+  if (!fill(8 + size))
+    return -1;
+  if (in_end - in_pos < 8 + size ||
+      !decode_chunk_tag((const uint8_t *)&in_buf[in_pos + 8], size, tag))
+    return -1;
+  has_tag = true;
+  in_pos += 8 + size;
+  return 1;
+}
+
+int trace_input::read_chunk(std::string &data, trace_chunk_tag &tag,
+                            bool &has_tag) {
+  data.clear();
+  has_tag = false;
+  if (kind == CODEC_SHM) {
+    int ret = read_shm_message(tag);
+    if (ret <= 0)
+      return ret;
+    has_tag = true;
+    while (shm_left) {
+      if (!fill(1) || in_pos == in_end)
+        return -1;
+      size_t n = in_end - in_pos < shm_left ? in_end - in_pos : shm_left;
+      data.append(in_buf, in_pos, n);
+      in_pos += n;
+      shm_left -= n;
+    }
+    return 1;
+  }
+  if (!fill(1))
+    return -1;
+  if (in_pos == in_end)
+    return 0;
+  if (kind == CODEC_RAW) {
+    // Raw traces are not framed, so the rest of the trace is one chunk.
+    while (in_pos < in_end) {
+      data.append(in_buf, in_pos, in_end - in_pos);
+      in_pos = in_end;
+      if (!fill(1))
+        return -1;
+    }
+    return 1;
+  }
+  if (kind != CODEC_GZIP && read_skippable_tag(tag, has_tag) < 0)
+    return -1;
+  if (!start_frame())
+    return -1;
+  char buf[64 * 1024];
+  while (!frame_done) {
+    size_t out_size;
+    if (!decompress(buf, sizeof(buf), out_size))
+      return -1;
+    data.append(buf, out_size);
+  }
+  if (kind == CODEC_GZIP && gzip_header.extra) {
+    // Look for the tag among the subfields of the extra field.
+    size_t extra_len = gzip_header.extra_len < gzip_extra.size()
+                           ? gzip_header.extra_len
+                           : gzip_extra.size();
+    size_t pos = 0;
+    while (pos + 4 <= extra_len) {
+      size_t len = gzip_extra[pos + 2] | (gzip_extra[pos + 3] << 8);
+      if (gzip_extra[pos] == TRACE_GZIP_TAG_ID1 &&
+          gzip_extra[pos + 1] == TRACE_GZIP_TAG_ID2 &&
+          pos + 4 + len <= extra_len) {
+        if (!decode_chunk_tag(&gzip_extra[pos + 4], len, tag))
+          return -1;
+        has_tag = true;
+        break;
+      }
+      pos += 4 + len;
+    }
+  }
+  return 1;
+}
+
+bool trace_input::seek(uint64_t offset) {
+  if (!file || fseeko(file, offset, SEEK_SET) != 0)
+    return false;
+  in_pos = in_end = 0;
+  frame_done = true;
+  // Drop whatever was left of the frame that was being decoded.
+#ifdef LLVMTRACER_HAS_ZSTD
+  if (kind == CODEC_ZSTD &&
+      ZSTD_isError(ZSTD_DCtx_reset((ZSTD_DCtx *)context,
+                                   ZSTD_reset_session_only)))
+    return false;
+#endif
+#ifdef LLVMTRACER_HAS_LZ4
+  if (kind == CODEC_LZ4)
+    LZ4F_resetDecompressionContext((LZ4F_dctx *)context);
+#endif
+  return true;
+}
+
+void trace_input::close() {
+  if (inflater_ready)
+    inflateEnd(&inflater);
+  inflater_ready = false;
+#ifdef LLVMTRACER_HAS_ZSTD
+  if (kind == CODEC_ZSTD && context)
+    ZSTD_freeDCtx((ZSTD_DCtx *)context);
+#endif
+#ifdef LLVMTRACER_HAS_LZ4
+  if (kind == CODEC_LZ4 && context)
+    LZ4F_freeDecompressionContext((LZ4F_dctx *)context);
+#endif
+  context = nullptr;
+  if (file)
+    fclose(file);
+  file = nullptr;
+  if (shm) {
+    if (shm->closed && shm->head == shm->tail) {
+      // The whole trace has been read, so the ring can go. Its name is
+      // removed unless the producer already did, or a new run replaced it.
+      struct stat st;
+      int fd = shm_open(shm_name.c_str(), O_RDONLY, 0);
+      if (fd >= 0 && fstat(fd, &st) == 0 && st.st_ino == shm_inode)
+        shm_unlink(shm_name.c_str());
+      if (fd >= 0)
+        ::close(fd);
+    } else {
+      shm->detached = 1;
+    }
+    munmap(shm, TRACE_SHM_DATA_OFFSET + shm->capacity);
+    shm = nullptr;
+  }
+}
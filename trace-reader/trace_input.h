@@ -0,0 +1,97 @@
+#ifndef __LLVM_TRACER_TRACE_INPUT_H__
+#define __LLVM_TRACER_TRACE_INPUT_H__
+
+#include <stddef.h>
+#include <stdio.h>
+#include <zlib.h>
+
+#include <string>
+#include <vector>
+
+#include "trace_codec.h"
+#include "trace_shm.h"
+
+// Reads a trace file written with any of the runtime's compression codecs
+// (see trace_codec.h). The codec is detected from the first frame: gzip, zstd
+// and lz4 frames are recognized by their magic numbers, and anything else is
+// read as an uncompressed (raw) trace.
+//
+// A trace can either be read as one stream of bytes with read(), or chunk by
+// chunk with read_chunk(), but not both. Reading can also start at any frame
+// with seek(), e.g. at an offset from the trace's index (see trace_index.h).
+//
+// A trace that the runtime streams to shared memory (see trace_shm.h) is
+// read the same way after attaching to its ring with open_shm(). Reads then
+// wait for the program to write more, and the trace ends when it closes the
+// ring. Such traces cannot be seeked.
+class trace_input {
+ public:
+  trace_input();
+  ~trace_input();
+
+  // Returns false if the file cannot be opened.
+  bool open(const char *name);
+  // Attach to the shared memory ring of the trace called trace_name as its
+  // consumer, waiting for the program to create it if it does not exist yet.
+  // Returns false on errors, or if the ring already has a consumer.
+  bool open_shm(const char *trace_name);
+  // Read up to size decompressed bytes. Returns the number of bytes read, 0
+  // at the end of the trace, and -1 on errors.
+  long read(void *dst, size_t size);
+  // Read the next chunk written by the runtime into data and its tag into
+  // tag. has_tag is set to false if the chunk is not tagged, which is the
+  // case for raw traces. The tag holds the chunk's context, so chunks read
+  // this way can be handed to other threads to be decoded in parallel.
+  // Returns 1 on success, 0 at the end of the trace, and -1 on errors.
+  int read_chunk(std::string &data, trace_chunk_tag &tag, bool &has_tag);
+  // Continue reading at the frame that starts at byte offset in the file.
+  // Returns false on errors.
+  bool seek(uint64_t offset);
+  // Whether the trace is uncompressed, and thus not made of frames.
+  bool is_raw() const { return kind == CODEC_RAW; }
+  void close();
+
+ private:
+  // CODEC_SHM is a shared memory ring, whose chunks are not compressed.
+  enum codec { CODEC_RAW, CODEC_GZIP, CODEC_ZSTD, CODEC_LZ4, CODEC_SHM };
+
+  // Decompress into out until it is full or the current frame ends, which
+  // sets frame_done. Returns false on errors.
+  bool decompress(char *out, size_t size, size_t &out_size);
+  // Make at least size bytes of compressed input available in in_buf,
+  // unless the file ends first. Returns false on read errors.
+  bool fill(size_t size);
+  // Consume a skippable frame holding a chunk tag, if there is one next.
+  int read_skippable_tag(trace_chunk_tag &tag, bool &has_tag);
+  // Start decoding the next frame. Returns false on errors.
+  bool start_frame();
+  // Read the header of the next message in a shared memory ring. Returns 1
+  // on success, 0 at the end of the trace, and -1 on errors.
+  int read_shm_message(trace_chunk_tag &tag);
+
+  codec kind;
+  FILE *file;
+  // Decompression state of zlib, and of the zstd or lz4 library.
+  z_stream inflater;
+  bool inflater_ready;
+  void *context;
+  // gzip header of the current frame, which receives the tag.
+  gz_header gzip_header;
+  std::vector<uint8_t> gzip_extra;
+  // Compressed input.
+  std::string in_buf;
+  size_t in_pos;
+  size_t in_end;
+  // Whether the last frame has been decoded completely, so that truncated
+  // traces can be told apart from complete ones.
+  bool frame_done;
+  // The shared memory ring and its name, the number of bytes of the current
+  // message's chunk that are left, and whether the producer died.
+  trace_shm_ring *shm;
+  std::string shm_name;
+  ino_t shm_inode;
+  uint64_t shm_left;
+  bool shm_failed;
+};
+
+#endif
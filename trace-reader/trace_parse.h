@@ -0,0 +1,185 @@
+#ifndef __LLVM_TRACER_TRACE_PARSE_H__
+#define __LLVM_TRACER_TRACE_PARSE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+// Scanning and number parsing for text traces.
+//
+// Lines are split by looking for commas and newlines TRACE_SCAN_BLOCK bytes
+// at a time, with AVX2 if the library is built for it (e.g. with
+// -march=native), with SSE2 on any other x86-64 and with a scalar loop
+// elsewhere. A block may extend past the end of the data being scanned, so
+// buffers that are scanned must be followed by TRACE_SCAN_PADDING readable
+// bytes. Delimiters in the padding are ignored.
+
+#define TRACE_SCAN_BLOCK 64
+#define TRACE_SCAN_PADDING TRACE_SCAN_BLOCK
+
+// Find the commas and newlines in the TRACE_SCAN_BLOCK bytes at p. Bit i of
+// the result is set if p[i] is a comma, and bit i of newlines if it is a
+// newline.
+static inline uint64_t trace_scan_block(const char *p, uint64_t &newlines) {
+#if defined(__AVX2__)
+  const __m256i comma = _mm256_set1_epi8(',');
+  const __m256i newline = _mm256_set1_epi8('\n');
+  __m256i lo = _mm256_loadu_si256((const __m256i *)p);
+  __m256i hi = _mm256_loadu_si256((const __m256i *)(p + 32));
+  newlines =
+      (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, newline)) |
+      (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, newline))
+          << 32;
+  return (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, comma)) |
+         (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, comma))
+             << 32;
+#elif defined(__SSE2__)
+  const __m128i comma = _mm_set1_epi8(',');
+  const __m128i newline = _mm_set1_epi8('\n');
+  uint64_t commas = 0;
+  newlines = 0;
+  for (int i = 0; i < TRACE_SCAN_BLOCK; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+    commas |= (uint64_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, comma)) << i;
+    newlines |= (uint64_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, newline)) << i;
+  }
+  return commas;
+#else
+  uint64_t commas = 0;
+  newlines = 0;
+  for (int i = 0; i < TRACE_SCAN_BLOCK; i++) {
+    commas |= (uint64_t)(p[i] == ',') << i;
+    newlines |= (uint64_t)(p[i] == '\n') << i;
+  }
+  return commas;
+#endif
+}
+
+// Index of the lowest set bit of a nonzero mask.
+static inline unsigned trace_scan_ctz(uint64_t mask) {
+  return __builtin_ctzll(mask);
+}
+
+// Lines are split into at most this many fields. No record of the text
+// format has more than eight.
+#define TRACE_MAX_FIELDS 16
+
+// The fields of one line, separated by commas. The last field of a line
+// has no comma after it, so a line with n commas has n + 1 fields.
+struct trace_line_fields {
+  // Offsets of the first TRACE_MAX_FIELDS - 1 commas from the line start.
+  uint32_t commas[TRACE_MAX_FIELDS - 1];
+  // Total number of commas in the line, which may exceed the number stored.
+  unsigned num_commas;
+};
+
+// Split the line at p into fields, scanning no further than end. Returns a
+// pointer to the newline that ends the line, or NULL if there is no newline
+// before end (then fields describes the partial line).
+static inline const char *trace_scan_line(const char *p, const char *end,
+                                          trace_line_fields &fields) {
+  fields.num_commas = 0;
+  for (size_t offset = 0; p + offset < end; offset += TRACE_SCAN_BLOCK) {
+    uint64_t newlines;
+    uint64_t commas = trace_scan_block(p + offset, newlines);
+    size_t left = end - (p + offset);
+    if (left < TRACE_SCAN_BLOCK) {
+      uint64_t valid = ((uint64_t)1 << left) - 1;
+      commas &= valid;
+      newlines &= valid;
+    }
+    // Only commas before the newline belong to this line.
+    if (newlines)
+      commas &= ((uint64_t)1 << trace_scan_ctz(newlines)) - 1;
+    for (; commas; commas &= commas - 1) {
+      if (fields.num_commas < TRACE_MAX_FIELDS - 1)
+        fields.commas[fields.num_commas] = offset + trace_scan_ctz(commas);
+      fields.num_commas++;
+    }
+    if (newlines)
+      return p + offset + trace_scan_ctz(newlines);
+  }
+  return NULL;
+}
+
+// Number parsing. Values are parsed the way strtoll, strtoull (base 16) and
+// strtod parse them, but the common forms written by the runtime ("%ld",
+// "%#llx" and "%f") are parsed inline. Anything else, such as numbers that
+// may overflow, is handed to the C library. Like the C functions, parsing
+// stops at the first character that is not part of the number, and the
+// number must be followed by such a character within the buffer (in traces,
+// a comma always follows).
+
+static inline int64_t trace_parse_int(const char *p) {
+  const char *start = p;
+  bool negative = *p == '-';
+  p += negative || *p == '+';
+  uint64_t result = 0;
+  int digits = 0;
+  for (unsigned digit; (digit = (unsigned)(*p - '0')) <= 9; p++, digits++)
+    result = result * 10 + digit;
+  // 18 digits cannot overflow. Anything with leading whitespace is left to
+  // strtoll as well.
+  if (digits > 18 || digits == 0)
+    return strtoll(start, NULL, 10);
+  return negative ? -(int64_t)result : (int64_t)result;
+}
+
+static inline uint64_t trace_parse_hex(const char *p) {
+  const char *start = p;
+  if (p[0] == '0' && (p[1] | 0x20) == 'x')
+    p += 2;
+  uint64_t result = 0;
+  int digits = 0;
+  for (;; p++, digits++) {
+    unsigned c = (unsigned char)*p, digit;
+    if (c - '0' <= 9)
+      digit = c - '0';
+    else if ((c | 0x20) - 'a' <= 5)
+      digit = (c | 0x20) - 'a' + 10;
+    else
+      break;
+    result = (result << 4) | digit;
+  }
+  // Longer numbers (e.g. vector values) saturate like they do in strtoull.
+  // Anything with leading whitespace or a sign is left to it as well.
+  if (digits > 16 || digits == 0)
+    return strtoull(start, NULL, 16);
+  return result;
+}
+
+static inline double trace_parse_double(const char *p) {
+  // Powers of ten that are exact doubles.
+  static const double powers_of_ten[] = {
+      1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+      1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+  const char *start = p;
+  bool negative = *p == '-';
+  p += negative;
+  uint64_t mantissa = 0;
+  int digits = 0;
+  int fraction_digits = 0;
+  unsigned digit;
+  for (; (digit = (unsigned)(*p - '0')) <= 9; p++, digits++)
+    mantissa = mantissa * 10 + digit;
+  if (*p == '.') {
+    for (p++; (digit = (unsigned)(*p - '0')) <= 9; p++, fraction_digits++)
+      mantissa = mantissa * 10 + digit;
+    digits += fraction_digits;
+  }
+  // If the digits and the power of ten are both exact doubles, dividing
+  // them rounds correctly, so the result is exactly what strtod returns.
+  // Everything else (exponents, hex, inf, nan, long or very precise numbers)
+  // is left to strtod.
+  if (digits == 0 || digits > 19 || mantissa > ((uint64_t)1 << 53) ||
+      fraction_digits > 22 || (unsigned)((*p | 0x20) - 'a') < 26)
+    return strtod(start, NULL);
+  double result = (double)mantissa / powers_of_ten[fraction_digits];
+  return negative ? -result : result;
+}
+
+#endif
@@ -0,0 +1,339 @@
+#include "trace_format.h"
+#include "trace_reader.h"
+
+// Size of the buffer, not counting its padding.
+#define READER_BUFFER_SIZE (4 << 20)
+#define LABELMAP_START "%%%% LABEL MAP START %%%%"
+#define LABELMAP_END "%%%% LABEL MAP END %%%%"
+
+// Reads the fields of a line, as split by trace_scan_line(), in order.
+struct field_reader {
+  const char *line;
+  const char *end;
+  const trace_line_fields &fields;
+  unsigned next;
+
+  field_reader(const char *_line, const char *_end,
+               const trace_line_fields &_fields)
+      : line(_line), end(_end), fields(_fields), next(0) {}
+
+  // Whether all fields have been read.
+  bool done() const { return next > fields.num_commas; }
+  // Whether the fields left are anything but a single empty field.
+  bool more() const { return !done() && start() < end; }
+  const char *start() const {
+    return next == 0 ? line : line + fields.commas[next - 1] + 1;
+  }
+
+  // Read the next field. Returns false if there are no fields left.
+  bool field(trace_view &field) {
+    if (done())
+      return false;
+    field.data = start();
+    field.size =
+        (next < fields.num_commas ? line + fields.commas[next] : end) -
+        field.data;
+    next++;
+    return true;
+  }
+};
+
+template <typename T>
+static inline bool parse_int(const trace_view &field, T &value) {
+  const char *p = field.data;
+  const char *end = p + field.size;
+  bool negative = p < end && *p == '-';
+  if (negative)
+    p++;
+  if (p == end)
+    return false;
+  uint64_t result = 0;
+  for (; p < end; p++) {
+    unsigned digit = *p - '0';
+    if (digit > 9)
+      return false;
+    result = result * 10 + digit;
+  }
+  value = negative ? -(T)result : (T)result;
+  return true;
+}
+
+template <typename T>
+static inline bool next_int(field_reader &fields, T &value) {
+  trace_view field;
+  return fields.field(field) && parse_int(field, value);
+}
+
+static inline bool line_equals(const char *line, const char *end,
+                               const char *str) {
+  size_t size = strlen(str);
+  return (size_t)(end - line) == size && memcmp(line, str, size) == 0;
+}
+
+trace_reader::trace_reader()
+    : buf_pos(0), buf_end(0), at_eof(false), labelmap_found(false),
+      records_read(0), line_number(0) {}
+
+bool trace_reader::open(const char *name) {
+  close();
+  if (!input.open(name))
+    return false;
+  return start();
+}
+
+bool trace_reader::open_shm(const char *trace_name) {
+  close();
+  if (!input.open_shm(trace_name))
+    return false;
+  return start();
+}
+
+bool trace_reader::start() {
+  buf.resize(READER_BUFFER_SIZE + TRACE_SCAN_PADDING);
+  if (!refill())
+    return !failed();
+  return read_header();
+}
+
+bool trace_reader::open_buffer(const char *data, size_t size) {
+  close();
+  buf.assign(data, size);
+  buf.resize(size + TRACE_SCAN_PADDING);
+  buf_end = size;
+  at_eof = true;
+  return read_header();
+}
+
+bool trace_reader::read_header() {
+  if (buf_end >= TRACE_BINARY_MAGIC_SIZE &&
+      memcmp(buf.data(), TRACE_BINARY_MAGIC, TRACE_BINARY_MAGIC_SIZE) == 0)
+    return fail("This is a binary trace. Convert it with trace-to-text.");
+
+  // The labelmap is optional, so that parts of traces can be read too.
+  const char *line, *line_end;
+  size_t start = buf_pos;
+  if (!next_line(line, line_end))
+    return !failed();
+  if (!line_equals(line, line_end, LABELMAP_START)) {
+    buf_pos = start;
+    line_number = 0;
+    return true;
+  }
+  labelmap_found = true;
+  while (next_line(line, line_end)) {
+    if (line_equals(line, line_end, LABELMAP_END))
+      return true;
+    labelmap_str.append(line, line_end - line);
+    labelmap_str += '\n';
+  }
+  return fail("The labelmap is not terminated.");
+}
+
+void trace_reader::close() {
+  input.close();
+  buf_pos = buf_end = 0;
+  at_eof = false;
+  labelmap_found = false;
+  labelmap_str.clear();
+  error_str.clear();
+  records_read = 0;
+  line_number = 0;
+}
+
+bool trace_reader::fail(const char *message) {
+  error_str = message;
+  if (line_number)
+    error_str += " (line " + std::to_string(line_number) + ")";
+  return false;
+}
+
+bool trace_reader::refill() {
+  if (at_eof)
+    return false;
+  memmove(&buf[0], &buf[buf_pos], buf_end - buf_pos);
+  buf_end -= buf_pos;
+  buf_pos = 0;
+  // A line that does not fit in the buffer makes it grow.
+  size_t capacity = buf.size() - TRACE_SCAN_PADDING;
+  if (buf_end == capacity) {
+    capacity *= 2;
+    buf.resize(capacity + TRACE_SCAN_PADDING);
+  }
+  long n = input.read(&buf[buf_end], capacity - buf_end);
+  if (n < 0) {
+    fail("Failed to read the trace.");
+    return false;
+  }
+  if (n == 0)
+    at_eof = true;
+  buf_end += n;
+  // After a short read, the bytes past the data are left over from earlier
+  // reads. Clear the padding so that scans never see stale delimiters, as in
+  // a buffer from open_buffer().
+  memset(&buf[buf_end], 0, TRACE_SCAN_PADDING);
+  return n > 0;
+}
+
+bool trace_reader::buffered_line(const char *&line, const char *&line_end) {
+  if (buf_pos == buf_end)
+    return false;
+  const char *start = buf.data() + buf_pos;
+  const char *newline =
+      trace_scan_line(start, buf.data() + buf_end, fields);
+  if (!newline) {
+    // The last line of a trace may have no newline.
+    if (!at_eof)
+      return false;
+    newline = buf.data() + buf_end;
+  }
+  line = start;
+  line_end = newline;
+  buf_pos = newline - buf.data() + (newline < buf.data() + buf_end);
+  line_number++;
+  return true;
+}
+
+bool trace_reader::next_line(const char *&line, const char *&line_end) {
+  while (!buffered_line(line, line_end)) {
+    if (!refill() && (failed() || buf_pos == buf_end))
+      return false;
+  }
+  return true;
+}
+
+bool trace_reader::parse_line(const char *line, const char *end,
+                              trace_record &record) {
+  if (fields.num_commas >= TRACE_MAX_FIELDS)
+    return fail("Malformed line.");
+  field_reader p(line, end, fields);
+  trace_view field;
+  switch (*line) {
+    case 'e':
+      record.kind = RECORD_ENTRY;
+      if (!p.field(field) || field != "entry")
+        return fail("Malformed line.");
+      if (p.field(record.function) && next_int(p, record.num_params))
+        return true;
+      return fail("Malformed entry line.");
+    case 't':
+      record.kind = RECORD_TIMESTAMP;
+      record.input = -1;
+      if (p.field(field) && field == "t" && next_int(p, record.timestamp) &&
+          (p.done() || next_int(p, record.input)))
+        return true;
+      return fail("Malformed timestamp line.");
+    case 's':
+      if (!p.field(field))
+        return fail("Malformed line.");
+      if (field == "simpoint") {
+        record.kind = RECORD_SIMPOINT;
+        if (next_int(p, record.interval) && p.field(field)) {
+          record.weight = field.to_double();
+          return true;
+        }
+        return fail("Malformed simpoint line.");
+      }
+      record.kind = RECORD_SAMPLING;
+      if (field == "sampling" && next_int(p, record.insts) &&
+          next_int(p, record.logged_insts) &&
+          next_int(p, record.invocations) &&
+          next_int(p, record.logged_invocations) &&
+          next_int(p, record.sample_period))
+        return true;
+      return fail("Malformed sampling line.");
+    case 'w':
+      record.kind = RECORD_WINDOW;
+      if (p.field(field) && field == "window" &&
+          next_int(p, record.skipped_insts) && next_int(p, record.warmup_insts))
+        return true;
+      return fail("Malformed window line.");
+    case 'i':
+      record.kind = RECORD_ITERATION;
+      if (p.field(field) && field == "iteration" &&
+          next_int(p, record.iteration))
+        return true;
+      return fail("Malformed iteration line.");
+    case 'l':
+      record.kind = RECORD_LOOP;
+      if (p.field(field) && field == "loop" &&
+          next_int(p, record.executions) && next_int(p, record.iterations) &&
+          next_int(p, record.logged_iterations))
+        return true;
+      return fail("Malformed loop line.");
+    case 'r':
+    case 'f':
+      record.kind = *line == 'r' ? RECORD_RESULT : RECORD_FORWARD;
+      if (!p.field(field) || field.size != 1)
+        return fail("Malformed line.");
+      break;
+    default:
+      if (!next_int(p, record.line))
+        return fail("Malformed line.");
+      if (record.line == 0) {
+        record.kind = RECORD_INST;
+        if (next_int(p, record.line) && p.field(record.function) &&
+            p.field(record.basic_block) && p.field(record.inst) &&
+            next_int(p, record.opcode) && next_int(p, record.inst_count))
+          return true;
+        return fail("Malformed instruction line.");
+      }
+      record.kind = RECORD_PARAM;
+      break;
+  }
+
+  // The rest of a parameter line: size, value, is_reg, label (a space if
+  // is_reg is not set) and, for phis, the previous basic block.
+  int is_reg;
+  if (!next_int(p, record.size) || !p.field(record.value) ||
+      !next_int(p, is_reg) || !p.field(record.label))
+    return fail("Malformed parameter line.");
+  record.is_reg = is_reg;
+  if (!is_reg)
+    record.label.size = 0;
+  record.is_phi = p.more();
+  record.prev_bb.data = record.is_phi ? p.start() : end;
+  record.prev_bb.size = 0;
+  if (record.is_phi && !p.field(record.prev_bb))
+    return fail("Malformed parameter line.");
+  return true;
+}
+
+bool trace_reader::next(trace_record &record) {
+  if (failed())
+    return false;
+  const char *line, *line_end;
+  while (next_line(line, line_end)) {
+    if (line == line_end)
+      continue;
+    if (!parse_line(line, line_end, record))
+      return false;
+    records_read++;
+    return true;
+  }
+  return false;
+}
+
+size_t trace_reader::next_batch(std::vector<trace_record> &records,
+                                size_t max_records) {
+  records.clear();
+  if (failed())
+    return 0;
+  while (records.empty()) {
+    const char *line, *line_end;
+    while (records.size() < max_records && buffered_line(line, line_end)) {
+      if (line == line_end)
+        continue;
+      records.resize(records.size() + 1);
+      if (!parse_line(line, line_end, records.back())) {
+        records.pop_back();
+        break;
+      }
+    }
+    if (failed() || !records.empty())
+      break;
+    if (!refill() && (failed() || buf_pos == buf_end))
+      break;
+  }
+  records_read += records.size();
+  return records.size();
+}
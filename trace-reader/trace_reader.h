@@ -0,0 +1,246 @@
+#ifndef __LLVM_TRACER_TRACE_READER_H__
+#define __LLVM_TRACER_TRACE_READER_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include "trace_input.h"
+#include "trace_parse.h"
+
+// Streaming reader for text traces.
+//
+// The reader decompresses a trace (with any of the runtime's codecs, see
+// trace_input.h) into a buffer and parses it one line at a time. Records are
+// returned as views: every name and value of a record points into the
+// buffer, so reading a record does not allocate or copy anything. Views stay
+// valid until the next call that reads from the reader.
+//
+// Records can be read one at a time, through next() or an iterator:
+//
+//   trace_reader reader;
+//   if (!reader.open("dynamic_trace.gz")) ...
+//   for (const trace_record &record : reader) ...
+//   if (reader.failed()) ...
+//
+// or in batches of all complete records in the buffer, with next_batch().
+//
+// Lines are split at their commas and newlines with SIMD instructions where
+// available, and numbers are parsed without the C library in the common
+// cases (see trace_parse.h).
+//
+// Binary traces must be converted with trace-to-text first. Traces written
+// by several threads under the same name interleave the threads' chunks;
+// split them with trace-demux first to read one thread at a time.
+
+enum trace_record_kind {
+  // entry,<function>,<num_params>,
+  RECORD_ENTRY,
+  // 0,<line>,<function>,<basic_block>,<inst>,<opcode>,<inst_count>
+  RECORD_INST,
+  // <line>,<size>,<value>,<is_reg>,<label>,[<prev_bb>,]
+  // where line is the operand number.
+  RECORD_PARAM,
+  // r,<size>,<value>,<is_reg>,<label>,[<prev_bb>,]
+  RECORD_RESULT,
+  // f,<size>,<value>,<is_reg>,<label>,[<prev_bb>,]
+  RECORD_FORWARD,
+  // t,<timestamp>[,<input>] (see LLVMTRACER_TIMESTAMPS and trace-merge)
+  RECORD_TIMESTAMP,
+  // sampling,<insts>,<logged_insts>,<invocations>,<logged_invocations>,
+  // <sample_period> (see LLVMTRACER_TRACE_BUDGET and LLVMTRACER_SAMPLE_PERIOD)
+  RECORD_SAMPLING,
+  // window,<skipped_insts>,<warmup_insts> (see LLVMTRACER_SAMPLE_PERIOD)
+  RECORD_WINDOW,
+  // simpoint,<interval>,<weight> (see LLVMTRACER_SIMPOINTS)
+  RECORD_SIMPOINT,
+  // iteration,<iteration> (see LLVMTRACER_LOOP_LABEL)
+  RECORD_ITERATION,
+  // loop,<executions>,<iterations>,<logged_iterations>
+  RECORD_LOOP,
+};
+
+// A string in the reader's buffer. It is not null terminated.
+struct trace_view {
+  const char *data;
+  size_t size;
+
+  std::string str() const { return std::string(data, size); }
+  bool empty() const { return size == 0; }
+  bool operator==(const char *other) const {
+    return strncmp(data, other, size) == 0 && other[size] == '\0';
+  }
+  bool operator!=(const char *other) const { return !(*this == other); }
+
+  // Parameter values in the text format. Values are always followed by a
+  // comma in the buffer, so they can be parsed in place (see trace_parse.h).
+  int64_t to_int() const { return trace_parse_int(data); }
+  uint64_t to_ptr() const { return trace_parse_hex(data); }
+  double to_double() const { return trace_parse_double(data); }
+};
+
+// A view of one record. Which fields are set depends on the kind.
+struct trace_record {
+  trace_record_kind kind;
+  // RECORD_INST: source line. RECORD_PARAM: operand number.
+  int64_t line;
+  // RECORD_ENTRY and RECORD_INST.
+  trace_view function;
+  // RECORD_INST.
+  trace_view basic_block;
+  trace_view inst;
+  int opcode;
+  int64_t inst_count;
+  // RECORD_ENTRY.
+  int num_params;
+  // RECORD_PARAM, RECORD_RESULT and RECORD_FORWARD. label is empty unless
+  // is_reg is set, and prev_bb is empty unless is_phi is set.
+  int size;
+  trace_view value;
+  bool is_reg;
+  trace_view label;
+  bool is_phi;
+  trace_view prev_bb;
+  // RECORD_TIMESTAMP. input is -1 unless the trace was merged.
+  uint64_t timestamp;
+  int input;
+  // RECORD_SAMPLING. The numbers of instructions and top-level invocations
+  // the program ran and how many of them were logged, and the sampling
+  // period at the end of the trace (0 if the budget ran out).
+  uint64_t insts;
+  uint64_t logged_insts;
+  uint64_t invocations;
+  uint64_t logged_invocations;
+  uint64_t sample_period;
+  // RECORD_WINDOW. The number of instructions skipped since the last logged
+  // one, and how many of the instructions after it only warm up the window.
+  // Gaps that end at the entry of an invocation are closed by a window
+  // record right before the entry.
+  uint64_t skipped_insts;
+  uint64_t warmup_insts;
+  // RECORD_SIMPOINT. The interval that starts here, and the fraction of the
+  // program's intervals it stands for.
+  uint64_t interval;
+  double weight;
+  // RECORD_ITERATION. The iteration of the sampled loop that starts here,
+  // counted from 0 in every execution of the loop.
+  uint64_t iteration;
+  // RECORD_LOOP. The number of times the sampled loop was run, its total
+  // number of iterations, and how many of them were logged.
+  uint64_t executions;
+  uint64_t iterations;
+  uint64_t logged_iterations;
+};
+
+class trace_reader {
+ public:
+  trace_reader();
+
+  // Open a text trace and read its labelmap. Returns false if the file
+  // cannot be opened or is not a text trace.
+  bool open(const char *name);
+  // Read a text trace that the runtime streams to shared memory, as it is
+  // written (see trace_input::open_shm()).
+  bool open_shm(const char *trace_name);
+  // Read a text trace, or any part of one that starts at a record boundary
+  // (such as a chunk from trace_input::read_chunk), that is already in
+  // memory. The data is copied.
+  bool open_buffer(const char *data, size_t size);
+  void close();
+
+  // The labelmap from the header of the trace, and whether the trace starts
+  // with a labelmap section at all (it may be empty).
+  const std::string &labelmap() const { return labelmap_str; }
+  bool has_labelmap() const { return labelmap_found; }
+
+  // Read the next record. Returns false at the end of the trace or on
+  // errors, which are told apart by failed().
+  bool next(trace_record &record);
+  // Read up to max_records of the complete records that are already in the
+  // buffer into records, refilling the buffer first if there are none.
+  // Returns the number of records, which is 0 at the end of the trace. On
+  // errors, the records before the error are returned and failed() is set.
+  // Views in the batch stay valid until the next read.
+  size_t next_batch(std::vector<trace_record> &records,
+                    size_t max_records = 65536);
+
+  // Whether reading stopped because of an error. error() describes it.
+  bool failed() const { return !error_str.empty(); }
+  const std::string &error() const { return error_str; }
+
+  // Number of records read so far.
+  uint64_t num_records() const { return records_read; }
+
+  class iterator {
+   public:
+    typedef std::input_iterator_tag iterator_category;
+    typedef trace_record value_type;
+    typedef ptrdiff_t difference_type;
+    typedef const trace_record *pointer;
+    typedef const trace_record &reference;
+
+    iterator() : reader(nullptr) {}
+    explicit iterator(trace_reader *_reader) : reader(_reader) { ++*this; }
+    const trace_record &operator*() const { return record; }
+    const trace_record *operator->() const { return &record; }
+    iterator &operator++() {
+      if (!reader->next(record))
+        reader = nullptr;
+      return *this;
+    }
+    bool operator==(const iterator &other) const {
+      return reader == other.reader;
+    }
+    bool operator!=(const iterator &other) const {
+      return reader != other.reader;
+    }
+
+   private:
+    trace_reader *reader;
+    trace_record record;
+  };
+
+  iterator begin() { return iterator(this); }
+  iterator end() { return iterator(); }
+
+ private:
+  // Find the next line that is already in the buffer. Returns false if
+  // there is no complete line left in it.
+  // The line is split into fields.
+  bool buffered_line(const char *&line, const char *&line_end);
+  // Find the next line, refilling the buffer if needed. Returns false at the
+  // end of the trace or on errors.
+  bool next_line(const char *&line, const char *&line_end);
+  // Move the unread part of the buffer to its start and read more data.
+  // Returns false if there was nothing more to read.
+  bool refill();
+  // Fill the buffer from the input that was just opened and read the header.
+  bool start();
+  // Check the start of the trace and read its labelmap, if it has one.
+  bool read_header();
+  // Parse the line most recently returned by buffered_line().
+  bool parse_line(const char *line, const char *end, trace_record &record);
+  bool fail(const char *message);
+
+  trace_input input;
+  // The data that was read, followed by TRACE_SCAN_PADDING bytes.
+  std::string buf;
+  // Unread data in buf, and whether the input has been read completely.
+  size_t buf_pos;
+  size_t buf_end;
+  bool at_eof;
+  // The fields of the last line found.
+  trace_line_fields fields;
+  bool labelmap_found;
+  std::string labelmap_str;
+  std::string error_str;
+  uint64_t records_read;
+  uint64_t line_number;
+};
+
+#endif
@@ -0,0 +1,68 @@
+/* Example in-process trace sink: a histogram of the opcodes of all logged
+ * instructions, printed when the program exits.
+ *
+ * Load it into an instrumented program with LLVMTRACER_SINK_PLUGINS, and
+ * skip writing the trace entirely with LLVMTRACER_TRACE_SINK=none:
+ *
+ *   LLVMTRACER_TRACE_SINK=none \
+ *   LLVMTRACER_SINK_PLUGINS=$TRACER_HOME/lib/libopcode-histogram-sink.so \
+ *   ./triad-instrumented
+ *
+ * See trace_sink.h for the interface.
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdint.h>
+
+#include <atomic>
+
+#include "trace_sink.h"
+
+// Opcodes are LLVM instruction opcodes, which are well below this.
+#define MAX_OPCODE 256
+
+static std::atomic<uint64_t> opcode_counts[MAX_OPCODE];
+static std::atomic<uint64_t> num_entries(0);
+
+// Batches of different threads may arrive at the same time, so each batch is
+// counted locally first.
+static void count_records(void * /*arg*/, const char * /*trace_name*/,
+                          uint32_t /*thread_id*/,
+                          const llvmtracer_record *records,
+                          size_t num_records) {
+  uint64_t counts[MAX_OPCODE] = {0};
+  uint64_t entries = 0;
+  for (size_t i = 0; i < num_records; i++) {
+    if (records[i].kind == LLVMTRACER_RECORD_ENTRY)
+      entries++;
+    else if (records[i].kind == LLVMTRACER_RECORD_INST &&
+             records[i].opcode >= 0 && records[i].opcode < MAX_OPCODE)
+      counts[records[i].opcode]++;
+  }
+  for (int i = 0; i < MAX_OPCODE; i++) {
+    if (counts[i])
+      opcode_counts[i] += counts[i];
+  }
+  num_entries += entries;
+}
+
+static void print_histogram(void * /*arg*/) {
+  uint64_t total = 0;
+  for (int i = 0; i < MAX_OPCODE; i++)
+    total += opcode_counts[i];
+  printf("%" PRIu64 " instructions in %" PRIu64 " top-level invocations\n",
+         total, (uint64_t)num_entries);
+  printf("opcode      count       %%\n");
+  for (int i = 0; i < MAX_OPCODE; i++) {
+    uint64_t count = opcode_counts[i];
+    if (count)
+      printf("%6d %10" PRIu64 " %6.2f%%\n", i, count, 100.0 * count / total);
+  }
+}
+
+extern "C" int llvmtracer_sink_init(llvmtracer_sink *sink) {
+  sink->records = &count_records;
+  sink->finish = &print_histogram;
+  return 0;
+}
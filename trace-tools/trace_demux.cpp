@@ -0,0 +1,95 @@
+/* Splits a trace written by several threads into one trace per thread.
+ *
+ * Threads that share a trace name write their chunks into the same file,
+ * interleaved in the order they were handed off. Every chunk is tagged with
+ * the ID of the thread that wrote it (see trace_codec.h), which is used here
+ * to reassemble the stream of each thread. Each output starts with the
+ * shared trace header, so it is a complete trace in the same format (text or
+ * binary) as the input, and is gzipped.
+ *
+ * Usage: trace-demux trace.gz output_prefix
+ *
+ * The trace of thread N is written to output_prefix.N.gz.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <zlib.h>
+
+#include <map>
+#include <string>
+
+#include "trace_input.h"
+
+struct thread_output {
+  gzFile file;
+  // Sequence number of the last chunk written, to check the order of chunks.
+  uint64_t last_seq;
+};
+
+static void write_or_die(gzFile file, const std::string &data) {
+  if (data.size() && gzwrite(file, data.data(), data.size()) == 0) {
+    fprintf(stderr, "Failed to write output trace.\n");
+    exit(1);
+  }
+}
+
+int main(int argc, char *argv[]) {
+  if (argc != 3) {
+    fprintf(stderr, "Usage: %s trace.gz output_prefix\n", argv[0]);
+    return 1;
+  }
+  trace_input in;
+  if (!in.open(argv[1])) {
+    perror("Failed to open input trace");
+    return 1;
+  }
+
+  std::string header;
+  std::map<uint32_t, thread_output> outputs;
+  std::string data;
+  trace_chunk_tag tag;
+  bool has_tag;
+  int ret;
+  while ((ret = in.read_chunk(data, tag, has_tag)) > 0) {
+    if (!has_tag) {
+      fprintf(stderr, "The trace is not tagged with thread IDs. Raw traces "
+                      "cannot be split.\n");
+      return 1;
+    }
+    if (tag.flags & CHUNK_IS_HEADER) {
+      header += data;
+      continue;
+    }
+    auto it = outputs.find(tag.thread_id);
+    if (it == outputs.end()) {
+      std::string name =
+          std::string(argv[2]) + "." + std::to_string(tag.thread_id) + ".gz";
+      thread_output output;
+      output.file = gzopen(name.c_str(), "w");
+      if (!output.file) {
+        perror("Failed to open output trace");
+        return 1;
+      }
+      write_or_die(output.file, header);
+      it = outputs.insert(std::make_pair(tag.thread_id, output)).first;
+    } else if (tag.seq <= it->second.last_seq) {
+      fprintf(stderr, "Chunks of thread %u are out of order.\n",
+              tag.thread_id);
+      return 1;
+    }
+    it->second.last_seq = tag.seq;
+    write_or_die(it->second.file, data);
+  }
+  if (ret < 0) {
+    fprintf(stderr, "Failed to read input trace.\n");
+    return 1;
+  }
+
+  for (auto it = outputs.begin(); it != outputs.end(); ++it)
+    gzclose(it->second.file);
+  in.close();
+  printf("Split the trace into %zu threads.\n", outputs.size());
+  return 0;
+}
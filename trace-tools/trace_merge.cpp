@@ -0,0 +1,222 @@
+/* Merges the traces of several threads into one trace in global time order.
+ *
+ * The inputs must be text traces written with LLVMTRACER_TIMESTAMPS set (use
+ * trace-to-text to convert binary traces first), and their timestamps must
+ * come from the same clock. Each input is split into segments at its "t,"
+ * timestamp lines, and segments are copied to the output in timestamp order.
+ * Only one segment of each input is held in memory at a time.
+ *
+ * The output starts with the labelmap of the first input. Every segment is
+ * preceded by a "t,<timestamp>,<input>" line, where input is the index of the
+ * trace it came from in the argument list, starting from 0. Records of an
+ * input before its first timestamp cannot be placed in time, so they are an
+ * error, as is an input without any timestamps.
+ *
+ * Usage: trace-merge merged_trace.gz trace0.gz trace1.gz ...
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#include <queue>
+#include <string>
+#include <vector>
+
+#include "trace_input.h"
+
+#define LABELMAP_START "%%%% LABEL MAP START %%%%"
+#define LABELMAP_END "%%%% LABEL MAP END %%%%"
+
+// Reads a trace line by line.
+class line_reader {
+ public:
+  line_reader() : pos(0), end(0) {}
+
+  bool open(const char *name) { return in.open(name); }
+
+  // Read the next line, without its newline, into line. Returns false at
+  // the end of the trace.
+  bool getline(std::string &line) {
+    line.clear();
+    while (true) {
+      if (pos == end) {
+        long n = in.read(buf, sizeof(buf));
+        if (n < 0) {
+          fprintf(stderr, "Failed to read input trace.\n");
+          exit(1);
+        }
+        if (n == 0)
+          return !line.empty();
+        pos = 0;
+        end = n;
+      }
+      char *newline = (char *)memchr(buf + pos, '\n', end - pos);
+      if (newline) {
+        line.append(buf + pos, newline - (buf + pos));
+        pos = newline - buf + 1;
+        return true;
+      }
+      line.append(buf + pos, end - pos);
+      pos = end;
+    }
+  }
+
+ private:
+  trace_input in;
+  char buf[1 << 16];
+  size_t pos;
+  size_t end;
+};
+
+// Returns true if line is a timestamp, and parses it into timestamp.
+static bool parse_timestamp(const std::string &line, uint64_t &timestamp) {
+  if (line.compare(0, 2, "t,") != 0)
+    return false;
+  timestamp = strtoull(line.c_str() + 2, NULL, 10);
+  return true;
+}
+
+struct merge_input {
+  line_reader reader;
+  // Timestamp and contents of the current segment.
+  uint64_t timestamp;
+  std::string segment;
+  // Timestamp of the segment after this one, if has_next.
+  uint64_t next_timestamp;
+  bool has_next;
+};
+
+// Read the labelmap at the start of an input, if it has one, and the blank
+// lines up to its first timestamp into header. Returns false if the input has
+// no timestamps or records before the first one.
+static bool read_header(merge_input &input, const char *name,
+                        std::string &header) {
+  input.has_next = false;
+  std::string line;
+  bool in_labelmap = false;
+  bool first = true;
+  while (input.reader.getline(line)) {
+    if (first && line == LABELMAP_START)
+      in_labelmap = true;
+    first = false;
+    if (in_labelmap) {
+      in_labelmap = line != LABELMAP_END;
+    } else if (parse_timestamp(line, input.next_timestamp)) {
+      input.has_next = true;
+      return true;
+    } else if (!line.empty()) {
+      fprintf(stderr, "%s has records before its first timestamp.\n", name);
+      return false;
+    }
+    header += line;
+    header += '\n';
+  }
+  if (in_labelmap)
+    fprintf(stderr, "The labelmap of %s is not terminated.\n", name);
+  else
+    fprintf(stderr, "%s has no timestamps.\n", name);
+  return false;
+}
+
+// Read lines up to the next timestamp into segment. Returns false if there
+// were no more segments.
+static bool load_segment(merge_input &input) {
+  if (!input.has_next)
+    return false;
+  input.timestamp = input.next_timestamp;
+  input.segment.clear();
+  input.has_next = false;
+  std::string line;
+  while (input.reader.getline(line)) {
+    if (parse_timestamp(line, input.next_timestamp)) {
+      input.has_next = true;
+      break;
+    }
+    input.segment += line;
+    input.segment += '\n';
+  }
+  return true;
+}
+
+struct segment_order {
+  const std::vector<merge_input *> *inputs;
+  // The priority queue puts the largest element first, so this orders
+  // later segments first. Ties go to the earlier input.
+  bool operator()(int a, int b) const {
+    uint64_t ta = (*inputs)[a]->timestamp;
+    uint64_t tb = (*inputs)[b]->timestamp;
+    return ta != tb ? ta > tb : a > b;
+  }
+};
+
+// Write size bytes of data to out. Returns false on errors.
+static bool write_output(gzFile out, const char *data, size_t size) {
+  if (size == 0 || gzwrite(out, data, size) == (int)size)
+    return true;
+  fprintf(stderr, "Failed to write the merged trace.\n");
+  return false;
+}
+
+// Merge the traces in names into out. The inputs are added to inputs as they
+// are opened, for the caller to free. Returns false on errors.
+static bool merge(gzFile out, char **names, int num_names,
+                  std::vector<merge_input *> &inputs) {
+  segment_order order = { &inputs };
+  std::priority_queue<int, std::vector<int>, segment_order> queue(order);
+  for (int i = 0; i < num_names; i++) {
+    merge_input *input = new merge_input();
+    inputs.push_back(input);
+    if (!input->reader.open(names[i])) {
+      fprintf(stderr, "Failed to open input trace %s.\n", names[i]);
+      return false;
+    }
+    std::string header;
+    if (!read_header(*input, names[i], header))
+      return false;
+    if (i == 0 && !write_output(out, header.data(), header.size()))
+      return false;
+    if (load_segment(*input))
+      queue.push(i);
+  }
+
+  while (!queue.empty()) {
+    int index = queue.top();
+    queue.pop();
+    merge_input *input = inputs[index];
+    char timestamp[64];
+    int length = snprintf(timestamp, sizeof(timestamp), "t,%" PRIu64 ",%d\n",
+                          input->timestamp, index);
+    if (!write_output(out, timestamp, length) ||
+        !write_output(out, input->segment.data(), input->segment.size()))
+      return false;
+    if (load_segment(*input))
+      queue.push(index);
+  }
+  return true;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 3) {
+    fprintf(stderr, "Usage: %s merged_trace.gz trace0.gz trace1.gz ...\n",
+            argv[0]);
+    return 1;
+  }
+  gzFile out = gzopen(argv[1], "w");
+  if (!out) {
+    perror("Failed to open output trace");
+    return 1;
+  }
+  std::vector<merge_input *> inputs;
+  bool ok = merge(out, argv + 2, argc - 2, inputs);
+  for (size_t i = 0; i < inputs.size(); i++)
+    delete inputs[i];
+  if (gzclose(out) != Z_OK && ok) {
+    fprintf(stderr, "Failed to write the merged trace.\n");
+    ok = false;
+  }
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,267 @@
+/* Benchmarks trace_reader against a naive text trace parser.
+ *
+ * The naive parser reads the trace line by line with gzgets and splits lines
+ * with strtok, the way trace consumers such as Aladdin have traditionally
+ * done it. Both parsers read every field of every record, including the
+ * labelmap, and parse parameter values as integers, pointers or doubles
+ * depending on their form. They must agree on the number of records and a
+ * checksum of all numbers, or the benchmark fails.
+ *
+ * To measure parsing rather than decompression, the trace is first
+ * decompressed into a temporary file (in $TMPDIR, or /tmp), which both
+ * parsers then read. Each parser reads it the given number of times (3 by
+ * default) and the fastest run is reported.
+ *
+ * Usage: trace-parse-bench dynamic_trace.gz [runs]
+ *
+ * For example, with a trace of playground/triad.c:
+ *
+ *   make trace-binary EXEC=triad TOP_LEVEL=triad SUFFIX=c
+ *   ./triad-instrumented
+ *   trace-parse-bench dynamic_trace.gz
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include <chrono>
+#include <string>
+
+#include "trace_input.h"
+#include "trace_reader.h"
+
+struct bench_result {
+  uint64_t records;
+  uint64_t labelmap_size;
+  // Sum of all numbers in the trace. Doubles are added as integers, so that
+  // any difference in how they are parsed changes the sum.
+  uint64_t checksum;
+};
+
+static uint64_t double_bits(double value) {
+  uint64_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  return bits;
+}
+
+// The runtime writes integers with %ld, pointers with %#llx and doubles with
+// a decimal point (see trace_text.h), so the form of a value tells its type.
+static uint64_t value_checksum(const char *value, size_t size) {
+  if (size > 1 && value[0] == '0' && value[1] == 'x')
+    return strtoull(value, NULL, 16);
+  if (memchr(value, '.', size))
+    return double_bits(strtod(value, NULL));
+  return strtoll(value, NULL, 10);
+}
+
+static uint64_t view_checksum(const trace_view &value) {
+  if (value.size > 1 && value.data[0] == '0' && value.data[1] == 'x')
+    return value.to_ptr();
+  if (memchr(value.data, '.', value.size))
+    return double_bits(value.to_double());
+  return value.to_int();
+}
+
+static bool naive_parse(const char *name, bench_result &result) {
+  gzFile file = gzopen(name, "r");
+  if (!file)
+    return false;
+  memset(&result, 0, sizeof(result));
+  static char line[1 << 16];
+  bool in_labelmap = false;
+  while (gzgets(file, line, sizeof(line))) {
+    if (strncmp(line, "%%%% LABEL MAP START", 20) == 0) {
+      in_labelmap = true;
+      continue;
+    }
+    if (in_labelmap) {
+      if (strncmp(line, "%%%% LABEL MAP END", 18) == 0)
+        in_labelmap = false;
+      else
+        result.labelmap_size += strlen(line);
+      continue;
+    }
+    char *kind = strtok(line, ",\n");
+    if (!kind)
+      continue;
+    result.records++;
+    if (strcmp(kind, "entry") == 0) {
+      strtok(NULL, ",\n");  // function
+      result.checksum += atoi(strtok(NULL, ",\n"));
+    } else if (strcmp(kind, "t") == 0) {
+      result.checksum += strtoull(strtok(NULL, ",\n"), NULL, 10);
+      if (char *input = strtok(NULL, ",\n"))
+        result.checksum += atoi(input);
+    } else if (strcmp(kind, "sampling") == 0 || strcmp(kind, "window") == 0 ||
+               strcmp(kind, "iteration") == 0 || strcmp(kind, "loop") == 0) {
+      for (char *field; (field = strtok(NULL, ",\n"));)
+        result.checksum += strtoull(field, NULL, 10);
+    } else if (strcmp(kind, "simpoint") == 0) {
+      result.checksum += strtoull(strtok(NULL, ",\n"), NULL, 10);
+      result.checksum += double_bits(strtod(strtok(NULL, ",\n"), NULL));
+    } else if (strcmp(kind, "0") == 0) {
+      result.checksum += atoi(strtok(NULL, ",\n"));  // line
+      strtok(NULL, ",\n");                           // function
+      strtok(NULL, ",\n");                           // basic block
+      strtok(NULL, ",\n");                           // instruction
+      result.checksum += atoi(strtok(NULL, ",\n"));  // opcode
+      result.checksum += strtoll(strtok(NULL, ",\n"), NULL, 10);
+    } else {
+      if (strcmp(kind, "r") != 0 && strcmp(kind, "f") != 0)
+        result.checksum += atoi(kind);
+      result.checksum += atoi(strtok(NULL, ",\n"));  // size
+      char *value = strtok(NULL, ",\n");
+      result.checksum += value_checksum(value, strlen(value));
+      result.checksum += atoi(strtok(NULL, ",\n"));  // is_reg
+      strtok(NULL, ",\n");                           // label
+      strtok(NULL, ",\n");                           // previous basic block
+    }
+  }
+  gzclose(file);
+  return true;
+}
+
+static bool reader_parse(const char *name, bench_result &result) {
+  trace_reader reader;
+  if (!reader.open(name))
+    return false;
+  memset(&result, 0, sizeof(result));
+  result.labelmap_size = reader.labelmap().size();
+  for (const trace_record &record : reader) {
+    result.records++;
+    switch (record.kind) {
+      case RECORD_ENTRY:
+        result.checksum += record.num_params;
+        break;
+      case RECORD_TIMESTAMP:
+        result.checksum += record.timestamp;
+        if (record.input >= 0)
+          result.checksum += record.input;
+        break;
+      case RECORD_INST:
+        result.checksum += record.line + record.opcode + record.inst_count;
+        break;
+      case RECORD_SAMPLING:
+        result.checksum += record.insts + record.logged_insts +
+                           record.invocations + record.logged_invocations +
+                           record.sample_period;
+        break;
+      case RECORD_WINDOW:
+        result.checksum += record.skipped_insts + record.warmup_insts;
+        break;
+      case RECORD_SIMPOINT:
+        result.checksum += record.interval + double_bits(record.weight);
+        break;
+      case RECORD_ITERATION:
+        result.checksum += record.iteration;
+        break;
+      case RECORD_LOOP:
+        result.checksum += record.executions + record.iterations +
+                           record.logged_iterations;
+        break;
+      default:
+        if (record.kind == RECORD_PARAM)
+          result.checksum += record.line;
+        result.checksum += record.size + view_checksum(record.value) +
+                           record.is_reg;
+        break;
+    }
+  }
+  if (reader.failed()) {
+    fprintf(stderr, "%s\n", reader.error().c_str());
+    return false;
+  }
+  return true;
+}
+
+// Decompress the trace into a temporary file. Returns its size, or -1.
+static long decompress(const char *name, char *tmp_name) {
+  trace_input in;
+  if (!in.open(name))
+    return -1;
+  int fd = mkstemp(tmp_name);
+  if (fd < 0)
+    return -1;
+  FILE *out = fdopen(fd, "w");
+  char buf[1 << 16];
+  long n, total = 0;
+  while ((n = in.read(buf, sizeof(buf))) > 0) {
+    if (fwrite(buf, 1, n, out) != (size_t)n)
+      n = -1;
+    if (n < 0)
+      break;
+    total += n;
+  }
+  if (fclose(out) != 0 || n < 0)
+    return -1;
+  return total;
+}
+
+typedef bool (*parse_fn)(const char *name, bench_result &result);
+
+static double best_time(parse_fn parse, const char *name, int runs,
+                        bench_result &result) {
+  double best = 0;
+  for (int i = 0; i < runs; i++) {
+    auto start = std::chrono::steady_clock::now();
+    if (!parse(name, result))
+      return -1;
+    std::chrono::duration<double> time =
+        std::chrono::steady_clock::now() - start;
+    if (i == 0 || time.count() < best)
+      best = time.count();
+  }
+  return best;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc != 2 && argc != 3) {
+    fprintf(stderr, "Usage: %s dynamic_trace.gz [runs]\n", argv[0]);
+    return 1;
+  }
+  int runs = argc == 3 ? atoi(argv[2]) : 3;
+  if (runs <= 0) {
+    fprintf(stderr, "Invalid number of runs \"%s\"!\n", argv[2]);
+    return 1;
+  }
+
+  const char *tmp_dir = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+  std::string tmp_name = std::string(tmp_dir) + "/trace-parse-bench.XXXXXX";
+  long size = decompress(argv[1], &tmp_name[0]);
+  if (size < 0) {
+    perror("Failed to decompress the trace");
+    return 1;
+  }
+
+  bench_result naive, fast;
+  double naive_time = best_time(naive_parse, tmp_name.c_str(), runs, naive);
+  double fast_time = best_time(reader_parse, tmp_name.c_str(), runs, fast);
+  unlink(tmp_name.c_str());
+  if (naive_time < 0 || fast_time < 0) {
+    fprintf(stderr, "Failed to parse the trace.\n");
+    return 1;
+  }
+  if (naive.records != fast.records || naive.checksum != fast.checksum ||
+      naive.labelmap_size != fast.labelmap_size) {
+    fprintf(stderr,
+            "The parsers disagree: %" PRIu64 " records, checksum %#" PRIx64
+            " (naive) vs. %" PRIu64 " records, checksum %#" PRIx64
+            " (trace_reader).\n",
+            naive.records, naive.checksum, fast.records, fast.checksum);
+    return 1;
+  }
+
+  double mb = size / 1e6;
+  printf("%.1f MB, %" PRIu64 " records, best of %d runs\n", mb, fast.records,
+         runs);
+  printf("getline/strtok: %8.3f s %8.1f MB/s\n", naive_time,
+         mb / naive_time);
+  printf("trace_reader:   %8.3f s %8.1f MB/s (%.2fx)\n", fast_time,
+         mb / fast_time, naive_time / fast_time);
+  return 0;
+}
@@ -0,0 +1,133 @@
+/* Extracts one top-level invocation from a trace using its index.
+ *
+ * The trace must have been written with LLVMTRACER_TRACE_INDEX set, so that
+ * it has an index named <trace>.idx next to it (see trace_index.h). Only the
+ * trace header and the chunks of the requested invocation are decompressed;
+ * everything else is skipped.
+ *
+ * Usage: trace-seek [-t thread] trace.gz output.gz invocation [inst]
+ *
+ * Invocations are numbered from 0 in each thread. If inst is given, the
+ * output starts at the chunk that holds that instruction of the invocation
+ * (by its inst_count) instead of at its entry, so it begins at most one chunk
+ * (LLVMTRACER_BUFFER_SIZE) before it, or at the next logged instruction if
+ * sampling skipped it. The thread defaults to the first one in the trace.
+ * The output is a gzipped trace in the same format (text or binary) as the
+ * input.
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#include <string>
+#include <vector>
+
+#include "trace_index_reader.h"
+
+static void usage(const char *name) {
+  fprintf(stderr,
+          "Usage: %s [-t thread] trace.gz output.gz invocation [inst]\n",
+          name);
+  exit(1);
+}
+
+static int64_t parse_number(const char *value, const char *name) {
+  char *end;
+  long long number = strtoll(value, &end, 10);
+  if (end == value || *end || number < 0) {
+    fprintf(stderr, "Invalid %s \"%s\".\n", name, value);
+    exit(1);
+  }
+  return number;
+}
+
+static void write_or_die(gzFile file, const std::string &data) {
+  if (data.size() && gzwrite(file, data.data(), data.size()) == 0) {
+    fprintf(stderr, "Failed to write output trace.\n");
+    exit(1);
+  }
+}
+
+int main(int argc, char *argv[]) {
+  int arg = 1;
+  bool has_thread = false;
+  uint32_t thread_id = 0;
+  if (arg + 1 < argc && strcmp(argv[arg], "-t") == 0) {
+    thread_id = parse_number(argv[arg + 1], "thread");
+    has_thread = true;
+    arg += 2;
+  }
+  if (argc - arg != 3 && argc - arg != 4)
+    usage(argv[0]);
+  const char *trace_name = argv[arg];
+  const char *output_name = argv[arg + 1];
+  int64_t invocation = parse_number(argv[arg + 2], "invocation");
+  int64_t inst = argc - arg == 4 ? parse_number(argv[arg + 3], "inst") : 0;
+
+  std::vector<trace_index_entry> entries;
+  std::string index_name = std::string(trace_name) + ".idx";
+  if (!read_trace_index(index_name.c_str(), entries)) {
+    fprintf(stderr, "Failed to read the trace index %s.\n",
+            index_name.c_str());
+    return 1;
+  }
+  if (!has_thread) {
+    for (size_t i = 0; i < entries.size(); i++) {
+      if (!(entries[i].flags & CHUNK_IS_HEADER)) {
+        thread_id = entries[i].thread_id;
+        break;
+      }
+    }
+  }
+  long first = find_trace_chunk(entries, thread_id, invocation, inst);
+  if (first < 0) {
+    fprintf(stderr, "Thread %u has no instruction %" PRId64
+            " in invocation %" PRId64 ".\n",
+            thread_id, inst, invocation);
+    return 1;
+  }
+
+  trace_input in;
+  if (!in.open(trace_name)) {
+    perror("Failed to open input trace");
+    return 1;
+  }
+  gzFile out = gzopen(output_name, "w");
+  if (!out) {
+    perror("Failed to open output trace");
+    return 1;
+  }
+  std::string data;
+  size_t num_chunks = 0;
+  for (size_t i = 0; i < entries.size(); i++) {
+    const trace_index_entry &entry = entries[i];
+    if (entry.flags & CHUNK_IS_HEADER) {
+      if (!read_indexed_chunk(in, entry, data)) {
+        fprintf(stderr, "Failed to read the trace header.\n");
+        return 1;
+      }
+      write_or_die(out, data);
+    }
+  }
+  for (size_t i = first; i < entries.size(); i++) {
+    const trace_index_entry &entry = entries[i];
+    if (entry.thread_id != thread_id || (entry.flags & CHUNK_IS_HEADER))
+      continue;
+    if (entry.invocation != invocation)
+      break;
+    if (!read_indexed_chunk(in, entry, data)) {
+      fprintf(stderr, "Failed to read input trace.\n");
+      return 1;
+    }
+    write_or_die(out, data);
+    num_chunks++;
+  }
+  gzclose(out);
+  printf("Extracted %zu chunks of invocation %" PRId64 " of thread %u.\n",
+         num_chunks, invocation, thread_id);
+  return 0;
+}
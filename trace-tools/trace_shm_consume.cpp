@@ -0,0 +1,116 @@
+/* Reference consumer of traces that the runtime streams to shared memory.
+ *
+ * Run the instrumented program with LLVMTRACER_TRACE_SINK=shm (or shm+file)
+ * and this tool at the same time, in either order:
+ *
+ *   LLVMTRACER_TRACE_SINK=shm ./triad-instrumented &
+ *   trace-shm-consume dynamic_trace.gz
+ *
+ * The trace is read chunk by chunk while the program writes it (see
+ * trace_shm.h). The tool counts the chunks, bytes and instructions of every
+ * thread and, for text traces, parses every chunk with trace_reader and
+ * counts its records. With -o, the trace is also written to a gzipped file,
+ * which then holds what the program would have written to its trace file.
+ *
+ * Usage: trace-shm-consume [-o output.gz] trace_name
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <zlib.h>
+
+#include <map>
+#include <string>
+
+#include "trace_format.h"
+#include "trace_input.h"
+#include "trace_reader.h"
+
+struct thread_stats {
+  uint64_t chunks;
+  uint64_t bytes;
+  uint64_t insts;
+  uint64_t records;
+};
+
+int main(int argc, char *argv[]) {
+  const char *output_name = nullptr;
+  int arg = 1;
+  if (argc == 4 && strcmp(argv[1], "-o") == 0) {
+    output_name = argv[2];
+    arg = 3;
+  }
+  if (arg != argc - 1) {
+    fprintf(stderr, "Usage: %s [-o output.gz] trace_name\n", argv[0]);
+    return 1;
+  }
+
+  gzFile out = nullptr;
+  if (output_name && !(out = gzopen(output_name, "wb"))) {
+    fprintf(stderr, "Failed to open %s.\n", output_name);
+    return 1;
+  }
+  trace_input in;
+  if (!in.open_shm(argv[arg])) {
+    fprintf(stderr, "Failed to attach to the trace ring of %s. Is another "
+                    "consumer attached?\n",
+            argv[arg]);
+    return 1;
+  }
+
+  std::map<uint32_t, thread_stats> threads;
+  std::string data;
+  trace_chunk_tag tag;
+  bool has_tag;
+  bool binary = false;
+  trace_reader reader;
+  int ret;
+  while ((ret = in.read_chunk(data, tag, has_tag)) > 0) {
+    if (out && gzwrite(out, data.data(), data.size()) != (int)data.size()) {
+      fprintf(stderr, "Failed to write %s.\n", output_name);
+      return 1;
+    }
+    if (tag.flags & CHUNK_IS_HEADER) {
+      binary = data.compare(0, TRACE_BINARY_MAGIC_SIZE,
+                            TRACE_BINARY_MAGIC) == 0;
+      continue;
+    }
+    thread_stats &stats = threads[tag.thread_id];
+    stats.chunks++;
+    stats.bytes += data.size();
+    stats.insts += tag.num_insts;
+    // Chunks start at a record boundary, so each can be parsed on its own.
+    if (binary)
+      continue;
+    if (!reader.open_buffer(data.data(), data.size())) {
+      fprintf(stderr, "%s\n", reader.error().c_str());
+      return 1;
+    }
+    trace_record record;
+    while (reader.next(record))
+      stats.records++;
+    if (reader.failed()) {
+      fprintf(stderr, "%s\n", reader.error().c_str());
+      return 1;
+    }
+  }
+  if (ret < 0) {
+    fprintf(stderr, "The trace ended early. Did the program crash?\n");
+    return 1;
+  }
+  if (out)
+    gzclose(out);
+
+  for (auto it = threads.begin(); it != threads.end(); ++it) {
+    const thread_stats &stats = it->second;
+    printf("Thread %u: %" PRIu64 " chunks, %.1f MB, %" PRIu64 " instructions",
+           it->first, stats.chunks, stats.bytes / 1e6, stats.insts);
+    if (binary)
+      printf("\n");
+    else
+      printf(", %" PRIu64 " records\n", stats.records);
+  }
+  return 0;
+}
@@ -0,0 +1,305 @@
+/* Picks the simpoints of a program from its basic block vectors.
+ *
+ * The first SimPoint pass (LLVMTRACER_BBV_INTERVAL without
+ * LLVMTRACER_SIMPOINTS) writes one basic block vector per interval of the
+ * program to <trace_name>.bbv. This tool clusters the intervals by those
+ * vectors the way SimPoint does: each vector is normalized, randomly
+ * projected down to a few dimensions and clustered with k-means for every k
+ * up to max_k, and the smallest k whose clustering scores close to the best
+ * by the Bayesian information criterion is kept. The interval closest to the
+ * center of each cluster is that cluster's simpoint, and its weight is the
+ * fraction of all intervals in the cluster.
+ *
+ * The simpoints are written to simpoints_file as "<interval> <weight>" lines,
+ * which the second pass reads from LLVMTRACER_SIMPOINTS to trace only those
+ * intervals. Intervals are numbered from 0. Everything is seeded, so the same
+ * vectors always give the same simpoints.
+ *
+ * Usage: trace-simpoint [-k max_k] bbv_file simpoints_file
+ */
+
+#include <inttypes.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <limits>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+
+// SimPoint's defaults.
+#define NUM_DIMENSIONS 15
+#define DEFAULT_MAX_K 10
+#define NUM_RESTARTS 5
+#define MAX_ITERATIONS 100
+// The smallest k whose score is within this fraction of the range of scores
+// from the best one is kept.
+#define BIC_THRESHOLD 0.9
+
+typedef std::vector<double> point;
+
+struct clustering {
+  std::vector<point> centers;
+  std::vector<int> assignment;
+  double distortion;
+};
+
+static void usage(const char *name) {
+  fprintf(stderr, "Usage: %s [-k max_k] bbv_file simpoints_file\n", name);
+  exit(1);
+}
+
+// A random number in [-1, 1] for each block and dimension. This is a hash
+// rather than a stored matrix, since block IDs are sparse.
+static double projection(uint64_t block, int dimension) {
+  uint64_t x = block * NUM_DIMENSIONS + dimension + 0x9e3779b97f4a7c15ull;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+  x ^= x >> 31;
+  return (x >> 11) * (2.0 / (1ull << 53)) - 1;
+}
+
+// Read the vectors of a .bbv file, in SimPoint's frequency vector format,
+// and project them down to NUM_DIMENSIONS.
+static bool read_bbv(const char *name, std::vector<point> &points) {
+  FILE *file = fopen(name, "r");
+  if (!file) {
+    perror(name);
+    return false;
+  }
+  std::vector<std::pair<uint64_t, uint64_t>> counts;
+  char *line = NULL;
+  size_t capacity = 0;
+  bool ok = true;
+  while (getline(&line, &capacity, file) > 0) {
+    if (line[0] != 'T')
+      continue;
+    counts.clear();
+    uint64_t total = 0;
+    char *p = line + 1;
+    while (*p == ':') {
+      char *end;
+      uint64_t block = strtoull(p + 1, &end, 10);
+      if (end == p + 1 || *end != ':') {
+        ok = false;
+        break;
+      }
+      p = end + 1;
+      uint64_t count = strtoull(p, &end, 10);
+      if (end == p) {
+        ok = false;
+        break;
+      }
+      counts.push_back(std::make_pair(block, count));
+      total += count;
+      for (p = end; *p == ' '; p++)
+        ;
+    }
+    if (!ok)
+      break;
+    // An interval that ran no instructions has nothing to normalize by. It
+    // stays at the origin rather than being dropped, so that the intervals
+    // after it keep their numbers.
+    point projected(NUM_DIMENSIONS, 0);
+    if (total == 0)
+      counts.clear();
+    for (const auto &count : counts) {
+      double frequency = (double)count.second / total;
+      for (int d = 0; d < NUM_DIMENSIONS; d++)
+        projected[d] += frequency * projection(count.first, d);
+    }
+    points.push_back(projected);
+  }
+  free(line);
+  fclose(file);
+  if (!ok)
+    fprintf(stderr, "Malformed basic block vector in %s.\n", name);
+  return ok;
+}
+
+static double distance2(const point &a, const point &b) {
+  double sum = 0;
+  for (int d = 0; d < NUM_DIMENSIONS; d++)
+    sum += (a[d] - b[d]) * (a[d] - b[d]);
+  return sum;
+}
+
+// One run of k-means, started with k-means++.
+static clustering kmeans(const std::vector<point> &points, int k,
+                         std::mt19937_64 &rng) {
+  size_t n = points.size();
+  clustering result;
+  std::vector<double> nearest(n, std::numeric_limits<double>::max());
+  result.centers.push_back(points[rng() % n]);
+  while ((int)result.centers.size() < k) {
+    double sum = 0;
+    for (size_t i = 0; i < n; i++) {
+      nearest[i] =
+          std::min(nearest[i], distance2(points[i], result.centers.back()));
+      sum += nearest[i];
+    }
+    // All points coincide with a center, so any will do.
+    if (sum == 0) {
+      result.centers.push_back(points[rng() % n]);
+      continue;
+    }
+    double target = std::uniform_real_distribution<double>(0, sum)(rng);
+    size_t i = 0;
+    for (; i < n - 1 && (target -= nearest[i]) > 0; i++)
+      ;
+    result.centers.push_back(points[i]);
+  }
+
+  result.assignment.assign(n, -1);
+  for (int iteration = 0; iteration < MAX_ITERATIONS; iteration++) {
+    bool changed = false;
+    for (size_t i = 0; i < n; i++) {
+      int best = 0;
+      double best_distance = distance2(points[i], result.centers[0]);
+      for (int c = 1; c < k; c++) {
+        double distance = distance2(points[i], result.centers[c]);
+        if (distance < best_distance) {
+          best = c;
+          best_distance = distance;
+        }
+      }
+      if (result.assignment[i] != best) {
+        result.assignment[i] = best;
+        changed = true;
+      }
+    }
+    if (!changed)
+      break;
+    std::vector<point> sums(k, point(NUM_DIMENSIONS, 0));
+    std::vector<size_t> sizes(k, 0);
+    for (size_t i = 0; i < n; i++) {
+      int c = result.assignment[i];
+      sizes[c]++;
+      for (int d = 0; d < NUM_DIMENSIONS; d++)
+        sums[c][d] += points[i][d];
+    }
+    // Empty clusters keep their center.
+    for (int c = 0; c < k; c++) {
+      if (!sizes[c])
+        continue;
+      for (int d = 0; d < NUM_DIMENSIONS; d++)
+        result.centers[c][d] = sums[c][d] / sizes[c];
+    }
+  }
+
+  result.distortion = 0;
+  for (size_t i = 0; i < n; i++) {
+    const point &center = result.centers[result.assignment[i]];
+    result.distortion += distance2(points[i], center);
+  }
+  return result;
+}
+
+// The Bayesian information criterion of a clustering, as X-means and
+// SimPoint compute it: the log-likelihood of the points under spherical
+// Gaussians around the centers, less a penalty for the number of parameters.
+static double bic(const clustering &result, size_t n) {
+  int k = result.centers.size();
+  double r = n;
+  double variance = n > (size_t)k ? result.distortion / (r - k) : 0;
+  variance = std::max(variance, 1e-12);
+  std::vector<size_t> sizes(k, 0);
+  for (int c : result.assignment)
+    sizes[c]++;
+  double likelihood = -r / 2 * log(2 * M_PI) -
+                      r * NUM_DIMENSIONS / 2 * log(variance) - (r - k) / 2 -
+                      r * log(r);
+  for (size_t size : sizes) {
+    if (size)
+      likelihood += size * log((double)size);
+  }
+  double parameters = (k - 1) + NUM_DIMENSIONS * k + 1;
+  return likelihood - parameters / 2 * log(r);
+}
+
+int main(int argc, char *argv[]) {
+  int max_k = DEFAULT_MAX_K;
+  int arg = 1;
+  if (argc == 5 && strcmp(argv[1], "-k") == 0) {
+    char *end;
+    max_k = strtol(argv[2], &end, 10);
+    if (end == argv[2] || *end || max_k < 1) {
+      fprintf(stderr, "Invalid max_k \"%s\".\n", argv[2]);
+      return 1;
+    }
+    arg = 3;
+  }
+  if (arg != argc - 2)
+    usage(argv[0]);
+
+  std::vector<point> points;
+  if (!read_bbv(argv[arg], points))
+    return 1;
+  if (points.empty()) {
+    fprintf(stderr, "%s has no basic block vectors.\n", argv[arg]);
+    return 1;
+  }
+  size_t n = points.size();
+  max_k = std::min<size_t>(max_k, n);
+
+  std::mt19937_64 rng(1);
+  std::vector<clustering> results;
+  std::vector<double> scores;
+  for (int k = 1; k <= max_k; k++) {
+    clustering best;
+    for (int restart = 0; restart < NUM_RESTARTS; restart++) {
+      clustering result = kmeans(points, k, rng);
+      if (restart == 0 || result.distortion < best.distortion)
+        best = result;
+    }
+    results.push_back(best);
+    scores.push_back(bic(best, n));
+  }
+  double min_score = *std::min_element(scores.begin(), scores.end());
+  double max_score = *std::max_element(scores.begin(), scores.end());
+  int chosen = 0;
+  while (scores[chosen] < min_score + BIC_THRESHOLD * (max_score - min_score))
+    chosen++;
+  const clustering &result = results[chosen];
+
+  // The simpoint of each cluster, and the number of intervals in it.
+  int k = chosen + 1;
+  std::vector<size_t> representatives(k, n);
+  std::vector<double> best_distance(k);
+  std::vector<size_t> sizes(k, 0);
+  for (size_t i = 0; i < n; i++) {
+    int c = result.assignment[i];
+    sizes[c]++;
+    double distance = distance2(points[i], result.centers[c]);
+    if (representatives[c] == n || distance < best_distance[c]) {
+      representatives[c] = i;
+      best_distance[c] = distance;
+    }
+  }
+  std::vector<std::pair<size_t, double>> simpoints;
+  for (int c = 0; c < k; c++) {
+    if (sizes[c])
+      simpoints.push_back(
+          std::make_pair(representatives[c], (double)sizes[c] / n));
+  }
+  std::sort(simpoints.begin(), simpoints.end());
+
+  FILE *out = fopen(argv[arg + 1], "w");
+  if (!out) {
+    perror(argv[arg + 1]);
+    return 1;
+  }
+  for (const auto &simpoint : simpoints)
+    fprintf(out, "%zu %.6f\n", simpoint.first, simpoint.second);
+  if (fclose(out) != 0) {
+    perror(argv[arg + 1]);
+    return 1;
+  }
+  printf("%zu intervals, %zu simpoints\n", n, simpoints.size());
+  return 0;
+}
@@ -0,0 +1,374 @@
+/* Converts a binary dynamic trace back to the text trace format.
+ *
+ * The output is byte-for-byte what the instrumented binary would have written
+ * had it been run without LLVMTRACER_TRACE_FORMAT=binary, so it can be fed to
+ * Aladdin directly. The input may be compressed with any of the runtime's
+ * codecs; the output is always gzipped.
+ *
+ * Usage: trace-to-text binary_trace.gz text_trace.gz
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <zlib.h>
+
+#include <string>
+#include <vector>
+
+#include "trace_format.h"
+#include "trace_input.h"
+#include "trace_text.h"
+
+#define RESULT_LINE 19134
+#define FORWARD_LINE 24601
+
+// Buffered reader over a compressed binary trace.
+class binary_reader {
+ public:
+  binary_reader(trace_input *_file)
+      : version(0), file(_file), pos(0), end(0) {}
+
+  // Returns false at the end of the trace.
+  bool at_end() {
+    if (pos < end)
+      return false;
+    refill();
+    return pos == end;
+  }
+
+  void read(void *dst, size_t size) {
+    char *out = reinterpret_cast<char *>(dst);
+    while (size > 0) {
+      if (at_end()) {
+        fprintf(stderr, "Unexpected end of binary trace.\n");
+        exit(1);
+      }
+      size_t n = end - pos < size ? end - pos : size;
+      memcpy(out, &buf[pos], n);
+      pos += n;
+      out += n;
+      size -= n;
+    }
+  }
+
+  template <typename T> T read_field() {
+    T value;
+    read(&value, sizeof(T));
+    return value;
+  }
+
+  void read_string(std::string &str) {
+    uint32_t len = read_field<uint32_t>();
+    str.resize(len);
+    if (len)
+      read(&str[0], len);
+  }
+
+  // Read a name, which is stored inline in version 1 traces and as an index
+  // into the string table afterwards.
+  void read_name(std::string &str) {
+    if (version < 2) {
+      read_string(str);
+      return;
+    }
+    uint32_t id = read_field<uint32_t>();
+    if (id >= strings.size()) {
+      fprintf(stderr, "String ID %u is not in the string table.\n", id);
+      exit(1);
+    }
+    str = strings[id];
+  }
+
+  uint32_t version;
+  std::vector<std::string> strings;
+  trace_static_table static_table;
+
+ private:
+  void refill() {
+    long n = file->read(buf, sizeof(buf));
+    if (n < 0) {
+      fprintf(stderr, "Failed to read binary trace.\n");
+      exit(1);
+    }
+    pos = 0;
+    end = n;
+  }
+
+  trace_input *file;
+  char buf[1 << 20];
+  size_t pos;
+  size_t end;
+};
+
+void convert_bytes_to_hex(std::string &out, const std::string &bytes) {
+  out.resize(TRACE_VECTOR_TEXT_SIZE(bytes.size() * 8));
+  char *end = trace_format_vector(&out[0], (const uint8_t *)bytes.data(),
+                                  bytes.size());
+  out.resize(end - &out[0]);
+}
+
+// Format an int, ptr or double parameter value the way the text trace does.
+void format_value(std::string &out, uint8_t kind, uint64_t bits) {
+  char buf[TRACE_VALUE_TEXT_SIZE];
+  switch (kind) {
+    case TRACE_REC_INT:
+      trace_format_int(buf, bits);
+      break;
+    case TRACE_REC_PTR:
+      trace_format_ptr(buf, bits);
+      break;
+    case TRACE_REC_DOUBLE: {
+      double value;
+      memcpy(&value, &bits, sizeof(value));
+      trace_format_double(buf, value);
+      break;
+    }
+  }
+  out = buf;
+}
+
+void write_param(gzFile out, int line, int size, const std::string &value_str,
+                 bool is_reg, const std::string &label, bool is_phi,
+                 const std::string &prev_bbid) {
+  if (line == RESULT_LINE)
+    gzprintf(out, "r,%d,", size);
+  else if (line == FORWARD_LINE)
+    gzprintf(out, "f,%d,", size);
+  else
+    gzprintf(out, "%d,%d,", line, size);
+  gzwrite(out, value_str.data(), value_str.size());
+  gzprintf(out, ",%d", is_reg);
+  if (is_reg)
+    gzprintf(out, ",%s", label.c_str());
+  else
+    gzprintf(out, ", ");
+  if (is_phi)
+    gzprintf(out, ",%s,\n", prev_bbid.c_str());
+  else
+    gzprintf(out, ",\n");
+}
+
+void convert_param(binary_reader &in, gzFile out, uint8_t tag) {
+  int line = in.read_field<int32_t>();
+  int size = in.read_field<int32_t>();
+  std::string value_str;
+  switch (tag) {
+    case TRACE_REC_INT:
+    case TRACE_REC_PTR:
+    case TRACE_REC_DOUBLE:
+      format_value(value_str, tag, in.read_field<uint64_t>());
+      break;
+    case TRACE_REC_STRING:
+      in.read_name(value_str);
+      break;
+    case TRACE_REC_VECTOR: {
+      std::string bytes(size / 8, '\0');
+      if (size / 8)
+        in.read(&bytes[0], size / 8);
+      convert_bytes_to_hex(value_str, bytes);
+      break;
+    }
+  }
+  uint8_t flags = in.read_field<uint8_t>();
+  std::string label, prev_bbid;
+  if (flags & PARAM_IS_REG)
+    in.read_name(label);
+  if (flags & PARAM_IS_PHI)
+    in.read_name(prev_bbid);
+  write_param(out, line, size, value_str, flags & PARAM_IS_REG, label,
+              flags & PARAM_IS_PHI, prev_bbid);
+}
+
+void read_static_table(binary_reader &in) {
+  uint32_t string_base = in.read_field<uint32_t>();
+  uint32_t record_base = in.read_field<uint32_t>();
+  std::string table(in.read_field<uint32_t>(), '\0');
+  if (table.size())
+    in.read(&table[0], table.size());
+  if (record_base != in.static_table.records.size() ||
+      !parse_static_table(reinterpret_cast<const uint8_t *>(table.data()),
+                          table.size(), string_base, in.static_table)) {
+    fprintf(stderr, "Malformed static record table.\n");
+    exit(1);
+  }
+}
+
+// Expand a static record using the static record tables from the header.
+void convert_static(binary_reader &in, gzFile out) {
+  uint32_t record_id = in.read_field<uint32_t>();
+  if (record_id >= in.static_table.records.size()) {
+    fprintf(stderr, "Static record %u is not in the static table.\n",
+            record_id);
+    exit(1);
+  }
+  const trace_static_record &record = in.static_table.records[record_id];
+  if (record.kind == STATIC_INST) {
+    int64_t inst_count = in.read_field<int64_t>();
+    gzprintf(out, "\n0,%d,%s,%s,%s,%d,%" PRId64 "\n", record.line,
+             in.strings.at(record.func).c_str(),
+             in.strings.at(record.bb).c_str(),
+             in.strings.at(record.inst).c_str(), record.opcode, inst_count);
+  }
+  std::string value_str;
+  for (uint16_t i = 0; i < record.num_params; i++) {
+    const trace_static_param &param =
+        in.static_table.params[record.first_param + i];
+    bool is_dynamic = param.flags & PARAM_IS_DYNAMIC;
+    if (param.kind == TRACE_REC_VECTOR) {
+      std::string bytes(param.size / 8, '\0');
+      if (bytes.size())
+        in.read(&bytes[0], bytes.size());
+      convert_bytes_to_hex(value_str, bytes);
+    } else if (param.kind == TRACE_REC_STRING) {
+      value_str = in.strings.at(param.value);
+    } else {
+      uint64_t bits = is_dynamic ? in.read_field<uint64_t>() : param.value;
+      format_value(value_str, param.kind, bits);
+    }
+    bool is_reg = param.flags & PARAM_IS_REG;
+    bool is_phi = param.flags & PARAM_IS_PHI;
+    write_param(out, param.line, param.size, value_str, is_reg,
+                is_reg ? in.strings.at(param.label) : "", is_phi,
+                is_phi ? in.strings.at(param.prev_bbid) : "");
+  }
+}
+
+void convert_header(binary_reader &in, gzFile out) {
+  char magic[TRACE_BINARY_MAGIC_SIZE];
+  in.read(magic, sizeof(magic));
+  if (memcmp(magic, TRACE_BINARY_MAGIC, TRACE_BINARY_MAGIC_SIZE) != 0) {
+    fprintf(stderr, "Input is not a binary LLVM-Tracer trace.\n");
+    exit(1);
+  }
+  in.version = in.read_field<uint32_t>();
+  if (in.version < 1 || in.version > TRACE_BINARY_VERSION) {
+    fprintf(stderr, "Unsupported binary trace version %u.\n", in.version);
+    exit(1);
+  }
+  if (in.read_field<uint8_t>() != TRACE_REC_LABELMAP) {
+    fprintf(stderr, "Binary trace is missing its labelmap.\n");
+    exit(1);
+  }
+  std::string labelmap;
+  in.read_string(labelmap);
+  const char *section_header = "%%%% LABEL MAP START %%%%\n";
+  const char *section_footer = "%%%% LABEL MAP END %%%%\n\n";
+  gzwrite(out, section_header, strlen(section_header));
+  gzwrite(out, labelmap.data(), labelmap.size());
+  gzwrite(out, section_footer, strlen(section_footer));
+
+  if (in.version < 2)
+    return;
+  if (in.read_field<uint8_t>() != TRACE_REC_STRING_TABLE) {
+    fprintf(stderr, "Binary trace is missing its string table.\n");
+    exit(1);
+  }
+  in.strings.resize(in.read_field<uint32_t>());
+  for (size_t i = 0; i < in.strings.size(); i++)
+    in.read_string(in.strings[i]);
+}
+
+int main(int argc, char *argv[]) {
+  if (argc != 3) {
+    fprintf(stderr, "Usage: %s binary_trace.gz text_trace.gz\n", argv[0]);
+    return 1;
+  }
+  trace_input in_file;
+  if (!in_file.open(argv[1])) {
+    perror("Failed to open input trace");
+    return 1;
+  }
+  gzFile out = gzopen(argv[2], "w");
+  if (!out) {
+    perror("Failed to open output trace");
+    return 1;
+  }
+
+  binary_reader *in = new binary_reader(&in_file);
+  convert_header(*in, out);
+
+  std::string func_name, bbid, instid;
+  while (!in->at_end()) {
+    uint8_t tag = in->read_field<uint8_t>();
+    switch (tag) {
+      case TRACE_REC_ENTRY: {
+        in->read_name(func_name);
+        int num_parameters = in->read_field<int32_t>();
+        gzprintf(out, "\nentry,%s,%d,\n", func_name.c_str(), num_parameters);
+        break;
+      }
+      case TRACE_REC_INST: {
+        int line_number = in->read_field<int32_t>();
+        in->read_name(func_name);
+        in->read_name(bbid);
+        in->read_name(instid);
+        int opcode = in->read_field<int32_t>();
+        int64_t inst_count = in->read_field<int64_t>();
+        gzprintf(out, "\n0,%d,%s,%s,%s,%d,%" PRId64 "\n", line_number,
+                 func_name.c_str(), bbid.c_str(), instid.c_str(), opcode,
+                 inst_count);
+        break;
+      }
+      case TRACE_REC_INT:
+      case TRACE_REC_PTR:
+      case TRACE_REC_DOUBLE:
+      case TRACE_REC_STRING:
+      case TRACE_REC_VECTOR:
+        convert_param(*in, out, tag);
+        break;
+      case TRACE_REC_STATIC_TABLE:
+        read_static_table(*in);
+        break;
+      case TRACE_REC_STATIC:
+        convert_static(*in, out);
+        break;
+      case TRACE_REC_TIMESTAMP:
+        gzprintf(out, "\nt,%" PRIu64 "\n", in->read_field<uint64_t>());
+        break;
+      case TRACE_REC_SAMPLING: {
+        uint64_t fields[5];
+        for (int i = 0; i < 5; i++)
+          fields[i] = in->read_field<uint64_t>();
+        gzprintf(out, "\nsampling,%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64
+                 ",%" PRIu64 "\n",
+                 fields[0], fields[1], fields[2], fields[3], fields[4]);
+        break;
+      }
+      case TRACE_REC_WINDOW: {
+        uint64_t skipped = in->read_field<uint64_t>();
+        gzprintf(out, "\nwindow,%" PRIu64 ",%" PRIu64 "\n", skipped,
+                 in->read_field<uint64_t>());
+        break;
+      }
+      case TRACE_REC_SIMPOINT: {
+        uint64_t interval = in->read_field<uint64_t>();
+        char buf[TRACE_VALUE_TEXT_SIZE];
+        trace_format_double(buf, in->read_field<double>());
+        gzprintf(out, "\nsimpoint,%" PRIu64 ",%s\n", interval, buf);
+        break;
+      }
+      case TRACE_REC_ITERATION:
+        gzprintf(out, "\niteration,%" PRIu64 "\n", in->read_field<uint64_t>());
+        break;
+      case TRACE_REC_LOOP: {
+        uint64_t fields[3];
+        for (int i = 0; i < 3; i++)
+          fields[i] = in->read_field<uint64_t>();
+        gzprintf(out, "\nloop,%" PRIu64 ",%" PRIu64 ",%" PRIu64 "\n",
+                 fields[0], fields[1], fields[2]);
+        break;
+      }
+      default:
+        fprintf(stderr, "Unknown record tag %d in binary trace.\n", tag);
+        return 1;
+    }
+  }
+
+  delete in;
+  in_file.close();
+  gzclose(out);
+  return 0;
+}
@@ -0,0 +1,1076 @@
+/* Converts text traces to another format, codec or chunk size.
+ *
+ * This re-encodes existing traces the way the runtime would have written
+ * them with the corresponding LLVMTRACER_* settings, without running the
+ * instrumented binary again. The input is a text trace in any codec, either
+ * a legacy single-stream dynamic_trace.gz or a chunked one. The output is
+ * split into chunks at record boundaries, and every chunk is tagged with its
+ * context (see trace_codec.h), so it can be read in parallel and indexed.
+ *
+ * The input is decompressed and split into chunks on the main thread. A pool
+ * of threads then parses each chunk, re-encodes it in the output format and
+ * compresses it. Frames are written in order. The labelmap is preserved, and
+ * every chunk must parse into as many records as the splitter counted in it.
+ * Finally, the output is read back and must hold the same labelmap and number
+ * of records as the input.
+ *
+ * Usage: trace-transcode [options] input_trace output_trace
+ *
+ *   -f text|binary       Output format (default: text).
+ *   -c codec[:level]     Output codec, as in LLVMTRACER_COMPRESSION (default:
+ *                        zlib).
+ *   -b size              Chunk size in bytes, with an optional K, M or G
+ *                        suffix, as in LLVMTRACER_BUFFER_SIZE (default: 4M).
+ *   -j threads           Number of threads (default: the number of CPUs).
+ *   -i                   Also write an index, output_trace.idx, as with
+ *                        LLVMTRACER_TRACE_INDEX. Every top-level invocation
+ *                        then starts on a new chunk.
+ *
+ * Binary output is written to output_trace.tmp first, since its header holds
+ * the string table, which is only complete once every chunk is encoded.
+ *
+ * Traces written by several threads under the same name must be split with
+ * trace-demux first. Binary traces must be converted with trace-to-text.
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "trace_codec.h"
+#include "trace_format.h"
+#include "trace_index.h"
+#include "trace_input.h"
+#include "trace_reader.h"
+#include "trace_text.h"
+
+#define RESULT_LINE 19134
+#define FORWARD_LINE 24601
+#define LABELMAP_START "%%%% LABEL MAP START %%%%"
+#define LABELMAP_END "%%%% LABEL MAP END %%%%"
+
+struct transcode_options {
+  trace_format format;
+  const trace_codec *codec;
+  int level;
+  size_t chunk_size;
+  int num_threads;
+  bool index;
+};
+
+static void usage(const char *name) {
+  fprintf(stderr,
+          "Usage: %s [-f text|binary] [-c codec[:level]] [-b size] "
+          "[-j threads] [-i] input_trace output_trace\n",
+          name);
+  exit(1);
+}
+
+// Parse a size in bytes, with an optional K, M or G suffix.
+static size_t parse_size(const char *value) {
+  char *end;
+  unsigned long long size = strtoull(value, &end, 10);
+  switch (*end) {
+    case 'G': case 'g':
+      size <<= 10;
+      // Fall through.
+    case 'M': case 'm':
+      size <<= 10;
+      // Fall through.
+    case 'K': case 'k':
+      size <<= 10;
+      end++;
+  }
+  if (end == value || *end || size == 0) {
+    fprintf(stderr, "Invalid chunk size \"%s\".\n", value);
+    exit(1);
+  }
+  return size;
+}
+
+// Parse a codec name optionally followed by a colon and a level.
+static void parse_compression(const char *value, transcode_options &options) {
+  std::string name(value);
+  const char *level = nullptr;
+  size_t colon = name.find(':');
+  if (colon != std::string::npos) {
+    level = value + colon + 1;
+    name.resize(colon);
+  }
+  options.codec = find_trace_codec(name.c_str());
+  if (!options.codec) {
+    fprintf(stderr, "Unknown or unsupported compression \"%s\".\n",
+            name.c_str());
+    exit(1);
+  }
+  options.level = options.codec->default_level;
+  if (!level)
+    return;
+  char *end;
+  options.level = strtol(level, &end, 10);
+  if (end == level || *end || options.level < options.codec->min_level ||
+      options.level > options.codec->max_level) {
+    fprintf(stderr, "Invalid %s compression level \"%s\" (must be %d-%d).\n",
+            options.codec->name, level, options.codec->min_level,
+            options.codec->max_level);
+    exit(1);
+  }
+}
+
+// Strings of a binary output trace, shared by all threads.
+class string_table {
+ public:
+  uint32_t intern(const std::string &str) {
+    std::lock_guard<std::mutex> guard(lock);
+    auto it = ids.find(str);
+    if (it != ids.end())
+      return it->second;
+    uint32_t id = strings.size();
+    ids[str] = id;
+    strings.push_back(str);
+    return id;
+  }
+
+  // Only called once all threads are done.
+  const std::vector<std::string> &all() const { return strings; }
+
+ private:
+  std::mutex lock;
+  std::unordered_map<std::string, uint32_t> ids;
+  std::vector<std::string> strings;
+};
+
+template <typename T>
+static inline void append_field(std::string &buf, T value) {
+  buf.append(reinterpret_cast<const char *>(&value), sizeof(T));
+}
+
+static void append_string(std::string &buf, const std::string &str) {
+  append_field<uint32_t>(buf, str.size());
+  buf += str;
+}
+
+// Re-encodes text records as binary records. Each thread has its own, which
+// caches the IDs of the strings it has seen.
+class binary_encoder {
+ public:
+  binary_encoder(string_table *_table) : table(_table) {}
+
+  // Append record to out. Returns false if it has no binary encoding.
+  bool encode(const trace_record &record, std::string &out) {
+    switch (record.kind) {
+      case RECORD_ENTRY:
+        append_field<uint8_t>(out, TRACE_REC_ENTRY);
+        append_field<uint32_t>(out, intern(record.function));
+        append_field<int32_t>(out, record.num_params);
+        return true;
+      case RECORD_INST:
+        append_field<uint8_t>(out, TRACE_REC_INST);
+        append_field<int32_t>(out, record.line);
+        append_field<uint32_t>(out, intern(record.function));
+        append_field<uint32_t>(out, intern(record.basic_block));
+        append_field<uint32_t>(out, intern(record.inst));
+        append_field<int32_t>(out, record.opcode);
+        append_field<int64_t>(out, record.inst_count);
+        return true;
+      case RECORD_TIMESTAMP:
+        // Merged traces record their inputs, which binary traces cannot.
+        if (record.input >= 0)
+          return false;
+        append_field<uint8_t>(out, TRACE_REC_TIMESTAMP);
+        append_field<uint64_t>(out, record.timestamp);
+        return true;
+      case RECORD_SAMPLING:
+        append_field<uint8_t>(out, TRACE_REC_SAMPLING);
+        append_field<uint64_t>(out, record.insts);
+        append_field<uint64_t>(out, record.logged_insts);
+        append_field<uint64_t>(out, record.invocations);
+        append_field<uint64_t>(out, record.logged_invocations);
+        append_field<uint64_t>(out, record.sample_period);
+        return true;
+      case RECORD_WINDOW:
+        append_field<uint8_t>(out, TRACE_REC_WINDOW);
+        append_field<uint64_t>(out, record.skipped_insts);
+        append_field<uint64_t>(out, record.warmup_insts);
+        return true;
+      case RECORD_SIMPOINT:
+        append_field<uint8_t>(out, TRACE_REC_SIMPOINT);
+        append_field<uint64_t>(out, record.interval);
+        append_field<double>(out, record.weight);
+        return true;
+      case RECORD_ITERATION:
+        append_field<uint8_t>(out, TRACE_REC_ITERATION);
+        append_field<uint64_t>(out, record.iteration);
+        return true;
+      case RECORD_LOOP:
+        append_field<uint8_t>(out, TRACE_REC_LOOP);
+        append_field<uint64_t>(out, record.executions);
+        append_field<uint64_t>(out, record.iterations);
+        append_field<uint64_t>(out, record.logged_iterations);
+        return true;
+      default:
+        encode_param(record, out);
+        return true;
+    }
+  }
+
+ private:
+  uint32_t intern(const trace_view &view) {
+    name.assign(view.data, view.size);
+    auto it = cache.find(name);
+    if (it != cache.end())
+      return it->second;
+    uint32_t id = table->intern(name);
+    cache[name] = id;
+    return id;
+  }
+
+  // Text traces do not say what type a value has, so it is inferred from how
+  // it is written. Whatever type is chosen, converting the value back to
+  // text must give exactly the same string, or it is stored as a string.
+  void encode_param(const trace_record &record, std::string &out) {
+    const trace_view &value = record.value;
+    char buf[TRACE_VALUE_TEXT_SIZE];
+    uint8_t tag = TRACE_REC_STRING;
+    uint64_t bits = 0;
+    if (value.size < sizeof(buf)) {
+      if (value.size > 2 && value.data[0] == '0' && value.data[1] == 'x') {
+        bits = value.to_ptr();
+        trace_format_ptr(buf, bits);
+        if (value == buf)
+          tag = TRACE_REC_PTR;
+      } else if (memchr(value.data, '.', value.size)) {
+        double number = value.to_double();
+        trace_format_double(buf, number);
+        memcpy(&bits, &number, sizeof(bits));
+        if (value == buf)
+          tag = TRACE_REC_DOUBLE;
+      } else {
+        bits = value.to_int();
+        trace_format_int(buf, bits);
+        if (value == buf)
+          tag = TRACE_REC_INT;
+      }
+    }
+    if (tag == TRACE_REC_STRING && is_vector(record))
+      tag = TRACE_REC_VECTOR;
+
+    append_field<uint8_t>(out, tag);
+    int line = record.kind == RECORD_RESULT    ? RESULT_LINE
+               : record.kind == RECORD_FORWARD ? FORWARD_LINE
+                                               : record.line;
+    append_field<int32_t>(out, line);
+    append_field<int32_t>(out, record.size);
+    switch (tag) {
+      case TRACE_REC_STRING:
+        append_field<uint32_t>(out, intern(value));
+        break;
+      case TRACE_REC_VECTOR:
+        for (size_t i = 2; i < value.size; i += 2)
+          out += (char)(hex_digit(value.data[i]) << 4 |
+                        hex_digit(value.data[i + 1]));
+        break;
+      default:
+        append_field<uint64_t>(out, bits);
+        break;
+    }
+    append_field<uint8_t>(out, (record.is_reg ? PARAM_IS_REG : 0) |
+                                   (record.is_phi ? PARAM_IS_PHI : 0));
+    if (record.is_reg)
+      append_field<uint32_t>(out, intern(record.label));
+    if (record.is_phi)
+      append_field<uint32_t>(out, intern(record.prev_bb));
+  }
+
+  // Vectors are written as "0x" followed by two lowercase hex digits for
+  // each of their size / 8 bytes.
+  static bool is_vector(const trace_record &record) {
+    const trace_view &value = record.value;
+    if (record.size <= 0 || record.size % 8 ||
+        value.size != 2 + (size_t)record.size / 4 || value.data[0] != '0' ||
+        value.data[1] != 'x')
+      return false;
+    for (size_t i = 2; i < value.size; i++) {
+      char c = value.data[i];
+      if (!((c >= '0' && c <= '9') || (c >= 'a' && c <= 'f')))
+        return false;
+    }
+    return true;
+  }
+
+  static int hex_digit(char c) { return c <= '9' ? c - '0' : c - 'a' + 10; }
+
+  string_table *table;
+  std::unordered_map<std::string, uint32_t> cache;
+  std::string name;
+};
+
+// A chunk of the output, from the time it is split off the input until its
+// frame is written.
+struct transcode_job {
+  uint64_t position;
+  std::string data;
+  trace_chunk_tag tag;
+  // Number of records the splitter found in the chunk.
+  uint64_t num_records;
+  trace_index_entry entry;
+};
+
+// Parses, re-encodes and compresses chunks on a pool of threads, and writes
+// the frames in order.
+class transcoder {
+ public:
+  transcoder(const transcode_options &_options, FILE *_out, FILE *_index)
+      : options(_options), out(_out), index(_index), encoded_records(0),
+        offset(0), next_frame(0), stopping(false), failed(false) {}
+
+  void start() {
+    for (int i = 0; i < options.num_threads; i++)
+      threads.push_back(std::thread(&transcoder::worker_main, this));
+  }
+
+  // Queue a chunk. Blocks while too many chunks are waiting, so that memory
+  // use does not depend on the size of the trace.
+  void submit(transcode_job *job) {
+    std::unique_lock<std::mutex> guard(lock);
+    size_t max_jobs = 2 * options.num_threads;
+    job_done.wait(guard,
+                  [&] { return queue.size() + pending.size() < max_jobs; });
+    queue.push_back(job);
+    job_ready.notify_one();
+  }
+
+  // Wait for every queued chunk to be written. Returns false on errors.
+  bool finish() {
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      stopping = true;
+    }
+    job_ready.notify_all();
+    for (size_t i = 0; i < threads.size(); i++)
+      threads[i].join();
+    return !failed;
+  }
+
+  const std::string &error() const { return error_str; }
+  uint64_t num_encoded_records() const { return encoded_records; }
+  uint64_t output_size() const { return offset; }
+  string_table strings;
+
+ private:
+  void worker_main() {
+    binary_encoder encoder(&strings);
+    std::string encoded, frame;
+    while (true) {
+      transcode_job *job;
+      {
+        std::unique_lock<std::mutex> guard(lock);
+        job_ready.wait(guard, [&] { return !queue.empty() || stopping; });
+        if (queue.empty())
+          return;
+        job = queue.front();
+        queue.pop_front();
+      }
+      std::string error;
+      uint64_t records = encode(*job, encoder, encoded, error);
+      if (error.empty() && records != job->num_records)
+        error = "Chunk " + std::to_string(job->position) + " holds " +
+                std::to_string(job->num_records) + " records, but " +
+                std::to_string(records) + " were encoded.";
+      const std::string &data =
+          options.format == TRACE_FORMAT_BINARY ? encoded : job->data;
+      options.codec->compress(data.data(), data.size(), options.level,
+                              job->tag, frame);
+      write_frame(job, frame, records, error);
+    }
+  }
+
+  // Parse the chunk, and re-encode it into encoded for binary output.
+  // Returns the number of records in it.
+  uint64_t encode(const transcode_job &job, binary_encoder &encoder,
+                  std::string &encoded, std::string &error) {
+    encoded.clear();
+    trace_reader reader;
+    // Only the header chunk holds the labelmap.
+    bool is_header = job.tag.flags & CHUNK_IS_HEADER;
+    if (!reader.open_buffer(job.data.data(), job.data.size()) ||
+        reader.has_labelmap() != is_header) {
+      error = "Failed to parse chunk " + std::to_string(job.position) + ".";
+      return 0;
+    }
+    trace_record record;
+    while (reader.next(record)) {
+      if (options.format == TRACE_FORMAT_BINARY &&
+          !encoder.encode(record, encoded)) {
+        error = "Merged traces cannot be converted to binary.";
+        return 0;
+      }
+    }
+    if (reader.failed())
+      error = "Chunk " + std::to_string(job.position) + ": " + reader.error();
+    return reader.num_records();
+  }
+
+  // Write the frame of job, along with any later frames that were waiting
+  // for it.
+  void write_frame(transcode_job *job, std::string &frame, uint64_t records,
+                   const std::string &error) {
+    std::lock_guard<std::mutex> guard(lock);
+    if (!error.empty() && !failed) {
+      failed = true;
+      error_str = error;
+    }
+    encoded_records += records;
+    job->data.swap(frame);
+    pending[job->position] = job;
+    auto it = pending.begin();
+    while (it != pending.end() && it->first == next_frame) {
+      transcode_job *ready = it->second;
+      const std::string &data = ready->data;
+      if (fwrite(data.data(), 1, data.size(), out) != data.size() &&
+          !failed) {
+        failed = true;
+        error_str = "Failed to write the output trace.";
+      }
+      if (index) {
+        uint8_t buf[TRACE_INDEX_ENTRY_SIZE];
+        ready->entry.offset = offset;
+        ready->entry.size = data.size();
+        encode_index_entry(ready->entry, buf);
+        if (fwrite(buf, 1, sizeof(buf), index) != sizeof(buf) && !failed) {
+          failed = true;
+          error_str = "Failed to write the index.";
+        }
+      }
+      offset += data.size();
+      next_frame++;
+      delete ready;
+      it = pending.erase(it);
+    }
+    job_done.notify_all();
+  }
+
+  const transcode_options &options;
+  FILE *out;
+  FILE *index;
+  std::vector<std::thread> threads;
+  // Protects everything below.
+  std::mutex lock;
+  std::condition_variable job_ready;
+  std::condition_variable job_done;
+  std::deque<transcode_job *> queue;
+  // Encoded frames waiting for earlier frames to be written.
+  std::map<uint64_t, transcode_job *> pending;
+  uint64_t encoded_records;
+  uint64_t offset;
+  uint64_t next_frame;
+  bool stopping;
+  bool failed;
+  std::string error_str;
+};
+
+// Splits a decompressed text trace into chunks at record boundaries, and
+// keeps track of the context of each chunk the way the runtime does.
+class trace_splitter {
+ public:
+  trace_splitter(trace_input *_in, const transcode_options &_options)
+      : in(_in), options(_options), scan(0), at_eof(false), records(0),
+        insts(0), last_inst(std::string::npos), timestamps(0),
+        group_start(std::string::npos), total_records(0) {
+    state.insts_before = 0;
+    state.invocation = -1;
+    state.inst_count = 0;
+    context = state;
+  }
+
+  // Read the labelmap section, including the blank line after it, into
+  // header. Returns false on errors.
+  bool read_header(std::string &header, std::string &labelmap) {
+    size_t line, end;
+    if (!next_line(line, end))
+      return !failed();
+    if (data.compare(0, TRACE_BINARY_MAGIC_SIZE, TRACE_BINARY_MAGIC) == 0) {
+      error_str = "This is a binary trace. Convert it with trace-to-text.";
+      return false;
+    }
+    if (data.compare(line, end - line, LABELMAP_START) != 0) {
+      scan = 0;
+      return true;
+    }
+    while (next_line(line, end)) {
+      if (data.compare(line, end - line, LABELMAP_END) == 0) {
+        // The runtime writes a blank line after the labelmap.
+        size_t header_end = scan;
+        if (next_line(line, end) && line == end)
+          header_end = scan;
+        header = data.substr(0, header_end);
+        data.erase(0, header_end);
+        scan = 0;
+        return true;
+      }
+      labelmap.append(data, line, end - line);
+      labelmap += '\n';
+    }
+    error_str = "The labelmap is not terminated.";
+    return false;
+  }
+
+  // Split off the next chunk into job. Returns false at the end of the
+  // trace or on errors.
+  bool next_chunk(transcode_job &job) {
+    size_t line, end;
+    while (next_line(line, end)) {
+      // Chunks are cut before instructions and entries, along with the blank
+      // lines and timestamps that precede them.
+      if (group_start == std::string::npos)
+        group_start = line;
+      if (line == end)
+        continue;
+      char kind = data[line];
+      bool is_entry = kind == 'e';
+      bool is_inst = kind == '0' && line + 1 < end && data[line + 1] == ',';
+      // Instructions skipped by budget sampling leave gaps in inst_count.
+      // Indexed chunks never span a gap, so that their instructions are
+      // contiguous.
+      bool gap = is_inst && options.index && group_start > 0 &&
+                 inst_count_at(end) != context.inst_count + (int64_t)insts;
+      if ((is_entry || is_inst) && group_start > 0 &&
+          (group_start >= options.chunk_size || (is_entry && options.index) ||
+           gap)) {
+        line -= group_start;
+        end -= group_start;
+        cut(group_start, is_entry, job);
+        // The next chunk starts at the count of its first instruction.
+        if (is_inst)
+          context.inst_count = state.inst_count = inst_count_at(end);
+      }
+      records++;
+      if (kind == 't') {
+        timestamps++;
+        continue;
+      }
+      timestamps = 0;
+      group_start = std::string::npos;
+      if (is_inst) {
+        insts++;
+        last_inst = line;
+      } else if (is_entry) {
+        // A new top-level invocation starts with a fresh inst_count.
+        state.invocation++;
+        state.inst_count = 0;
+        state.function.clear();
+        state.basic_block.clear();
+        last_inst = std::string::npos;
+      }
+      if (job.data.size())
+        return true;
+    }
+    if (failed() || data.empty())
+      return false;
+    timestamps = 0;
+    cut(data.size(), false, job);
+    return true;
+  }
+
+  bool failed() const { return !error_str.empty(); }
+  const std::string &error() const { return error_str; }
+  uint64_t num_records() const { return total_records; }
+  uint64_t num_insts() const { return state.insts_before; }
+
+ private:
+  // The inst_count of the instruction line that ends at end, which is its
+  // last field.
+  int64_t inst_count_at(size_t end) {
+    return trace_parse_int(data.c_str() + data.rfind(',', end) + 1);
+  }
+
+  // Find the next line. Offsets are into data, which is refilled as needed.
+  bool next_line(size_t &line, size_t &end) {
+    while (true) {
+      const char *newline =
+          (const char *)memchr(data.data() + scan, '\n', data.size() - scan);
+      if (newline || (at_eof && scan < data.size())) {
+        line = scan;
+        end = newline ? newline - data.data() : data.size();
+        scan = newline ? end + 1 : end;
+        return true;
+      }
+      if (at_eof)
+        return false;
+      char buf[1 << 16];
+      long n = in->read(buf, sizeof(buf));
+      if (n < 0) {
+        error_str = "Failed to read the input trace.";
+        return false;
+      }
+      if (n == 0)
+        at_eof = true;
+      data.append(buf, n);
+    }
+  }
+
+  // Move data[0, size) into job, and start the next chunk, which starts
+  // with an entry if before_entry is set. The sequence numbers of the job are
+  // left to the caller.
+  void cut(size_t size, bool before_entry, transcode_job &job) {
+    job.data.assign(data, 0, size);
+    job.num_records = records - timestamps;
+    job.tag.thread_id = 0;
+    job.tag.flags = 0;
+    job.tag.num_insts = insts;
+    job.tag.context = context;
+
+    // The state after the chunk's last instruction, which is only parsed
+    // now, is the context of the next chunk.
+    if (last_inst != std::string::npos) {
+      trace_reader reader;
+      trace_record record;
+      size_t end = data.find('\n', last_inst);
+      if (end == std::string::npos || end > size)
+        end = size;
+      if (reader.open_buffer(data.data() + last_inst, end - last_inst) &&
+          reader.next(record) && record.kind == RECORD_INST) {
+        state.inst_count = record.inst_count + 1;
+        state.function = record.function.str();
+        state.basic_block = record.basic_block.str();
+      }
+    }
+    state.insts_before += insts;
+    // Top-level invocations end with a fresh inst_count.
+    if (before_entry) {
+      state.inst_count = 0;
+      state.function.clear();
+      state.basic_block.clear();
+    }
+    context = state;
+
+    job.entry.thread_id = 0;
+    job.entry.flags = 0;
+    job.entry.invocation = state.invocation;
+    job.entry.first_inst = job.tag.context.inst_count;
+    job.entry.end_inst = job.entry.first_inst + insts;
+
+    data.erase(0, size);
+    scan -= size;
+    total_records += job.num_records;
+    records = timestamps;
+    group_start = 0;
+    insts = 0;
+    last_inst = std::string::npos;
+  }
+
+  trace_input *in;
+  const transcode_options &options;
+  // Input that has not been split off yet. The current chunk starts at its
+  // beginning, and scan is where the next line starts.
+  std::string data;
+  size_t scan;
+  bool at_eof;
+  // Records and instructions in the current chunk, and where its last
+  // instruction is.
+  uint64_t records;
+  uint64_t insts;
+  size_t last_inst;
+  // Number of timestamp lines since the last other record, and where the
+  // blank and timestamp lines before the next record start.
+  uint64_t timestamps;
+  size_t group_start;
+  // The state of the trace as of the last chunk boundary or entry record,
+  // and the context at the start of the current chunk.
+  trace_chunk_context state;
+  trace_chunk_context context;
+  uint64_t total_records;
+  std::string error_str;
+};
+
+// The header of a binary trace with the given labelmap and strings.
+static void encode_binary_header(const std::string &labelmap,
+                                 const std::vector<std::string> &strings,
+                                 std::string &header) {
+  header.assign(TRACE_BINARY_MAGIC, TRACE_BINARY_MAGIC_SIZE);
+  append_field<uint32_t>(header, TRACE_BINARY_VERSION);
+  append_field<uint8_t>(header, TRACE_REC_LABELMAP);
+  append_string(header, labelmap);
+  append_field<uint8_t>(header, TRACE_REC_STRING_TABLE);
+  append_field<uint32_t>(header, strings.size());
+  for (size_t i = 0; i < strings.size(); i++)
+    append_string(header, strings[i]);
+}
+
+static trace_chunk_tag header_tag() {
+  trace_chunk_tag tag;
+  tag.thread_id = 0;
+  tag.flags = CHUNK_IS_HEADER;
+  tag.seq = 0;
+  tag.num_insts = 0;
+  tag.context.insts_before = 0;
+  tag.context.invocation = -1;
+  tag.context.inst_count = 0;
+  return tag;
+}
+
+static trace_index_entry header_entry(uint64_t size) {
+  trace_index_entry entry;
+  memset(&entry, 0, sizeof(entry));
+  entry.size = size;
+  entry.flags = CHUNK_IS_HEADER;
+  entry.invocation = -1;
+  return entry;
+}
+
+static bool write_index_entry(FILE *index, const trace_index_entry &entry) {
+  uint8_t buf[TRACE_INDEX_ENTRY_SIZE];
+  encode_index_entry(entry, buf);
+  return fwrite(buf, 1, sizeof(buf), index) == sizeof(buf);
+}
+
+// Reads the records of a binary trace written by this tool, which never
+// holds static records, and counts them.
+class binary_counter {
+ public:
+  binary_counter(trace_input *_in)
+      : in(_in), pos(0), end(0), error(false) {}
+
+  bool count(std::string &labelmap, uint64_t &num_records) {
+    char magic[TRACE_BINARY_MAGIC_SIZE];
+    uint32_t version, num_strings;
+    if (!read(magic, sizeof(magic)) ||
+        memcmp(magic, TRACE_BINARY_MAGIC, sizeof(magic)) != 0 ||
+        !read(&version, 4) || version != TRACE_BINARY_VERSION ||
+        field<uint8_t>() != TRACE_REC_LABELMAP ||
+        !skip(field<uint32_t>(), &labelmap) ||
+        field<uint8_t>() != TRACE_REC_STRING_TABLE ||
+        !read(&num_strings, 4))
+      return false;
+    for (uint32_t i = 0; i < num_strings; i++) {
+      if (!skip(field<uint32_t>()))
+        return false;
+    }
+    num_records = 0;
+    uint8_t tag;
+    while (read(&tag, 1)) {
+      size_t size;
+      switch (tag) {
+        case TRACE_REC_ENTRY: size = 8; break;
+        case TRACE_REC_INST: size = 28; break;
+        case TRACE_REC_TIMESTAMP: size = 8; break;
+        case TRACE_REC_SAMPLING: size = 40; break;
+        case TRACE_REC_WINDOW: size = 16; break;
+        case TRACE_REC_SIMPOINT: size = 16; break;
+        case TRACE_REC_ITERATION: size = 8; break;
+        case TRACE_REC_LOOP: size = 24; break;
+        case TRACE_REC_INT:
+        case TRACE_REC_PTR:
+        case TRACE_REC_DOUBLE:
+        case TRACE_REC_STRING:
+        case TRACE_REC_VECTOR: {
+          field<int32_t>();
+          int32_t bits = field<int32_t>();
+          size = tag == TRACE_REC_STRING ? 4
+                 : tag == TRACE_REC_VECTOR ? bits / 8 : 8;
+          if (!skip(size))
+            return false;
+          uint8_t flags = field<uint8_t>();
+          size = (flags & PARAM_IS_REG ? 4 : 0) + (flags & PARAM_IS_PHI ? 4 : 0);
+          break;
+        }
+        default:
+          return false;
+      }
+      if (!skip(size))
+        return false;
+      num_records++;
+    }
+    return !error;
+  }
+
+ private:
+  bool read(void *dst, size_t size) {
+    char *out = static_cast<char *>(dst);
+    while (size) {
+      if (pos == end) {
+        long n = in->read(buf, sizeof(buf));
+        if (n <= 0) {
+          error = n < 0;
+          return false;
+        }
+        pos = 0;
+        end = n;
+      }
+      size_t n = end - pos < size ? end - pos : size;
+      memcpy(out, buf + pos, n);
+      out += n;
+      pos += n;
+      size -= n;
+    }
+    return true;
+  }
+
+  // Skip size bytes, appending them to str if given.
+  bool skip(size_t size, std::string *str = nullptr) {
+    char chunk[4096];
+    while (size) {
+      size_t n = size < sizeof(chunk) ? size : sizeof(chunk);
+      if (!read(chunk, n)) {
+        error = true;
+        return false;
+      }
+      if (str)
+        str->append(chunk, n);
+      size -= n;
+    }
+    return true;
+  }
+
+  template <typename T> T field() {
+    T value = T();
+    if (!read(&value, sizeof(T)))
+      error = true;
+    return value;
+  }
+
+  trace_input *in;
+  char buf[1 << 16];
+  size_t pos;
+  size_t end;
+  bool error;
+};
+
+// Read the output back and check that it holds the expected labelmap and
+// number of records.
+static bool verify_output(const char *name, const transcode_options &options,
+                          const std::string &labelmap, uint64_t num_records) {
+  std::string out_labelmap;
+  uint64_t out_records = 0;
+  if (options.format == TRACE_FORMAT_BINARY) {
+    trace_input in;
+    binary_counter counter(&in);
+    if (!in.open(name) || !counter.count(out_labelmap, out_records)) {
+      fprintf(stderr, "Failed to read back the output trace.\n");
+      return false;
+    }
+  } else {
+    trace_reader reader;
+    trace_record record;
+    if (reader.open(name)) {
+      while (reader.next(record))
+        ;
+    }
+    if (reader.failed()) {
+      fprintf(stderr, "Failed to read back the output trace: %s\n",
+              reader.error().c_str());
+      return false;
+    }
+    out_labelmap = reader.labelmap();
+    out_records = reader.num_records();
+  }
+  if (out_labelmap != labelmap) {
+    fprintf(stderr, "The labelmap of the output trace does not match.\n");
+    return false;
+  }
+  if (out_records != num_records) {
+    fprintf(stderr,
+            "The output trace holds %" PRIu64
+            " records, but the input holds %" PRIu64 ".\n",
+            out_records, num_records);
+    return false;
+  }
+  return true;
+}
+
+// Append the contents of the file called name to out.
+static bool append_file(const char *name, FILE *out) {
+  FILE *in = fopen(name, "rb");
+  if (!in)
+    return false;
+  char buf[1 << 16];
+  size_t n;
+  bool ok = true;
+  while (ok && (n = fread(buf, 1, sizeof(buf), in)) > 0)
+    ok = fwrite(buf, 1, n, out) == n;
+  ok = ok && !ferror(in);
+  fclose(in);
+  return ok;
+}
+
+int main(int argc, char *argv[]) {
+  transcode_options options;
+  options.format = TRACE_FORMAT_TEXT;
+  parse_compression("zlib", options);
+  options.chunk_size = 4 * 1024 * 1024;
+  options.num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  options.index = false;
+  int arg = 1;
+  for (; arg < argc && argv[arg][0] == '-'; arg++) {
+    const char *flag = argv[arg];
+    if (strcmp(flag, "-i") == 0) {
+      options.index = true;
+      continue;
+    }
+    if (arg + 1 == argc || flag[1] == '\0' || flag[2] != '\0')
+      usage(argv[0]);
+    const char *value = argv[++arg];
+    switch (flag[1]) {
+      case 'f':
+        if (strcmp(value, "text") != 0 && strcmp(value, "binary") != 0)
+          usage(argv[0]);
+        options.format = parse_trace_format(value);
+        break;
+      case 'c':
+        parse_compression(value, options);
+        break;
+      case 'b':
+        options.chunk_size = parse_size(value);
+        break;
+      case 'j':
+        options.num_threads = atoi(value);
+        if (options.num_threads < 1) {
+          fprintf(stderr, "Invalid number of threads \"%s\".\n", value);
+          return 1;
+        }
+        break;
+      default:
+        usage(argv[0]);
+    }
+  }
+  if (argc - arg != 2)
+    usage(argv[0]);
+  const char *in_name = argv[arg];
+  const char *out_name = argv[arg + 1];
+  // In case the number of CPUs is unknown.
+  if (options.num_threads < 1)
+    options.num_threads = 1;
+
+  trace_input in;
+  if (!in.open(in_name)) {
+    perror("Failed to open input trace");
+    return 1;
+  }
+  // Binary chunks are written to a temporary file until the header is known.
+  bool binary = options.format == TRACE_FORMAT_BINARY;
+  std::string body_name = std::string(out_name) + (binary ? ".tmp" : "");
+  FILE *out = fopen(body_name.c_str(), "wb");
+  if (!out) {
+    perror("Failed to open output trace");
+    return 1;
+  }
+  std::string index_name = std::string(out_name) + ".idx";
+  std::string index_body_name = index_name + (binary ? ".tmp" : "");
+  FILE *index = nullptr;
+  if (options.index) {
+    index = fopen(index_body_name.c_str(), "wb");
+    // The header of a binary trace's index is written with the header's
+    // entry at the end.
+    std::string index_header;
+    encode_index_header(index_header);
+    if (!index ||
+        (!binary && fwrite(index_header.data(), 1, index_header.size(),
+                           index) != index_header.size())) {
+      perror("Failed to open the index");
+      return 1;
+    }
+  }
+
+  trace_splitter splitter(&in, options);
+  std::string header, labelmap;
+  if (!splitter.read_header(header, labelmap)) {
+    fprintf(stderr, "%s\n", splitter.error().c_str());
+    return 1;
+  }
+
+  transcoder coder(options, out, index);
+  coder.start();
+  // Position of the next chunk in the file (or the temporary file for binary
+  // traces), and its sequence number, which counts the header too.
+  uint64_t position = 0;
+  uint64_t seq = binary ? 1 : 0;
+  // Text traces start with a header chunk holding the labelmap, as they do
+  // when written by the runtime.
+  if (!binary && !header.empty()) {
+    transcode_job *job = new transcode_job();
+    job->position = position++;
+    job->data.swap(header);
+    job->tag = header_tag();
+    job->num_records = 0;
+    job->entry = header_entry(0);
+    coder.submit(job);
+    seq++;
+  }
+  while (true) {
+    transcode_job *job = new transcode_job();
+    if (!splitter.next_chunk(*job)) {
+      delete job;
+      break;
+    }
+    job->position = position++;
+    job->tag.seq = job->entry.seq = seq++;
+    coder.submit(job);
+  }
+  bool ok = coder.finish();
+  if (!ok)
+    fprintf(stderr, "%s\n", coder.error().c_str());
+  if (splitter.failed()) {
+    fprintf(stderr, "%s\n", splitter.error().c_str());
+    ok = false;
+  }
+  in.close();
+  ok = fclose(out) == 0 && ok;
+  if (index)
+    ok = fclose(index) == 0 && ok;
+
+  if (ok && binary) {
+    // Write the header, then the chunks after it, and shift the index by
+    // the size of the header.
+    std::string data, frame;
+    encode_binary_header(labelmap, coder.strings.all(), data);
+    options.codec->compress(data.data(), data.size(), options.level,
+                            header_tag(), frame);
+    out = fopen(out_name, "wb");
+    ok = out && fwrite(frame.data(), 1, frame.size(), out) == frame.size() &&
+         append_file(body_name.c_str(), out);
+    ok = out && fclose(out) == 0 && ok;
+    if (ok && options.index) {
+      FILE *index_body = fopen(index_body_name.c_str(), "rb");
+      index = fopen(index_name.c_str(), "wb");
+      encode_index_header(data);
+      ok = index_body && index &&
+           fwrite(data.data(), 1, data.size(), index) == data.size() &&
+           write_index_entry(index, header_entry(frame.size()));
+      uint8_t buf[TRACE_INDEX_ENTRY_SIZE];
+      while (ok && fread(buf, 1, sizeof(buf), index_body) == sizeof(buf)) {
+        trace_index_entry entry;
+        decode_index_entry(buf, entry);
+        entry.offset += frame.size();
+        ok = write_index_entry(index, entry);
+      }
+      if (index_body)
+        fclose(index_body);
+      ok = index && fclose(index) == 0 && ok;
+      unlink(index_body_name.c_str());
+    }
+    unlink(body_name.c_str());
+    if (!ok)
+      perror("Failed to write output trace");
+  }
+  if (!ok)
+    return 1;
+
+  if (!verify_output(out_name, options, labelmap, splitter.num_records()))
+    return 1;
+  printf("%s: %" PRIu64 " records, %" PRIu64 " instructions in %" PRIu64
+         " chunks.\n",
+         out_name, splitter.num_records(), splitter.num_insts(), seq);
+  return 0;
+}